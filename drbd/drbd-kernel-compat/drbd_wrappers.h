@@ -89,6 +89,19 @@ static inline void blk_queue_write_cache(struct request_queue *q, bool enabled,
 }
 #endif
 
+/* Does the queue either do FUA natively, or has no volatile write cache? */
+static inline bool queue_fua_or_no_write_cache(struct request_queue *q)
+{
+#ifdef COMPAT_HAVE_BLK_QUEUE_WRITE_CACHE
+	return blk_queue_fua(q) || !test_bit(QUEUE_FLAG_WC, &q->queue_flags);
+#elif defined(REQ_FLUSH) && !defined(REQ_HARDBARRIER)
+/* Linux version 2.6.37 up to 4.7 keep that in q->flush_flags */
+	return (q->flush_flags & REQ_FUA) || !(q->flush_flags & REQ_FLUSH);
+#else
+	return false;
+#endif
+}
+
 #ifndef KREF_INIT
 #define KREF_INIT(N) { ATOMIC_INIT(N) }
 #endif
@@ -1438,6 +1438,33 @@ void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 	spin_unlock_irqrestore(&device->al_lock, flags);
 }
 
+/**
+ * drbd_rs_more_io() - Take one more reference on a resync extent in use
+ * @peer_device: DRBD peer device.
+ * @sector:	The sector number.
+ *
+ * The answer to a batched P_CSUM_RS_REQUEST consists of several packets,
+ * each of which gets released with drbd_rs_complete_io().
+ */
+void drbd_rs_more_io(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	struct drbd_device *device = peer_device->device;
+	unsigned int enr = BM_SECT_TO_EXT(sector);
+	struct lc_element *e;
+	unsigned long flags;
+	bool in_use;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	e = lc_find(peer_device->resync_lru, enr);
+	in_use = e && e->refcnt;
+	if (in_use)
+		e->refcnt++;
+	spin_unlock_irqrestore(&device->al_lock, flags);
+
+	if (!in_use && drbd_ratelimit())
+		drbd_err(device, "drbd_rs_more_io() called, but extent not in use\n");
+}
+
 /**
  * drbd_rs_cancel_all() - Removes all extents from the resync LRU (even BME_LOCKED)
  */
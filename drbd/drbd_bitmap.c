@@ -1458,6 +1458,22 @@ unsigned long drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned l
 		     BM_OP_FIND_BIT, NULL);
 }
 
+/* Returns the first set bit in [start, end], or DRBD_END_OF_BITMAP */
+unsigned long drbd_bm_range_find_next(struct drbd_peer_device *peer_device,
+				      unsigned long start, unsigned long end)
+{
+	return bm_op(peer_device->device, peer_device->bitmap_index, start, end,
+		     BM_OP_FIND_BIT, NULL);
+}
+
+/* Returns the first clear bit in [start, end], or DRBD_END_OF_BITMAP */
+unsigned long drbd_bm_range_find_next_zero(struct drbd_peer_device *peer_device,
+					   unsigned long start, unsigned long end)
+{
+	return bm_op(peer_device->device, peer_device->bitmap_index, start, end,
+		     BM_OP_FIND_ZERO_BIT, NULL);
+}
+
 /* does not spin_lock_irqsave.
  * you must take drbd_bm_lock() first */
 unsigned long _drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned long start)
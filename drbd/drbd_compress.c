@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_compress.c
+
+   This file is part of DRBD.
+
+   Optional compression of the payload of P_DATA and P_RS_DATA_REPLY
+   packets. Each side announces the codecs it can decompress as feature
+   flags, and compresses with the codec named in the "compress" module
+   parameter if the peer can decompress it. A compressed packet carries
+   the codec and the uncompressed size in its dp_flags; the digest of
+   data-integrity-alg covers the uncompressed data.
+*/
+
+#include <linux/crypto.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/clock.h>
+#include "drbd_int.h"
+
+/* Do not bother with anything smaller */
+#define DRBD_COMPRESS_MIN_SIZE 4096
+/* After a payload did not compress, skip up to that many before trying again */
+#define DRBD_COMPRESS_MAX_BACKOFF 64
+
+static const struct drbd_compress_codec {
+	const char *name;
+	u32 feature;
+	u32 dp_flag;
+} drbd_compress_codecs[DRBD_COMPRESS_CODECS] = {
+	{ "lz4", DRBD_FF_COMPRESS_LZ4, DP_COMPRESS_LZ4 },
+	{ "zstd", DRBD_FF_COMPRESS_ZSTD, DP_COMPRESS_ZSTD },
+};
+
+/* The codecs we can decompress, as feature flags */
+u32 drbd_compress_features(void)
+{
+	u32 features = 0;
+	int i;
+
+	for (i = 0; i < DRBD_COMPRESS_CODECS; i++) {
+		if (crypto_has_comp(drbd_compress_codecs[i].name, 0, 0))
+			features |= drbd_compress_codecs[i].feature;
+	}
+
+	return features;
+}
+
+static void free_sending_side(struct drbd_compress *c)
+{
+	if (c->tfm)
+		crypto_free_comp(c->tfm);
+	c->tfm = NULL;
+	c->codec = NULL;
+	kvfree(c->raw);
+	c->raw = NULL;
+	kvfree(c->out);
+	c->out = NULL;
+}
+
+static void free_receiving_side(struct drbd_compress *c)
+{
+	int i;
+
+	for (i = 0; i < DRBD_COMPRESS_CODECS; i++) {
+		if (c->peer_tfm[i])
+			crypto_free_comp(c->peer_tfm[i]);
+		c->peer_tfm[i] = NULL;
+	}
+	kvfree(c->peer_in);
+	c->peer_in = NULL;
+	kvfree(c->peer_out);
+	c->peer_out = NULL;
+}
+
+void drbd_compress_free(struct drbd_connection *connection)
+{
+	free_sending_side(&connection->compress);
+	free_receiving_side(&connection->compress);
+}
+
+/* Called from drbd_do_features() after the feature flags are agreed on,
+ * with connection->mutex[DATA_STREAM] held. */
+void drbd_compress_setup(struct drbd_connection *connection)
+{
+	struct drbd_compress *c = &connection->compress;
+	const struct drbd_compress_codec *codec = NULL;
+	char alg[DRBD_COMPRESS_ALG_LEN];
+	int i;
+
+	free_sending_side(c);
+	free_receiving_side(c);
+	c->backoff = 0;
+	c->skip = 0;
+
+	strscpy(alg, drbd_compress_alg, sizeof(alg));
+	if (!alg[0])
+		return;
+
+	for (i = 0; i < DRBD_COMPRESS_CODECS; i++) {
+		if (!strcmp(alg, drbd_compress_codecs[i].name))
+			codec = &drbd_compress_codecs[i];
+	}
+	if (!codec) {
+		drbd_warn(connection, "Unknown compression algorithm \"%s\"\n", alg);
+		return;
+	}
+	if (!(connection->agreed_features & codec->feature)) {
+		drbd_info(connection, "Peer can not decompress %s, sending uncompressed\n", alg);
+		return;
+	}
+
+	c->tfm = crypto_alloc_comp(codec->name, 0, 0);
+	if (IS_ERR(c->tfm)) {
+		drbd_err(connection, "Can not allocate \"%s\" compression, err %ld\n",
+			 alg, PTR_ERR(c->tfm));
+		c->tfm = NULL;
+		return;
+	}
+	c->raw = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	c->out = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!c->raw || !c->out) {
+		drbd_err(connection, "Can not allocate compression buffers\n");
+		free_sending_side(c);
+		return;
+	}
+	c->codec = codec;
+	drbd_info(connection, "Compressing data with %s\n", alg);
+}
+
+/* Compress c->raw into c->out. Returns the compressed size,
+ * or 0 if it would not save enough to be worth it. */
+static unsigned int compress_raw(struct drbd_connection *connection, unsigned int size, u32 *dp_flags)
+{
+	struct drbd_compress *c = &connection->compress;
+	/* Require at least 1/8 to be saved */
+	unsigned int out_len = size - size / 8;
+	u64 start = local_clock();
+	int err;
+
+	err = crypto_comp_compress(c->tfm, c->raw, size, c->out, &out_len);
+	c->cpu_ns += local_clock() - start;
+
+	if (err || out_len >= size - size / 8) {
+		c->incompressible++;
+		c->backoff = clamp(c->backoff * 2, 1U, (unsigned int)DRBD_COMPRESS_MAX_BACKOFF);
+		c->skip = c->backoff;
+		return 0;
+	}
+
+	c->backoff = 0;
+	c->raw_bytes += size;
+	c->wire_bytes += out_len;
+	*dp_flags |= c->codec->dp_flag | (size >> 9) << DP_RAW_SECTORS_SHIFT;
+	return out_len;
+}
+
+static bool want_compress(struct drbd_connection *connection, unsigned int size)
+{
+	struct drbd_compress *c = &connection->compress;
+
+	if (!c->codec || size < DRBD_COMPRESS_MIN_SIZE || size > DRBD_MAX_BIO_SIZE)
+		return false;
+	if (c->skip) {
+		c->skip--;
+		c->skipped++;
+		return false;
+	}
+	return true;
+}
+
+/* Called with connection->mutex[DATA_STREAM] held.
+ * Returns the size of the compressed payload in connection->compress.out,
+ * or 0 if the payload should be sent as it is. */
+unsigned int drbd_compress_bio(struct drbd_connection *connection, struct bio *bio, u32 *dp_flags)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int size = bio->bi_iter.bi_size;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	void *pos;
+
+	if (!want_compress(connection, size))
+		return 0;
+
+	pos = c->raw;
+	bio_for_each_segment(bvec, bio, iter) {
+		void *from = kmap_atomic(bvec.bv_page);
+		memcpy(pos, from + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(from);
+		pos += bvec.bv_len;
+	}
+
+	return compress_raw(connection, size, dp_flags);
+}
+
+/* Digest of the size bytes drbd_compress_bio() compressed last, which is
+ * what the peer ends up with after decompression */
+void drbd_compress_csum_raw(struct drbd_connection *connection, struct crypto_shash *tfm,
+			    unsigned int size, void *digest)
+{
+	SHASH_DESC_ON_STACK(desc, tfm);
+
+	desc->tfm = tfm;
+	crypto_shash_digest(desc, connection->compress.raw, size, digest);
+	shash_desc_zero(desc);
+}
+
+/* Same as drbd_compress_bio(), for the page chain of a peer request */
+unsigned int drbd_compress_pages(struct drbd_connection *connection, struct page *page,
+				 unsigned int size, u32 *dp_flags)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int len = size;
+	void *pos;
+
+	if (!want_compress(connection, size))
+		return 0;
+
+	pos = c->raw;
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		void *from = kmap_atomic(page);
+		memcpy(pos, from + page_chain_offset(page), l);
+		kunmap_atomic(from);
+		pos += l;
+		len -= l;
+		if (!len)
+			break;
+	}
+
+	return compress_raw(connection, size, dp_flags);
+}
+
+static const struct drbd_compress_codec *codec_from_dp_flags(u32 dp_flags)
+{
+	int i;
+
+	for (i = 0; i < DRBD_COMPRESS_CODECS; i++) {
+		if (dp_flags & drbd_compress_codecs[i].dp_flag)
+			return &drbd_compress_codecs[i];
+	}
+	return NULL;
+}
+
+/* Receiver thread only. Returns the buffer to receive in_len bytes of
+ * compressed payload into, allocating things on first use. */
+void *drbd_decompress_buffer(struct drbd_connection *connection, u32 dp_flags, unsigned int in_len)
+{
+	struct drbd_compress *c = &connection->compress;
+	const struct drbd_compress_codec *codec = codec_from_dp_flags(dp_flags);
+	unsigned int noio_flag;
+	int i;
+
+	if (!codec || !(connection->agreed_features & codec->feature) || in_len > DRBD_MAX_BIO_SIZE) {
+		drbd_err(connection, "Unexpected compressed payload, dp_flags 0x%x, size %u\n",
+			 dp_flags, in_len);
+		return NULL;
+	}
+	i = codec - drbd_compress_codecs;
+	if (c->peer_tfm[i] && c->peer_in)
+		return c->peer_in;
+
+	/* We might be needed to make progress on memory reclaim */
+	noio_flag = memalloc_noio_save();
+	if (!c->peer_in)
+		c->peer_in = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!c->peer_out)
+		c->peer_out = kvmalloc(DRBD_MAX_BIO_SIZE, GFP_KERNEL);
+	if (!c->peer_tfm[i]) {
+		struct crypto_comp *tfm = crypto_alloc_comp(codec->name, 0, 0);
+		c->peer_tfm[i] = IS_ERR(tfm) ? NULL : tfm;
+	}
+	memalloc_noio_restore(noio_flag);
+
+	if (!c->peer_in || !c->peer_out || !c->peer_tfm[i]) {
+		drbd_err(connection, "Can not set up %s decompression\n", codec->name);
+		return NULL;
+	}
+	return c->peer_in;
+}
+
+/* Decompress in_len bytes in connection->compress.peer_in into
+ * connection->compress.peer_out, which has to result in exactly out_len bytes. */
+int drbd_decompress(struct drbd_connection *connection, u32 dp_flags,
+		    unsigned int in_len, unsigned int out_len)
+{
+	struct drbd_compress *c = &connection->compress;
+	const struct drbd_compress_codec *codec = codec_from_dp_flags(dp_flags);
+	unsigned int len = DRBD_MAX_BIO_SIZE;
+	u64 start = local_clock();
+	int err;
+
+	err = crypto_comp_decompress(c->peer_tfm[codec - drbd_compress_codecs],
+				     c->peer_in, in_len, c->peer_out, &len);
+	c->peer_cpu_ns += local_clock() - start;
+	if (err || len != out_len) {
+		drbd_err(connection, "Decompression failed, err %d, %u of %u bytes\n",
+			 err, len, out_len);
+		return -EIO;
+	}
+	c->peer_raw_bytes += out_len;
+	c->peer_wire_bytes += in_len;
+	return 0;
+}
@@ -24,6 +24,7 @@ static struct dentry *drbd_debugfs_refcounts;
 static struct dentry *drbd_debugfs_resources;
 static struct dentry *drbd_debugfs_minors;
 static struct dentry *drbd_debugfs_compat;
+static struct dentry *drbd_debugfs_page_pools;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 static void seq_print_age_or_dash(struct seq_file *m, bool valid, ktime_t dt)
@@ -96,6 +97,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 		seq_print_rq_state_bit(m, s & RQ_EXP_RECEIVE_ACK, &sep, "B");
 		seq_print_rq_state_bit(m, s & RQ_EXP_WRITE_ACK, &sep, "C");
 		seq_print_rq_state_bit(m, s & RQ_EXP_BARR_ACK, &sep, "barr");
+		seq_print_rq_state_bit(m, s & RQ_EXP_SEND_DONE, &sep, "zc");
 		if (sep == ' ')
 			seq_puts(m, " -");
 	}
@@ -808,6 +810,80 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static void seq_print_compression(struct seq_file *m, const char *what,
+				  u64 raw, u64 wire, u64 cpu_ns)
+{
+	u64 ratio, rem;
+
+	seq_printf(m, "%s: %llu bytes as %llu bytes", what,
+		   (unsigned long long)raw, (unsigned long long)wire);
+	if (wire) {
+		ratio = div64_u64_rem(raw, wire, &rem);
+		seq_printf(m, ", ratio %llu.%02llu", (unsigned long long)ratio,
+			   (unsigned long long)div64_u64(rem * 100, wire));
+	}
+	seq_printf(m, ", cpu %llu ms\n", (unsigned long long)div_u64(cpu_ns, NSEC_PER_MSEC));
+}
+
+static int connection_compression_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_compress *c = &connection->compress;
+	struct drbd_dedup *d = &connection->dedup;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 1);
+
+	seq_print_compression(m, "compressed", c->raw_bytes, c->wire_bytes, c->cpu_ns);
+	seq_printf(m, "incompressible: %llu\nskipped: %llu\n",
+		   (unsigned long long)c->incompressible, (unsigned long long)c->skipped);
+	seq_print_compression(m, "decompressed", c->peer_raw_bytes, c->peer_wire_bytes,
+			      c->peer_cpu_ns);
+	seq_printf(m, "resync dedup: sent %llu references\n", (unsigned long long)d->hits);
+	seq_printf(m, "resync dedup: received %llu references, %llu missed\n",
+		   (unsigned long long)d->peer_hits, (unsigned long long)d->peer_misses);
+	return 0;
+}
+
+static int connection_page_credits_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	unsigned int mxb;
+	int in_use;
+
+	rcu_read_lock();
+	mxb = rcu_dereference(connection->transport.net_conf)->max_buffers;
+	rcu_read_unlock();
+	in_use = atomic_read(&connection->pp_in_use);
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "max_buffers: %u\n", mxb);
+	seq_printf(m, "in_use: %d\n", in_use);
+	seq_printf(m, "in_use_by_net: %d\n", atomic_read(&connection->pp_in_use_by_net));
+	seq_printf(m, "credits: %d\n", (int)mxb - in_use);
+	seq_printf(m, "waits: %llu\n", (unsigned long long)connection->pp_stats.waits);
+	seq_printf(m, "memory waits: %llu\n", (unsigned long long)connection->pp_stats.mem_waits);
+	seq_printf(m, "overrides: %llu\n", (unsigned long long)connection->pp_stats.overrides);
+	seq_printf(m, "wait time: %llu us\n",
+		   (unsigned long long)div_u64(connection->pp_stats.wait_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static int connection_peer_acks_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "latency bound: %u us\n", READ_ONCE(drbd_peer_ack_latency_us));
+	seq_printf(m, "sent: %llu\n", (unsigned long long)connection->peer_ack_stats.sent);
+	seq_printf(m, "merged: %llu\n", (unsigned long long)connection->peer_ack_stats.merged);
+	return 0;
+}
+
 static int connection_debug_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_connection *connection = m->private;
@@ -898,6 +974,9 @@ drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
 drbd_debugfs_connection_attr(transport)
 drbd_debugfs_connection_attr(debug)
+drbd_debugfs_connection_attr(compression)
+drbd_debugfs_connection_attr(page_credits)
+drbd_debugfs_connection_attr(peer_acks)
 
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
@@ -919,6 +998,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(oldest_requests);
 	conn_dcf(transport);
 	conn_dcf(debug);
+	conn_dcf(compression);
+	conn_dcf(page_credits);
+	conn_dcf(peer_acks);
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		if (!peer_device->debugfs_peer_dev)
@@ -928,6 +1010,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 
 void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
+	drbd_debugfs_remove(&connection->debugfs_conn_peer_acks);
+	drbd_debugfs_remove(&connection->debugfs_conn_page_credits);
+	drbd_debugfs_remove(&connection->debugfs_conn_compression);
 	drbd_debugfs_remove(&connection->debugfs_conn_debug);
 	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
@@ -1048,6 +1133,29 @@ static int device_md_io_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_flushes_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_flush_agg *fa = &device->flush;
+	u64 requested, submitted;
+	bool in_flight, follow_up;
+
+	spin_lock_irq(&fa->lock);
+	requested = fa->requested;
+	submitted = fa->submitted;
+	in_flight = fa->in_flight;
+	follow_up = fa->follow_up;
+	spin_unlock_irq(&fa->lock);
+
+	seq_printf(m, "requested: %llu\n", requested);
+	seq_printf(m, "submitted: %llu\n", submitted);
+	seq_printf(m, "saved: %llu\n", requested - submitted);
+	seq_printf(m, "in flight: %d\n", in_flight);
+	seq_printf(m, "follow up: %d\n", follow_up);
+
+	return 0;
+}
+
 static int device_data_gen_id_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1224,6 +1332,7 @@ drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
+drbd_debugfs_device_attr(flushes)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
 #endif
@@ -1263,6 +1372,7 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
+	vol_dcf(flushes);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
 #endif
@@ -1291,6 +1401,7 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
+	drbd_debugfs_remove(&device->debugfs_vol_flushes);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
 #endif
@@ -1631,7 +1742,60 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
-#define drbd_debugfs_peer_device_attr(name)					\
+#ifdef CONFIG_DRBD_TIMING_STATS
+static int peer_device_ack_latency_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+	struct drbd_device *device = peer_device->device;
+	unsigned int hist[DRBD_ACK_LATENCY_BUCKETS];
+	unsigned int i, max = 0;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	spin_lock_irq(&device->timing_lock);
+	memcpy(hist, peer_device->ack_latency_hist, sizeof(hist));
+	spin_unlock_irq(&device->timing_lock);
+
+	seq_puts(m, "write latency, sent to acked, in microseconds; write an 'r' to reset\n");
+	for (i = 0; i < DRBD_ACK_LATENCY_BUCKETS; i++)
+		max = max(max, hist[i]);
+	if (!max)
+		return 0;
+
+	for (i = 0; i < DRBD_ACK_LATENCY_BUCKETS; i++) {
+		unsigned v = (hist[i] * 60UL + max-1) / max;
+		seq_printf(m, "%s%8u : %10u : %-60.*s\n",
+			   i == DRBD_ACK_LATENCY_BUCKETS - 1 ? ">=" : "< ",
+			   i == DRBD_ACK_LATENCY_BUCKETS - 1 ? 1U << (i - 1) : 1U << i,
+			   hist[i], v,
+			   "############################################################");
+	}
+	return 0;
+}
+
+static ssize_t peer_device_ack_latency_write(struct file *file, const char __user *ubuf,
+					     size_t cnt, loff_t *ppos)
+{
+	struct drbd_peer_device *peer_device = file_inode(file)->i_private;
+	struct drbd_device *device = peer_device->device;
+	char buffer;
+
+	if (copy_from_user(&buffer, ubuf, 1))
+		return -EFAULT;
+
+	if (buffer == 'r' || buffer == 'R') {
+		spin_lock_irq(&device->timing_lock);
+		memset(peer_device->ack_latency_hist, 0, sizeof(peer_device->ack_latency_hist));
+		spin_unlock_irq(&device->timing_lock);
+	}
+
+	*ppos += cnt;
+	return cnt;
+}
+#endif
+
+#define __drbd_debugfs_peer_device_attr(name, write_fn)				\
 static int peer_device_ ## name ## _open(struct inode *inode, struct file *file)\
 {										\
 	struct drbd_peer_device *peer_device = inode->i_private;		\
@@ -1649,13 +1813,18 @@ static int peer_device_ ## name ## _release(struct inode *inode, struct file *fi
 static const struct file_operations peer_device_ ## name ## _fops = {		\
 	.owner		= THIS_MODULE,						\
 	.open		= peer_device_ ## name ## _open,			\
+	.write		= write_fn,						\
 	.read		= seq_read,						\
 	.llseek		= seq_lseek,						\
 	.release	= peer_device_ ## name ## _release,			\
 };
+#define drbd_debugfs_peer_device_attr(name) __drbd_debugfs_peer_device_attr(name, NULL)
 
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+#ifdef CONFIG_DRBD_TIMING_STATS
+__drbd_debugfs_peer_device_attr(ack_latency, peer_device_ack_latency_write)
+#endif
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1670,10 +1839,16 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+#ifdef CONFIG_DRBD_TIMING_STATS
+	drbd_dcf(peer_device->debugfs_peer_dev, peer_device, ack_latency, 0600);
+#endif
 }
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+#ifdef CONFIG_DRBD_TIMING_STATS
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_ack_latency);
+#endif
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
@@ -1723,6 +1898,42 @@ static const struct file_operations drbd_refcounts_fops = {
 	.release = single_release,
 };
 
+static int drbd_page_pools_show(struct seq_file *m, void *ignored)
+{
+	int node;
+
+	if (!drbd_page_pools)
+		return 0;
+
+	seq_puts(m, "node\tvacant\tfrom_pool\tfrom_system\tfrom_blocks\tfrom_remote\tto_pool\tto_system\n");
+	for_each_online_node(node) {
+		struct drbd_page_pool *pool = &drbd_page_pools[node];
+
+		seq_printf(m, "%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n",
+			   node, READ_ONCE(pool->vacant),
+			   atomic_long_read(&pool->from_pool),
+			   atomic_long_read(&pool->from_system),
+			   atomic_long_read(&pool->from_blocks),
+			   atomic_long_read(&pool->from_remote),
+			   atomic_long_read(&pool->to_pool),
+			   atomic_long_read(&pool->to_system));
+	}
+	return 0;
+}
+
+static int drbd_page_pools_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_page_pools_show, NULL);
+}
+
+static const struct file_operations drbd_page_pools_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_page_pools_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
 static int drbd_compat_show(struct seq_file *m, void *ignored)
 {
 	return 0;
@@ -1745,6 +1956,7 @@ static const struct file_operations drbd_compat_fops = {
  * from the module-load-failure path as well. */
 void drbd_debugfs_cleanup(void)
 {
+	drbd_debugfs_remove(&drbd_debugfs_page_pools);
 	drbd_debugfs_remove(&drbd_debugfs_compat);
 	drbd_debugfs_remove(&drbd_debugfs_resources);
 	drbd_debugfs_remove(&drbd_debugfs_minors);
@@ -1774,4 +1986,7 @@ void __init drbd_debugfs_init(void)
 
 	dentry = debugfs_create_file("compat", 0444, drbd_debugfs_root, NULL, &drbd_compat_fops);
 	drbd_debugfs_compat = dentry;
+
+	dentry = debugfs_create_file("page_pools", 0444, drbd_debugfs_root, NULL, &drbd_page_pools_fops);
+	drbd_debugfs_page_pools = dentry;
 }
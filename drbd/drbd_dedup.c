@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_dedup.c
+
+   This file is part of DRBD.
+
+   Deduplication of streamed resync data, see send_rs_push_sparse().
+   Both sides keep the last DRBD_DEDUP_SLOTS BM_BLOCK_SIZE chunks of
+   P_RS_DATA_REPLY packets flagged DP_RS_DEDUP_STORE in a dictionary,
+   numbered in the order they were sent. A chunk equal to one still in the
+   dictionary is sent as a DP_RS_DEDUP_REF packet that only carries its
+   number. Each slot remembers the number of the chunk it holds, so a
+   reference to a chunk the receiving side does not have fails cleanly.
+*/
+
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/xxhash.h>
+#include <linux/sched/mm.h>
+#include "drbd_int.h"
+
+struct drbd_dedup_dict {
+	u32 next;			/* number of the next chunk stored */
+	u32 pos[DRBD_DEDUP_SLOTS];	/* number of the chunk in each slot */
+	struct {
+		u64 hash;
+		u32 pos;
+	} index[DRBD_DEDUP_SLOTS];	/* sending side only */
+	u8 data[DRBD_DEDUP_SLOTS][BM_BLOCK_SIZE];
+};
+
+/* Call within memalloc_noio_save(). kvmalloc() only falls back to vmalloc
+ * with GFP_KERNEL, and the dictionary is too large for kmalloc to be
+ * reliable. */
+static struct drbd_dedup_dict *alloc_dict(void)
+{
+	struct drbd_dedup_dict *dict;
+	int i;
+
+	dict = kvmalloc(sizeof(*dict), GFP_KERNEL);
+	if (!dict)
+		return NULL;
+	dict->next = 0;
+	/* No chunk number maps to its own slot that way */
+	for (i = 0; i < DRBD_DEDUP_SLOTS; i++) {
+		dict->pos[i] = i + 1;
+		dict->index[i].hash = 0;
+		dict->index[i].pos = i + 1;
+	}
+	return dict;
+}
+
+void drbd_dedup_free(struct drbd_connection *connection)
+{
+	struct drbd_dedup *d = &connection->dedup;
+
+	kvfree(d->dict);
+	d->dict = NULL;
+	kvfree(d->peer_dict);
+	d->peer_dict = NULL;
+}
+
+/* Called from drbd_do_features(), both dictionaries start empty with each connection */
+void drbd_dedup_setup(struct drbd_connection *connection)
+{
+	drbd_dedup_free(connection);
+}
+
+/* Sender thread only. Returns whether the chunks of streamed resync
+ * data should go through drbd_dedup_chunk(). */
+bool drbd_dedup_prepare(struct drbd_connection *connection)
+{
+	struct drbd_dedup *d = &connection->dedup;
+
+	if (!READ_ONCE(drbd_resync_dedup) ||
+	    !(connection->agreed_features & DRBD_FF_RS_DEDUP))
+		return false;
+	if (!d->dict) {
+		/* We might be needed to make progress on memory reclaim */
+		unsigned int noio_flag = memalloc_noio_save();
+		d->dict = alloc_dict();
+		memalloc_noio_restore(noio_flag);
+	}
+	return d->dict != NULL;
+}
+
+/* Sender thread only, after drbd_dedup_prepare(). Returns true if an equal
+ * chunk is in the dictionary, with its number in *pos. Otherwise stores
+ * the chunk, which the caller has to send with DP_RS_DEDUP_STORE. */
+bool drbd_dedup_chunk(struct drbd_connection *connection, const void *chunk, u32 *pos)
+{
+	struct drbd_dedup *d = &connection->dedup;
+	struct drbd_dedup_dict *dict = d->dict;
+	u64 hash = xxh64(chunk, BM_BLOCK_SIZE, 0);
+	unsigned int i = hash % DRBD_DEDUP_SLOTS;
+	u32 old = dict->index[i].pos;
+	unsigned int slot = old % DRBD_DEDUP_SLOTS;
+
+	if (dict->index[i].hash == hash && dict->pos[slot] == old &&
+	    !memcmp(dict->data[slot], chunk, BM_BLOCK_SIZE)) {
+		d->hits++;
+		*pos = old;
+		return true;
+	}
+
+	*pos = dict->next++;
+	slot = *pos % DRBD_DEDUP_SLOTS;
+	memcpy(dict->data[slot], chunk, BM_BLOCK_SIZE);
+	dict->pos[slot] = *pos;
+	dict->index[i].hash = hash;
+	dict->index[i].pos = *pos;
+	return false;
+}
+
+/* Receiver thread only. Stores the full chunks of a DP_RS_DEDUP_STORE packet,
+ * the first one as number pos. */
+void drbd_dedup_store(struct drbd_connection *connection, struct drbd_peer_request *peer_req, u32 pos)
+{
+	struct drbd_dedup *d = &connection->dedup;
+	struct page *page = peer_req->page_chain.head;
+	unsigned int chunks = peer_req->i.size / BM_BLOCK_SIZE;
+	unsigned int offset = 0;
+
+	if (!d->peer_dict) {
+		/* We might be needed to make progress on memory reclaim */
+		unsigned int noio_flag = memalloc_noio_save();
+		d->peer_dict = alloc_dict();
+		memalloc_noio_restore(noio_flag);
+		if (!d->peer_dict)
+			return;
+	}
+
+	page_chain_for_each(page) {
+		void *data;
+
+		if (!chunks)
+			break;
+		data = kmap_atomic(page);
+		for (offset = 0; offset < PAGE_SIZE && chunks; offset += BM_BLOCK_SIZE) {
+			unsigned int slot = pos % DRBD_DEDUP_SLOTS;
+
+			memcpy(d->peer_dict->data[slot], data + offset, BM_BLOCK_SIZE);
+			d->peer_dict->pos[slot] = pos++;
+			chunks--;
+		}
+		kunmap_atomic(data);
+	}
+}
+
+/* Receiver thread only. Fills the data of a DP_RS_DEDUP_REF packet into
+ * peer_req; fails with -ENOENT if we do not have that chunk. */
+int drbd_dedup_fill(struct drbd_connection *connection, struct drbd_peer_request *peer_req, u32 pos)
+{
+	struct drbd_dedup *d = &connection->dedup;
+	unsigned int slot = pos % DRBD_DEDUP_SLOTS;
+	struct page *page;
+	void *data;
+
+	if (!d->peer_dict || d->peer_dict->pos[slot] != pos || peer_req->i.size != BM_BLOCK_SIZE) {
+		d->peer_misses++;
+		return -ENOENT;
+	}
+
+	drbd_alloc_page_chain(&connection->transport, &peer_req->page_chain,
+			      DIV_ROUND_UP(BM_BLOCK_SIZE, PAGE_SIZE), GFP_TRY);
+	page = peer_req->page_chain.head;
+	if (!page)
+		return -ENOMEM;
+
+	data = kmap_atomic(page);
+	memcpy(data, d->peer_dict->data[slot], BM_BLOCK_SIZE);
+	kunmap_atomic(data);
+	set_page_chain_offset(page, 0);
+	set_page_chain_size(page, BM_BLOCK_SIZE);
+	d->peer_hits++;
+	return 0;
+}
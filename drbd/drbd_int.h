@@ -41,8 +41,10 @@
 #include "compat.h"
 #include "drbd_state.h"
 #include "drbd_protocol.h"
+#include "drbd_protocol_ext.h"
 #include "drbd_kref_debug.h"
 #include "drbd_transport.h"
+#include "drbd_transport_ext.h"
 #include "drbd_polymorph_printk.h"
 
 #ifdef __CHECKER__
@@ -60,6 +62,23 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_zerocopy_send_done;
+extern unsigned int drbd_ack_busy_poll_us;
+#define DRBD_COMPRESS_ALG_LEN 16
+extern char drbd_compress_alg[DRBD_COMPRESS_ALG_LEN];
+extern bool drbd_csums_batch;
+extern unsigned int drbd_verify_tree_kb;
+extern bool drbd_csum_offload;
+extern unsigned int drbd_resync_request_kb;
+extern unsigned int drbd_resync_push_kb;
+extern bool drbd_resync_dedup;
+extern unsigned int drbd_resync_latency_us;
+extern bool drbd_resync_multi_source;
+extern bool drbd_resync_on_read;
+extern bool drbd_fua_ordering;
+extern unsigned int drbd_page_alloc_order;
+extern unsigned int drbd_peer_submit_contexts;
+extern unsigned int drbd_peer_ack_latency_us;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -85,9 +104,13 @@ enum {
  */
 #define DRBD_SIGKILL SIGHUP
 
+/* block_id values with a special meaning on the wire */
 #define ID_IN_SYNC      (4711ULL)
 #define ID_OUT_OF_SYNC  (4712ULL)
 #define ID_SYNCER (-1ULL)
+#define ID_CSUM_BATCH (4713ULL)
+#define ID_OV_DESCEND (4714ULL)
+#define ID_RS_PUSH (4715ULL)
 
 #define UUID_NEW_BM_OFFSET ((u64)0x0001000000000000ULL)
 
@@ -141,6 +164,8 @@ drbd_insert_fault(struct drbd_device *device, unsigned int type) {
 extern struct idr drbd_devices; /* RCU, updates: genl_lock() */
 extern struct list_head drbd_resources; /* RCU, updates: resources_mutex */
 extern struct mutex resources_mutex;
+extern struct workqueue_struct *drbd_csum_wq;
+extern struct workqueue_struct *drbd_peer_submit_wq;
 
 /* for sending/receiving the bitmap,
  * possibly in some encoding scheme */
@@ -319,6 +344,9 @@ struct drbd_request {
 	unsigned long pre_submit_jif;
 	unsigned long pre_send_jif[DRBD_PEERS_MAX];
 
+	/* local disk, for DRBD internal statistics and drbd_app_io_start() */
+	ktime_t pre_submit_kt;
+
 #ifdef CONFIG_DRBD_TIMING_STATS
 	/* for DRBD internal statistics */
 	ktime_t start_kt;
@@ -326,9 +354,6 @@ struct drbd_request {
 	/* before actual request processing */
 	ktime_t in_actlog_kt;
 
-	/* local disk */
-	ktime_t pre_submit_kt;
-
 	/* per connection */
 	ktime_t pre_send_kt[DRBD_PEERS_MAX];
 	ktime_t acked_kt[DRBD_PEERS_MAX];
@@ -407,6 +432,7 @@ struct drbd_epoch {
 	atomic_t epoch_size; /* increased on every request added. */
 	atomic_t active;     /* increased on every req. added, and dec on every finished. */
 	atomic_t confirmed;  /* adjusted for every P_CONFIRM_STABLE */
+	struct list_head parked; /* writes held back until the previous epoch finished */
 	unsigned long flags;
 };
 
@@ -417,6 +443,7 @@ enum {
 	DE_CONTAINS_A_BARRIER,
 	DE_HAVE_BARRIER_NUMBER,
 	DE_IS_FINISHING,
+	DE_NEEDS_FLUSH,		/* contains a write that was not FUA */
 };
 
 struct digest_info {
@@ -424,6 +451,7 @@ struct digest_info {
 	void *digest;
 };
 
+struct drbd_csums;
 struct drbd_peer_request {
 	struct drbd_work w;
 	struct drbd_peer_device *peer_device;
@@ -437,16 +465,19 @@ struct drbd_peer_request {
 	atomic_t pending_bios;
 	struct drbd_interval i;
 	unsigned long flags;	/* see comments on ee flag bits below */
+	struct drbd_csums *csums; /* computed on drbd_csum_wq, see drbd_csum_offload() */
 	union {
 		struct { /* regular peer_request */
 			struct drbd_epoch *epoch; /* for writes */
 			unsigned long submit_jif;
+			ktime_t submit_kt;
 			union {
 				u64 block_id;
 				struct digest_info *digest;
 			};
 			u64 dagtag_sector;
-
+			/* next one submitted with the same bio, see submit_peer_writes() */
+			struct drbd_peer_request *merged_next;
 		};
 		struct { /* reused object to queue send OOS to other nodes */
 			u64 sent_oos_nodes; /* Used to notify L_SYNC_TARGETs about new out_of_sync bits */
@@ -527,6 +558,12 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* P_CSUM_RS_REQUEST with one digest per BM_BLOCK_SIZE chunk */
+	__EE_CSUM_BATCH,
+
+	/* resync data the sync source sends without a request */
+	__EE_RS_PUSH,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -545,6 +582,8 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_CSUM_BATCH		(1<<__EE_CSUM_BATCH)
+#define EE_RS_PUSH		(1<<__EE_RS_PUSH)
 
 /* flag bits per device */
 enum device_flag {
@@ -606,6 +645,8 @@ enum peer_device_flag {
 	SYNC_TARGET_TO_BEHIND,  /* SyncTarget, wait for Behind */
 	HANDLING_CONGESTION,    /* Set while testing for congestion and handling it */
 	HANDLE_CONGESTION,      /* tell worker to change state due to congestion */
+	RS_PUSH,		/* SyncSource: streaming resync data, see make_resync_push() */
+	RS_PUSH_REQUESTED,	/* SyncTarget: asked the sync source to stream resync data */
 };
 
 /* We could make these currently hardcoded constants configurable
@@ -936,6 +977,7 @@ struct drbd_resource {
 	bool cached_all_devices_have_quorum;
 
 	enum write_ordering_e write_ordering;
+	bool write_ordering_fua;	/* WO_BDEV_FLUSH by FUA writes, see fua_ordering */
 
 	/* Protects the current transfer log (tle) fields. */
 	spinlock_t current_tle_lock;
@@ -961,6 +1003,45 @@ struct drbd_resource {
 	struct rcu_head rcu;
 };
 
+/* Payload compression, see drbd_compress.c and drbd_protocol_ext.h */
+#define DRBD_COMPRESS_CODECS	2
+
+struct drbd_compress_codec;
+struct drbd_compress {
+	/* sending side, protected by connection->mutex[DATA_STREAM] */
+	const struct drbd_compress_codec *codec;
+	struct crypto_comp *tfm;
+	void *raw;
+	void *out;
+	unsigned int backoff; /* after incompressible payload */
+	unsigned int skip;
+	u64 raw_bytes;
+	u64 wire_bytes;
+	u64 incompressible;
+	u64 skipped;
+	u64 cpu_ns;
+
+	/* receiving side, only accessed from the receiver thread */
+	struct crypto_comp *peer_tfm[DRBD_COMPRESS_CODECS];
+	void *peer_in;
+	void *peer_out;
+	u64 peer_raw_bytes;
+	u64 peer_wire_bytes;
+	u64 peer_cpu_ns;
+};
+
+struct drbd_dedup_dict;
+struct drbd_dedup {
+	/* sending side, sender thread only */
+	struct drbd_dedup_dict *dict;
+	u64 hits;
+
+	/* receiving side, receiver thread only */
+	struct drbd_dedup_dict *peer_dict;
+	u64 peer_hits;
+	u64 peer_misses;
+};
+
 struct drbd_connection {
 	struct list_head connections;
 	struct drbd_resource *resource;
@@ -970,6 +1051,9 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_oldest_requests;
 	struct dentry *debugfs_conn_transport;
 	struct dentry *debugfs_conn_debug;
+	struct dentry *debugfs_conn_compression;
+	struct dentry *debugfs_conn_page_credits;
+	struct dentry *debugfs_conn_peer_acks;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -999,6 +1083,8 @@ struct drbd_connection {
 	unsigned long last_received;	/* in jiffies, either socket */
 	atomic_t ap_in_flight; /* App sectors in flight (waiting for ack) */
 	atomic_t rs_in_flight; /* Resync sectors in flight */
+	ktime_t ping_sent_kt;
+	u64 rtt_ns; /* average of P_PING round trips */
 
 	struct drbd_work connect_timer_work;
 	struct timer_list connect_timer;
@@ -1012,10 +1098,14 @@ struct drbd_connection {
 	void *int_dig_in;
 	void *int_dig_vv;
 
+	struct drbd_compress compress;
+	struct drbd_dedup dedup;
+
 	/* receiver side */
 	struct drbd_epoch *current_epoch;
 	spinlock_t epoch_lock;
 	unsigned int epochs;
+	atomic_t epoch_flushes;	/* see drbd_flush_epoch_async() */
 
 	unsigned long last_reconnect_jif;
 	/* empty member on older kernels without blk_start_plug() */
@@ -1024,7 +1114,11 @@ struct drbd_connection {
 	struct drbd_thread sender;
 	struct drbd_thread ack_receiver;
 	struct workqueue_struct *ack_sender;
-	struct work_struct peer_ack_work;
+	struct delayed_work peer_ack_work;	/* see peer_ack_latency_us */
+	struct {			/* ack sender only */
+		u64 sent;
+		u64 merged;		/* covered by a later one with the same mask */
+	} peer_ack_stats;
 	u64 last_dagtag_sector;
 
 	atomic_t active_ee_cnt;
@@ -1036,11 +1130,22 @@ struct drbd_connection {
 	struct list_head net_ee;    /* zero-copy network send in progress */
 	struct list_head done_ee;   /* need to send P_WRITE_ACK */
 	atomic_t done_ee_cnt;
+	spinlock_t csum_lock;
+	struct list_head csum_jobs; /* reads waiting for drbd_csum_wq, in completion order */
+	unsigned int csum_tfm_gen; /* bumped by drbd_csum_replace_tfm(), under conf_update */
 	struct work_struct send_acks_work;
 	wait_queue_head_t ee_wait;
 
 	atomic_t pp_in_use;		/* allocated from page pool */
+	int pp_node;			/* NUMA node of the receiver, to allocate pages on */
 	atomic_t pp_in_use_by_net;	/* sendpage()d, still referenced by transport */
+	wait_queue_head_t pp_wait;	/* for pp_in_use to drop below max_buffers */
+	struct {			/* updated without locking, see drbd_alloc_pages() */
+		u64 waits;
+		u64 mem_waits;
+		u64 overrides;		/* gave up waiting, max_buffers ignored */
+		u64 wait_ns;
+	} pp_stats;
 	/* sender side */
 	struct drbd_work_queue sender_work;
 
@@ -1120,6 +1225,21 @@ struct drbd_connection {
 
 		/* position in change stream */
 		u64 current_dagtag_sector;
+
+		/* bytes handed over to the transport on the DATA_STREAM */
+		atomic64_t bytes_handed;
+
+		/* Protocol A writes sent zero-copy (RQ_EXP_SEND_DONE), which
+		 * the transport may still reference.  Each mark remembers
+		 * the stream position after the send, and the dagtag of the
+		 * last request covered by it.  Only changed by the sender
+		 * thread, see drbd_zc_send_done(). */
+#define DRBD_ZC_MARKS 16
+		struct {
+			u64 bytes_handed;
+			u64 dagtag_sector;
+		} zc_mark[DRBD_ZC_MARKS];
+		unsigned int zc_head, zc_tail;
 	} send;
 
 	unsigned int peer_node_id;
@@ -1137,6 +1257,9 @@ enum drbd_neighbor {
 	NEXT_HIGHER
 };
 
+/* Resync extents waited for by application reads, queued per peer */
+#define RS_PRIO_EXTENTS 8
+
 struct drbd_peer_device {
 	struct list_head peer_devices;
 	struct drbd_device *device;
@@ -1188,6 +1311,26 @@ struct drbd_peer_device {
 
 	/* use checksums for *this* resync */
 	bool use_csums;
+	/* let the sync source stream this resync, SyncTarget only */
+	bool use_push;
+	/* resync extents application reads wait for, see drbd_rs_read_priority() */
+	spinlock_t rs_prio_lock;
+	unsigned int rs_prio_ext[RS_PRIO_EXTENTS];
+	unsigned int rs_prio_cnt;
+	/* the one requested first now, sender thread only */
+	unsigned long rs_prio_start, rs_prio_end; /* 0 if none */
+	unsigned long rs_prio_saved_bit; /* resync_next_bit to go on with after it */
+	/* take resync extents from device->rs_claim_ext, SyncTarget only */
+	bool rs_claim;
+	unsigned long rs_claim_end; /* end of the extent claimed last, 0 if none */
+	/* extents the tail pass left to other sync targets, sender thread only */
+	unsigned int rs_skipped_ext[DRBD_PEERS_MAX];
+	unsigned int rs_skipped_cnt;
+	/* reads of streamed resync data not yet sent, sender thread only */
+	int rs_push_reads;
+	/* streamed run of zeroes not yet sent, sender thread only */
+	sector_t rs_push_zero_sector;
+	unsigned int rs_push_zero_size;
 	/* blocks to resync in this run [unit BM_BLOCK_SIZE] */
 	unsigned long rs_total;
 	/* number of resync blocks that failed in this run */
@@ -1229,6 +1372,12 @@ struct drbd_peer_device {
 			      * on the lower level device when we last looked. */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
 	ktime_t rs_last_mk_req_kt;
+	/* latency based resync controller, see drbd_rs_latency_controller() */
+	unsigned int rs_lat_rate; /* [KiB/s] */
+	u64 rs_lat_base_ns;
+	u64 rs_lat_k; /* [ns per KiB/s, << 10] */
+	u64 rs_lat_ns_seen;
+	int rs_lat_cnt_seen;
 	unsigned long ov_left; /* in bits */
 	unsigned long ov_skipped; /* in bits */
 	u64 rs_source_uuid;
@@ -1249,10 +1398,18 @@ struct drbd_peer_device {
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+#ifdef CONFIG_DRBD_TIMING_STATS
+	struct dentry *debugfs_peer_dev_ack_latency;
+#endif
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
 	ktime_t net_done_kt;
+#ifdef CONFIG_DRBD_TIMING_STATS
+	/* sent to acked, bucket n counts [2^(n-1), 2^n) microseconds */
+#define DRBD_ACK_LATENCY_BUCKETS 24
+	unsigned int ack_latency_hist[DRBD_ACK_LATENCY_BUCKETS];
+#endif
 
 	struct {/* sender todo per peer_device */
 		bool was_ahead;
@@ -1268,6 +1425,34 @@ struct submit_worker {
 	struct list_head peer_writes;
 };
 
+/* Peer writes that are in the activity log already are submitted from one
+ * of these, on drbd_peer_submit_wq. The context is chosen by the activity
+ * log extent, so that overlapping peer writes get submitted in the order
+ * they were received. See drbd_dispatch_peer_write(). */
+struct drbd_submit_ctx {
+	struct drbd_device *device;
+	struct work_struct work;
+
+	spinlock_t lock;
+	struct list_head peer_writes;	/* linked by peer_req->wait_for_actlog */
+};
+
+/* Flushes of the backing device, requested by the epochs of all
+ * connections, are coalesced: While one flush is in flight, all further
+ * requests wait for a single follow-up flush. Each waiter remembers the
+ * generation of the flush that covers it. See submit_one_flush(). */
+struct drbd_flush_agg {
+	spinlock_t lock;
+	struct list_head waiters;	/* one_flush_context, ordered by generation */
+	u64 gen;			/* generation of the flush submitted last */
+	bool in_flight;
+	bool follow_up;			/* waiters for generation gen + 1 exist */
+	struct work_struct work;	/* submits the follow-up flush */
+
+	u64 requested;
+	u64 submitted;
+};
+
 struct opener {
 	struct list_head list;
 	char comm[TASK_COMM_LEN];
@@ -1290,6 +1475,7 @@ struct drbd_device {
 	struct opener openers;
 
 	unsigned long flush_jif;
+	struct drbd_flush_agg flush;
 #ifdef CONFIG_DEBUG_FS
 	struct dentry *debugfs_minor;
 	struct dentry *debugfs_vol;
@@ -1301,6 +1487,7 @@ struct drbd_device {
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
+	struct dentry *debugfs_vol_flushes;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
 #endif
@@ -1377,6 +1564,10 @@ struct drbd_device {
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
 	atomic_t rs_sect_ev; /* for submitted resync data rate, both */
+	atomic64_t app_lat_ns; /* latency of application I/O on the backing device, summed up */
+	atomic_t app_lat_cnt;
+	unsigned long app_lat_until; /* measured until then [jiffies], see drbd_app_io_start() */
+	atomic_t rs_claim_ext; /* next resync extent to claim, see resync_multi_source */
 	struct pending_bitmap_work_s {
 		atomic_t n;		/* inc when queued here, */
 		spinlock_t q_lock;	/* dec only once finished. */
@@ -1387,6 +1578,8 @@ struct drbd_device {
 	/* any requests that would block in drbd_make_request()
 	 * are deferred to this single-threaded work queue */
 	struct submit_worker submit;
+	struct drbd_submit_ctx *submit_ctx;	/* peer writes, see peer_submit_contexts */
+	unsigned int nr_submit_ctx;
 	u64 read_nodes; /* used for balancing read requests among peers */
 	bool have_quorum[2];	/* no quorum -> suspend IO or error IO */
 	bool cached_state_unstable; /* updates with each state change */
@@ -1544,15 +1737,23 @@ extern int drbd_send_sync_param(struct drbd_peer_device *);
 extern int drbd_send_out_of_sync(struct drbd_peer_device *, struct drbd_interval *);
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
+extern int drbd_send_rs_data_part(struct drbd_peer_device *, struct drbd_peer_request *,
+				  unsigned int offset, unsigned int size, u32 dp_flags, u32 dedup_pos);
+extern int drbd_send_rs_dedup_ref(struct drbd_peer_device *, sector_t sector, u32 dedup_pos);
+extern int drbd_send_rs_batch_done(struct drbd_peer_device *, struct drbd_peer_request *,
+				   unsigned long *differ, unsigned int chunks);
+extern int drbd_send_rs_push_done(struct drbd_peer_device *);
 extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
 extern int drbd_send_drequest(struct drbd_peer_device *, int cmd,
 			      sector_t sector, int size, u64 block_id);
 extern void *drbd_prepare_drequest_csum(struct drbd_peer_request *peer_req, int digest_size);
+extern int drbd_send_csum_batch(struct drbd_peer_device *, sector_t sector, int size,
+				const void *digests, unsigned int digests_size);
 extern int drbd_send_ov_request(struct drbd_peer_device *, sector_t sector, int size);
 
 extern int drbd_send_bitmap(struct drbd_device *, struct drbd_peer_device *);
 extern int drbd_send_dagtag(struct drbd_connection *connection, u64 dagtag);
-extern int drbd_send_rs_deallocated(struct drbd_peer_device *, struct drbd_peer_request *);
+extern int drbd_send_rs_deallocated(struct drbd_peer_device *, sector_t sector, int size);
 extern void drbd_send_twopc_reply(struct drbd_connection *connection,
 				  enum drbd_packet, struct twopc_reply *);
 extern void drbd_send_peers_in_sync(struct drbd_peer_device *, u64, sector_t, int);
@@ -1793,6 +1994,10 @@ extern sector_t      drbd_bm_capacity(struct drbd_device *device);
 
 #define DRBD_END_OF_BITMAP	(~(unsigned long)0)
 extern unsigned long drbd_bm_find_next(struct drbd_peer_device *, unsigned long);
+extern unsigned long drbd_bm_range_find_next(struct drbd_peer_device *,
+					     unsigned long start, unsigned long end);
+extern unsigned long drbd_bm_range_find_next_zero(struct drbd_peer_device *,
+						  unsigned long start, unsigned long end);
 /* bm_find_next variants for use while you hold drbd_bm_lock() */
 extern unsigned long _drbd_bm_find_next(struct drbd_peer_device *, unsigned long);
 extern unsigned long _drbd_bm_find_next_zero(struct drbd_peer_device *, unsigned long);
@@ -1816,8 +2021,28 @@ extern struct kmem_cache *drbd_request_cache;
 extern struct kmem_cache *drbd_ee_cache;	/* peer requests */
 extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
+extern struct kmem_cache *drbd_peer_ack_cache;
 extern mempool_t drbd_request_mempool;
 extern mempool_t drbd_ee_mempool;
+extern mempool_t drbd_peer_ack_mempool;
+
+/* Per CPU cache of free objects in front of a mempool, see drbd_obj_alloc() */
+#define DRBD_OBJ_CACHE_SIZE 16
+struct drbd_obj_cache_cpu {
+	unsigned int count;
+	void *objs[DRBD_OBJ_CACHE_SIZE];
+};
+
+struct drbd_obj_cache {
+	mempool_t *pool;
+	struct drbd_obj_cache_cpu __percpu *cpu;
+};
+
+extern struct drbd_obj_cache drbd_request_objs;
+extern struct drbd_obj_cache drbd_ee_objs;
+extern struct drbd_obj_cache drbd_peer_ack_objs;
+extern void *drbd_obj_alloc(struct drbd_obj_cache *cache, gfp_t gfp_mask);
+extern void drbd_obj_free(struct drbd_obj_cache *cache, void *obj);
 
 /* drbd's page pool, used to buffer data received from the peer,
  * or data requested by the peer.
@@ -1832,11 +2057,28 @@ extern mempool_t drbd_ee_mempool;
  * frequent calls to alloc_page(), and still will be able to make progress even
  * under memory pressure.
  */
-extern struct page *drbd_pp_pool;
-extern spinlock_t   drbd_pp_lock;
-extern int	    drbd_pp_vacant;
 extern wait_queue_head_t drbd_pp_wait;
 
+/* There is one such pool per NUMA node, so that the pool lock stays local,
+ * and received data ends up in memory close to the receiver thread.
+ * Pages are returned to the pool of the node they are on.
+ * Only if the local pool and the system are both out of pages,
+ * the pools of the other nodes are tried. */
+struct drbd_page_pool {
+	spinlock_t lock;
+	struct page *pages;
+	int vacant;
+
+	atomic_long_t from_pool;	/* allocations served by this pool */
+	atomic_long_t from_system;	/* allocations with alloc_pages_node() */
+	atomic_long_t from_blocks;	/* allocations of contiguous blocks, see page_alloc_order */
+	atomic_long_t from_remote;	/* allocations on this node served by another pool */
+	atomic_long_t to_pool;		/* page chains freed to this pool */
+	atomic_long_t to_system;	/* page chains freed, as the pool was full */
+} ____cacheline_aligned_in_smp;
+
+extern struct drbd_page_pool *drbd_page_pools; /* [nr_node_ids] */
+
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
  * We can keep it global, as long as it is used as "N pages at a time".
@@ -1930,6 +2172,7 @@ enum drbd_ret_code drbd_resync_after_valid(struct drbd_device *device, int o_min
 void drbd_resync_after_changed(struct drbd_device *device);
 extern bool drbd_stable_sync_source_present(struct drbd_peer_device *, enum which_state);
 extern void drbd_start_resync(struct drbd_peer_device *, enum drbd_repl_state);
+extern void drbd_rs_read_priority(struct drbd_device *, struct drbd_peer_device *, sector_t, int);
 extern void resume_next_sg(struct drbd_device *device);
 extern void suspend_other_sg(struct drbd_device *device);
 extern int drbd_resync_finished(struct drbd_peer_device *, enum drbd_disk_state);
@@ -1948,6 +2191,7 @@ extern void drbd_check_peers_new_current_uuid(struct drbd_device *);
 extern void drbd_ping_peer(struct drbd_connection *connection);
 extern struct drbd_peer_device *peer_device_by_node_id(struct drbd_device *, int);
 extern void repost_up_to_date_fn(struct timer_list *t);
+extern bool drbd_zc_send_done(struct drbd_connection *connection);
 
 static inline void ov_out_of_sync_print(struct drbd_peer_device *peer_device)
 {
@@ -1971,6 +2215,10 @@ static inline void ov_skipped_print(struct drbd_peer_device *peer_device)
 
 extern void drbd_csum_bio(struct crypto_shash *, struct bio *, void *);
 extern void drbd_csum_pages(struct crypto_shash *, struct page *, void *);
+extern void drbd_csum_page_range(struct crypto_shash *, struct page *,
+				 unsigned int, unsigned int, void *);
+extern void drbd_csum_replace_tfm(struct drbd_connection *, struct crypto_shash **,
+				  struct crypto_shash *);
 /* worker callbacks */
 extern int w_e_end_data_req(struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_work *, int);
@@ -1993,6 +2241,7 @@ extern void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req);
 /* bi_end_io handlers */
 extern void drbd_md_endio(struct bio *bio);
 extern void drbd_peer_request_endio(struct bio *bio);
+extern void drbd_peer_writes_merged_endio(struct bio *bio);
 extern void drbd_request_endio(struct bio *bio);
 
 void __update_timing_details(
@@ -2033,6 +2282,7 @@ struct drbd_peer_request_details {
 	uint32_t bi_size;	/* resulting bio size */
 	/* for non-discards: bi_size = length - digest_size */
 	uint32_t digest_size;
+	uint32_t dedup_pos;	/* be64_to_cpu(p_data.block_id) with DP_RS_DEDUP_* */
 };
 
 struct queued_twopc {
@@ -2055,11 +2305,14 @@ extern int drbd_ack_receiver(struct drbd_thread *thi);
 extern void drbd_send_ping_wf(struct work_struct *ws);
 extern void drbd_send_acks_wf(struct work_struct *ws);
 extern void drbd_send_peer_ack_wf(struct work_struct *ws);
+extern void drbd_submit_flush_wf(struct work_struct *ws);
 extern bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *);
 extern bool drbd_rs_should_slow_down(struct drbd_peer_device *, sector_t,
 				     bool throttle_if_app_is_waiting);
 extern int drbd_submit_peer_request(struct drbd_peer_request *);
 extern void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_request *peer_req);
+extern void drbd_peer_submit_wf(struct work_struct *ws);
+extern void drbd_flush_peer_submit(struct drbd_device *device);
 extern void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head *cleanup);
 extern int drbd_free_peer_reqs(struct drbd_connection *, struct list_head *, bool is_net_ee);
 extern struct drbd_peer_request *drbd_alloc_peer_req(struct drbd_peer_device *, gfp_t) __must_hold(local);
@@ -2114,6 +2367,29 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
 extern void twopc_timer_fn(struct timer_list *t);
 extern void connect_timer_fn(struct timer_list *t);
 
+/* drbd_compress.c */
+extern u32 drbd_compress_features(void);
+extern void drbd_compress_setup(struct drbd_connection *connection);
+extern void drbd_compress_free(struct drbd_connection *connection);
+extern unsigned int drbd_compress_bio(struct drbd_connection *connection, struct bio *bio, u32 *dp_flags);
+extern unsigned int drbd_compress_pages(struct drbd_connection *connection, struct page *page,
+					unsigned int size, u32 *dp_flags);
+extern void drbd_compress_csum_raw(struct drbd_connection *connection, struct crypto_shash *tfm,
+				   unsigned int size, void *digest);
+extern void *drbd_decompress_buffer(struct drbd_connection *connection, u32 dp_flags, unsigned int in_len);
+extern int drbd_decompress(struct drbd_connection *connection, u32 dp_flags,
+			   unsigned int in_len, unsigned int out_len);
+
+/* drbd_dedup.c */
+extern void drbd_dedup_setup(struct drbd_connection *connection);
+extern void drbd_dedup_free(struct drbd_connection *connection);
+extern bool drbd_dedup_prepare(struct drbd_connection *connection);
+extern bool drbd_dedup_chunk(struct drbd_connection *connection, const void *chunk, u32 *pos);
+extern void drbd_dedup_store(struct drbd_connection *connection,
+			     struct drbd_peer_request *peer_req, u32 pos);
+extern int drbd_dedup_fill(struct drbd_connection *connection,
+			   struct drbd_peer_request *peer_req, u32 pos);
+
 /* drbd_proc.c */
 extern struct proc_dir_entry *drbd_proc;
 int drbd_seq_show(struct seq_file *seq, void *v);
@@ -2127,6 +2403,7 @@ extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_in
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_rs_complete_io(struct drbd_peer_device *, sector_t);
+extern void drbd_rs_more_io(struct drbd_peer_device *, sector_t);
 extern int drbd_rs_begin_io(struct drbd_peer_device *, sector_t);
 extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, bool);
 extern void drbd_rs_cancel_all(struct drbd_peer_device *);
@@ -2744,6 +3021,27 @@ static inline struct drbd_connection *first_connection(struct drbd_resource *res
 
 #define NODE_MASK(id) ((u64)1 << (id))
 
+/* Latency of application I/O on the backing device, for the latency based
+ * resync controller. Only measured while one runs for the device, which
+ * keeps extending app_lat_until. */
+static inline bool drbd_app_io_latency(struct drbd_device *device)
+{
+	return time_before(jiffies, READ_ONCE(device->app_lat_until));
+}
+
+static inline ktime_t drbd_app_io_start(struct drbd_device *device)
+{
+	return drbd_app_io_latency(device) ? ktime_get() : ns_to_ktime(0);
+}
+
+static inline void drbd_app_io_done(struct drbd_device *device, ktime_t submit_kt)
+{
+	if (!ktime_to_ns(submit_kt) || !drbd_app_io_latency(device))
+		return;
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), submit_kt)), &device->app_lat_ns);
+	atomic_inc(&device->app_lat_cnt);
+}
+
 #ifdef CONFIG_DRBD_TIMING_STATS
 #define ktime_aggregate_delta(D, ST, M) D->M = ktime_add(D->M, ktime_sub(ktime_get(), ST))
 #define ktime_aggregate(D, R, M) D->M = ktime_add(D->M, ktime_sub(R->M, R->start_kt))
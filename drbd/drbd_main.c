@@ -129,6 +129,115 @@ const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+/* Send protocol A and data-integrity writes zero-copy as well,
+ * see drbd_send_dblock() and drbd_zc_send_done() */
+bool drbd_zerocopy_send_done;
+MODULE_PARM_DESC(zerocopy_send_done, "Send protocol A and data-integrity writes without copying; "
+		 "complete protocol A writes once the transport released their pages");
+module_param_named(zerocopy_send_done, drbd_zerocopy_send_done, bool, 0644);
+
+/* Spin on the control stream for up to this long before the ack receiver
+ * sleeps, while writes or resync requests are waiting for their acks.
+ * While enabled, the ack receiver runs SCHED_NORMAL instead of SCHED_RR. */
+unsigned int drbd_ack_busy_poll_us;
+MODULE_PARM_DESC(ack_busy_poll_us, "Busy poll for acks up to that many microseconds (0 = off)");
+module_param_named(ack_busy_poll_us, drbd_ack_busy_poll_us, uint, 0644);
+
+/* Taken when connecting, see drbd_compress_setup() */
+char drbd_compress_alg[DRBD_COMPRESS_ALG_LEN];
+MODULE_PARM_DESC(compress, "Compress replicated data with this algorithm (lz4 or zstd), "
+		 "if the peer supports it");
+module_param_string(compress, drbd_compress_alg, sizeof(drbd_compress_alg), 0644);
+
+/* With csums-alg, send one digest per 4KiB instead of one per resync request.
+ * That saves transferring identical blocks, not round trips: there is still
+ * one P_CSUM_RS_REQUEST per resync request, see resync_request_kb. */
+bool drbd_csums_batch = true;
+MODULE_PARM_DESC(csums_batch, "Checksum based resync compares 4KiB chunks and transfers only the differing ones");
+module_param_named(csums_batch, drbd_csums_batch, bool, 0644);
+
+/* Online verify compares the digests of ranges of that size first, and
+ * descends only into ranges that differ */
+unsigned int drbd_verify_tree_kb = DRBD_MAX_BIO_SIZE >> 10;
+MODULE_PARM_DESC(verify_tree_kb, "Size of the top level ranges of online verify in KiB "
+		 "(4 = one digest per 4KiB, as without hierarchical verify)");
+module_param_named(verify_tree_kb, drbd_verify_tree_kb, uint, 0644);
+
+/* Compute the checksums of verify and checksum based resync on drbd_csum_wq,
+ * instead of in the sender thread of the connection */
+bool drbd_csum_offload = true;
+MODULE_PARM_DESC(csum_offload, "Compute verify and resync checksums on all CPUs");
+module_param_named(csum_offload, drbd_csum_offload, bool, 0644);
+
+/* Upper limit for the size of resync requests, besides max_bio_size.
+ * A request never crosses a resync extent boundary. */
+unsigned int drbd_resync_request_kb = DRBD_MAX_BIO_SIZE >> 10;
+MODULE_PARM_DESC(resync_request_kb, "Maximum size of resync requests in KiB");
+module_param_named(resync_request_kb, drbd_resync_request_kb, uint, 0644);
+
+/* Let the sync source stream mostly-full resyncs instead of having each block
+ * requested; the value limits the data streamed but not yet acknowledged */
+unsigned int drbd_resync_push_kb;
+MODULE_PARM_DESC(resync_push_kb, "Window of streaming resync in KiB (0 = disabled)");
+module_param_named(resync_push_kb, drbd_resync_push_kb, uint, 0644);
+
+/* Send blocks of streamed resync data the peer got recently as references */
+bool drbd_resync_dedup;
+MODULE_PARM_DESC(resync_dedup, "Deduplicate streamed resync data");
+module_param_named(resync_dedup, drbd_resync_dedup, bool, 0644);
+
+/* Instead of c-fill-target and c-delay-target, have the SyncTarget adapt the
+ * resync rate so that application I/O on its backing device completes within
+ * that many microseconds on average. c-min-rate and c-max-rate still apply. */
+unsigned int drbd_resync_latency_us;
+MODULE_PARM_DESC(resync_latency_us, "Target latency of application I/O during resync "
+		 "in microseconds (0 = use the dynamic resync speed controller)");
+module_param_named(resync_latency_us, drbd_resync_latency_us, uint, 0644);
+
+/* Resync from all up-to-date peers at once instead of one after the other;
+ * the sync targets of a device claim resync extents from a shared cursor */
+bool drbd_resync_multi_source;
+MODULE_PARM_DESC(resync_multi_source, "Resync from several up-to-date peers in parallel");
+module_param_named(resync_multi_source, drbd_resync_multi_source, bool, 0644);
+
+/* On a SyncTarget, when an application read has to go to a peer because the
+ * blocks are still out of sync, resync the whole resync extent around it first */
+bool drbd_resync_on_read;
+MODULE_PARM_DESC(resync_on_read, "Resync the extents of application reads first");
+module_param_named(resync_on_read, drbd_resync_on_read, bool, 0644);
+
+/* With write ordering "flush", write received data with FUA instead of
+ * flushing the backing devices after each epoch, if all of them either
+ * support FUA natively or have no volatile write cache.
+ * Evaluated when the write ordering method is (re)determined. */
+bool drbd_fua_ordering;
+MODULE_PARM_DESC(fua_ordering, "Use FUA writes instead of flushes to ensure write ordering");
+module_param_named(fua_ordering, drbd_fua_ordering, bool, 0644);
+
+/* Allocate the pages for data of more than one page in physically contiguous
+ * blocks of up to 2^page_alloc_order pages, if that is possible without
+ * reclaim, before falling back to single pages and the page pool.
+ * At most PAGE_ALLOC_COSTLY_ORDER, 0 disables that. */
+unsigned int drbd_page_alloc_order = PAGE_ALLOC_COSTLY_ORDER;
+MODULE_PARM_DESC(page_alloc_order, "Largest order of contiguous page blocks for peer request data");
+module_param_named(page_alloc_order, drbd_page_alloc_order, uint, 0644);
+
+/* Peer writes that need no activity log transaction are submitted from
+ * that many contexts per device on drbd_peer_submit_wq, instead of from
+ * the receiver thread. The context is chosen by activity log extent.
+ * Takes effect for devices created afterwards, 0 disables that. */
+unsigned int drbd_peer_submit_contexts = 4;
+MODULE_PARM_DESC(peer_submit_contexts, "Number of parallel submit contexts for peer writes per device");
+module_param_named(peer_submit_contexts, drbd_peer_submit_contexts, uint, 0444);
+
+/* Upper bound for how long a peer ack may wait for more peer acks to
+ * accumulate, before the ack sender of a connection sends them. Peer acks
+ * with the same mask are sent as one P_PEER_ACK. Rounded up to jiffies,
+ * 0 sends them as soon as the ack sender gets to it. */
+unsigned int drbd_peer_ack_latency_us;
+MODULE_PARM_DESC(peer_ack_latency_us, "Maximum delay of peer acks for sending them in batches");
+module_param_named(peer_ack_latency_us, drbd_peer_ack_latency_us, uint, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
@@ -140,9 +249,14 @@ struct kmem_cache *drbd_request_cache;
 struct kmem_cache *drbd_ee_cache;	/* peer requests */
 struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
+struct kmem_cache *drbd_peer_ack_cache;
 mempool_t drbd_request_mempool;
 mempool_t drbd_ee_mempool;
+mempool_t drbd_peer_ack_mempool;
 mempool_t drbd_md_io_page_pool;
+struct drbd_obj_cache drbd_request_objs = { .pool = &drbd_request_mempool };
+struct drbd_obj_cache drbd_ee_objs = { .pool = &drbd_ee_mempool };
+struct drbd_obj_cache drbd_peer_ack_objs = { .pool = &drbd_peer_ack_mempool };
 struct bio_set drbd_md_io_bio_set;
 struct bio_set drbd_io_bio_set;
 
@@ -152,11 +266,83 @@ struct bio_set drbd_io_bio_set;
    Note: This is a single linked list, the next pointer is the private
 	 member of struct page.
  */
-struct page *drbd_pp_pool;
-spinlock_t   drbd_pp_lock;
-int          drbd_pp_vacant;
+struct drbd_page_pool *drbd_page_pools;
 wait_queue_head_t drbd_pp_wait;
 
+/* Objects freed on a CPU are kept in a small per CPU stack and handed out
+ * again by the next allocation on that CPU, without touching the mempool
+ * or the slab. A full stack returns half of its objects to the mempool
+ * in one go. While the emergency reserve of the mempool is not full,
+ * objects go straight back to it, so that the reserve never ends up
+ * parked in the per CPU stacks. */
+void *drbd_obj_alloc(struct drbd_obj_cache *cache, gfp_t gfp_mask)
+{
+	struct drbd_obj_cache_cpu *c;
+	unsigned long flags;
+	void *obj = NULL;
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(cache->cpu);
+	if (c->count)
+		obj = c->objs[--c->count];
+	local_irq_restore(flags);
+
+	if (obj)
+		return obj;
+	return mempool_alloc(cache->pool, gfp_mask);
+}
+
+/* May be called from any context, including RCU callbacks */
+void drbd_obj_free(struct drbd_obj_cache *cache, void *obj)
+{
+	void *batch[DRBD_OBJ_CACHE_SIZE / 2];
+	struct drbd_obj_cache_cpu *c;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	if (READ_ONCE(cache->pool->curr_nr) < cache->pool->min_nr) {
+		mempool_free(obj, cache->pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(cache->cpu);
+	if (c->count == DRBD_OBJ_CACHE_SIZE) {
+		n = DRBD_OBJ_CACHE_SIZE / 2;
+		c->count -= n;
+		memcpy(batch, &c->objs[c->count], n * sizeof(void *));
+	}
+	c->objs[c->count++] = obj;
+	local_irq_restore(flags);
+
+	while (n)
+		mempool_free(batch[--n], cache->pool);
+}
+
+static int drbd_obj_cache_init(struct drbd_obj_cache *cache)
+{
+	cache->cpu = alloc_percpu(struct drbd_obj_cache_cpu);
+	return cache->cpu ? 0 : -ENOMEM;
+}
+
+/* After rcu_barrier(), with nothing allocating anymore */
+static void drbd_obj_cache_exit(struct drbd_obj_cache *cache)
+{
+	int cpu;
+
+	if (!cache->cpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_obj_cache_cpu *c = per_cpu_ptr(cache->cpu, cpu);
+
+		while (c->count)
+			mempool_free(c->objs[--c->count], cache->pool);
+	}
+	free_percpu(cache->cpu);
+	cache->cpu = NULL;
+}
+
 static const struct block_device_operations drbd_ops = {
 	.owner =   THIS_MODULE,
 	.open =    drbd_open,
@@ -1027,6 +1213,8 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 	offset = sbuf->unsent - (char *)page_address(sbuf->page);
 	err = tr_ops->send_page(transport, drbd_stream, sbuf->page, offset, size, msg_flags);
 	if (!err) {
+		if (drbd_stream == DATA_STREAM)
+			atomic64_add(size, &connection->send.bytes_handed);
 		sbuf->unsent =
 		sbuf->pos += sbuf->allocated_size;      /* send buffer submitted! */
 	}
@@ -1125,6 +1313,7 @@ int drbd_send_ping(struct drbd_connection *connection)
 {
 	if (!conn_prepare_command(connection, 0, CONTROL_STREAM))
 		return -EIO;
+	connection->ping_sent_kt = ktime_get();
 	return send_command(connection, -1, P_PING, CONTROL_STREAM);
 }
 
@@ -1853,15 +2042,15 @@ int drbd_send_bitmap(struct drbd_device *device, struct drbd_peer_device *peer_d
 }
 
 int drbd_send_rs_deallocated(struct drbd_peer_device *peer_device,
-			     struct drbd_peer_request *peer_req)
+			     sector_t sector, int size)
 {
 	struct p_block_desc *p;
 
 	p = drbd_prepare_command(peer_device, sizeof(*p), DATA_STREAM);
 	if (!p)
 		return -EIO;
-	p->sector = cpu_to_be64(peer_req->i.sector);
-	p->blksize = cpu_to_be32(peer_req->i.size);
+	p->sector = cpu_to_be64(sector);
+	p->blksize = cpu_to_be32(size);
 	p->pad = 0;
 	return drbd_send_command(peer_device, P_RS_DEALLOCATED, DATA_STREAM);
 }
@@ -1897,6 +2086,33 @@ void *drbd_prepare_drequest_csum(struct drbd_peer_request *peer_req, int digest_
 	return p + 1; /* digest should be placed behind the struct */
 }
 
+static int _drbd_send_copy(struct drbd_connection *connection, const void *from, unsigned int size);
+
+/* P_CSUM_RS_REQUEST with one digest per BM_BLOCK_SIZE chunk, see w_e_send_csum().
+ * These may not fit into the send buffer, so they go out as payload. */
+int drbd_send_csum_batch(struct drbd_peer_device *peer_device, sector_t sector, int size,
+			 const void *digests, unsigned int digests_size)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct p_block_req *p;
+	int err;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p), DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->sector = cpu_to_be64(sector);
+	p->block_id = ID_CSUM_BATCH;
+	p->pad = 0;
+	p->blksize = cpu_to_be32(size);
+	additional_size_command(connection, DATA_STREAM, digests_size);
+	err = __send_command(connection, peer_device->device->vnr, P_CSUM_RS_REQUEST, DATA_STREAM);
+	if (!err)
+		err = _drbd_send_copy(connection, digests, digests_size);
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+
+	return err;
+}
+
 int drbd_send_ov_request(struct drbd_peer_device *peer_device, sector_t sector, int size)
 {
 	struct p_block_req *p;
@@ -1940,8 +2156,10 @@ static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *pa
 	int err;
 
 	err = tr_ops->send_page(transport, DATA_STREAM, page, offset, size, msg_flags);
-	if (!err)
+	if (!err) {
+		atomic64_add(size, &connection->send.bytes_handed);
 		peer_device->send_cnt += size >> 9;
+	}
 
 	return err;
 }
@@ -1999,11 +2217,13 @@ static int _drbd_send_bio(struct drbd_peer_device *peer_device, struct bio *bio)
 	return 0;
 }
 
-static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *bio)
+static bool bio_may_send_zc(struct bio *bio)
 {
 	struct bio_vec bvec;
 	struct bvec_iter iter;
-	bool no_zc = drbd_disable_sendpage;
+
+	if (drbd_disable_sendpage)
+		return false;
 
 	/* e.g. XFS meta- & log-data is in slab pages, which have a
 	 * page_count of 0 and/or have PageSlab() set.
@@ -2011,32 +2231,82 @@ static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *b
 	 * put_page(); and would cause either a VM_BUG directly, or
 	 * __page_cache_release a page that would actually still be referenced
 	 * by someone, leading to some obscure delayed Oops somewhere else. */
-	if (!no_zc)
-		bio_for_each_segment(bvec, bio, iter) {
-			struct page *page = bvec.bv_page;
+	bio_for_each_segment(bvec, bio, iter) {
+		struct page *page = bvec.bv_page;
 
-			if (page_count(page) < 1 || PageSlab(page)) {
-				no_zc = true;
-				break;
-			}
-		}
+		if (page_count(page) < 1 || PageSlab(page))
+			return false;
+	}
+	return true;
+}
 
-	if (no_zc) {
-		return _drbd_send_bio(peer_device, bio);
-	} else {
-		struct drbd_connection *connection = peer_device->connection;
-		struct drbd_transport *transport = &connection->transport;
-		struct drbd_transport_ops *tr_ops = transport->ops;
-		int err;
+static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *bio)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_transport_ops *tr_ops = transport->ops;
+	int err;
 
-		flush_send_buffer(connection, DATA_STREAM);
+	flush_send_buffer(connection, DATA_STREAM);
 
-		err = tr_ops->send_zc_bio(transport, bio);
-		if (!err)
-			peer_device->send_cnt += bio->bi_iter.bi_size >> 9;
+	err = tr_ops->send_zc_bio(transport, bio);
+	if (!err) {
+		atomic64_add(bio->bi_iter.bi_size, &connection->send.bytes_handed);
+		peer_device->send_cnt += bio->bi_iter.bi_size >> 9;
+	}
 
-		return err;
+	return err;
+}
+
+/* Remember the current DATA_STREAM position for a protocol A write which
+ * was sent zero-copy.  Once the transport reports that much data as
+ * acknowledged by the peer, drbd_zc_send_done() completes the request.
+ * If we run out of marks, we coarsen the most recent one.
+ * Called with the DATA_STREAM mutex held. */
+static void drbd_zc_mark(struct drbd_connection *connection, struct drbd_request *req)
+{
+	struct drbd_transport *transport = &connection->transport;
+
+	unsigned int i = connection->send.zc_tail;
+
+	if (i - connection->send.zc_head == DRBD_ZC_MARKS)
+		i--;
+	else
+		connection->send.zc_tail++;
+
+	i %= DRBD_ZC_MARKS;
+	connection->send.zc_mark[i].bytes_handed =
+		atomic64_read(&connection->send.bytes_handed);
+	connection->send.zc_mark[i].dagtag_sector = req->dagtag_sector;
+
+	/* Have the transport call drbd_transport_send_done() */
+	transport->ops->hint(transport, DATA_STREAM, NOSPACE);
+}
+
+/* Send size bytes at offset into the pages of a peer request */
+static int _drbd_send_zc_ee_range(struct drbd_peer_device *peer_device,
+				  struct drbd_peer_request *peer_req,
+				  unsigned int offset, unsigned int size)
+{
+	struct page *page = peer_req->page_chain.head;
+	int err;
+
+	flush_send_buffer(peer_device->connection, DATA_STREAM);
+	page_chain_for_each(page) {
+		unsigned l;
+
+		if (offset >= PAGE_SIZE) {
+			offset -= PAGE_SIZE;
+			continue;
+		}
+		l = min_t(unsigned, size, PAGE_SIZE - offset);
+		size -= l;
+		err = _drbd_send_page(peer_device, page, offset, l, size ? MSG_MORE : 0);
+		if (err || !size)
+			return err;
+		offset = 0;
 	}
+	return -EIO;
 }
 
 static int _drbd_send_zc_ee(struct drbd_peer_device *peer_device,
@@ -2065,6 +2335,38 @@ static int _drbd_send_zc_ee(struct drbd_peer_device *peer_device,
 	return 0;
 }
 
+/* Send a payload of any size by copying it through the send buffer */
+static int _drbd_send_copy(struct drbd_connection *connection, const void *from, unsigned int size)
+{
+	struct drbd_send_buffer *sbuf = &connection->send_buffer[DATA_STREAM];
+
+	/* Flush send buffer and make sure PAGE_SIZE is available... */
+	alloc_send_buffer(connection, PAGE_SIZE, DATA_STREAM);
+	sbuf->allocated_size = 0;
+
+	while (size) {
+		unsigned int l = min_t(unsigned int, size, PAGE_SIZE);
+
+		memcpy(alloc_send_buffer(connection, l, DATA_STREAM), from, l);
+		from += l;
+		size -= l;
+		if (size) {
+			sbuf->pos += sbuf->allocated_size;
+			sbuf->allocated_size = 0;
+		}
+	}
+
+	return flush_send_buffer(connection, DATA_STREAM);
+}
+
+/* Send the payload prepared by drbd_compress_bio() or drbd_compress_pages() */
+static int _drbd_send_compressed(struct drbd_peer_device *peer_device, unsigned int size)
+{
+	struct drbd_connection *connection = peer_device->connection;
+
+	return _drbd_send_copy(connection, connection->compress.out, size);
+}
+
 /* see also wire_flags_to_bio() */
 static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio)
 {
@@ -2093,6 +2395,7 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	struct p_wsame *wsame = NULL;
 	void *digest_out = NULL;
 	unsigned int dp_flags = 0;
+	unsigned int compressed_size = 0;
 	int digest_size = 0;
 	int err;
 	const unsigned s = req->net_rq_state[peer_device->node_id];
@@ -2133,6 +2436,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		dp_flags |= DP_SEND_RECEIVE_ACK;
 	if (s & RQ_EXP_WRITE_ACK || dp_flags & DP_MAY_SET_IN_SYNC)
 		dp_flags |= DP_SEND_WRITE_ACK;
+	if (!trim && !wsame)
+		compressed_size = drbd_compress_bio(peer_device->connection, req->master_bio, &dp_flags);
 	p->dp_flags = cpu_to_be32(dp_flags);
 
 	if (trim) {
@@ -2143,7 +2448,12 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 
 	if (digest_size && digest_out) {
 		BUG_ON(digest_size > sizeof(peer_device->connection->scratch_buffer.d.before));
-		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
+		if (compressed_size)
+			drbd_compress_csum_raw(peer_device->connection,
+					       peer_device->connection->integrity_tfm,
+					       req->i.size, before);
+		else
+			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
 		memcpy(digest_out, before, digest_size);
 	}
 
@@ -2152,34 +2462,60 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 					bio_iovec(req->master_bio).bv_len);
 		err = __send_command(peer_device->connection, device->vnr, P_WSAME, DATA_STREAM);
 	} else {
-		additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
+		additional_size_command(peer_device->connection, DATA_STREAM,
+					compressed_size ?: req->i.size);
 		err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
 	}
-	if (!err) {
+	if (!err && compressed_size) {
+		/* A copy already, complete on send like any copied payload */
+		err = _drbd_send_compressed(peer_device, compressed_size);
+		peer_device->send_cnt += req->i.size >> 9;
+	} else if (!err) {
+		const bool proto_a = !(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK));
+		bool zc = bio_may_send_zc(req->master_bio);
+
 		/* For protocol A, we have to memcpy the payload into
 		 * socket buffers, as we may complete right away
 		 * as soon as we handed it over to tcp, at which point the data
 		 * pages may become invalid.
+		 * Unless zerocopy_send_done is set: then we keep the request
+		 * RQ_NET_PENDING until the transport is done with its pages.
 		 *
 		 * For data-integrity enabled, we copy it as well, so we can be
 		 * sure that even if the bio pages may still be modified, it
 		 * won't change the data on the wire, thus if the digest checks
 		 * out ok after sending on this side, but does not fit on the
 		 * receiving side, we sure have detected corruption elsewhere.
+		 * We set BDI_CAP_STABLE_WRITES, so with zerocopy_send_done we
+		 * trust the upper layers to not modify pages under writeback,
+		 * and still detect it below if they do.
 		 */
-		if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
-			err = _drbd_send_bio(peer_device, req->master_bio);
-		else
+		if (zc && (proto_a || digest_size))
+			zc = drbd_zerocopy_send_done;
+
+		if (zc && proto_a) {
+			spin_lock_irq(&req->rq_lock);
+			req->net_rq_state[peer_device->node_id] |= RQ_EXP_SEND_DONE;
+			spin_unlock_irq(&req->rq_lock);
+		}
+
+		if (zc)
 			err = _drbd_send_zc_bio(peer_device, req->master_bio);
+		else
+			err = _drbd_send_bio(peer_device, req->master_bio);
 
-		/* double check digest, sometimes buffers have been modified in flight. */
-		if (digest_size > 0) {
-			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
-			if (memcmp(before, after, digest_size)) {
-				drbd_warn(device,
-					"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
-					(unsigned long long)req->i.sector, req->i.size);
-			}
+		if (!err && zc && proto_a)
+			drbd_zc_mark(peer_device->connection, req);
+	}
+
+	/* double check digest, sometimes buffers have been modified in flight.
+	 * With compression, before is the digest of the copy that was sent. */
+	if (!err && digest_size > 0) {
+		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
+		if (memcmp(before, after, digest_size)) {
+			drbd_warn(device,
+				"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
+				(unsigned long long)req->i.sector, req->i.size);
 		}
 	}
 out:
@@ -2196,6 +2532,8 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 		    struct drbd_peer_request *peer_req)
 {
 	struct p_data *p;
+	unsigned int compressed_size = 0;
+	u32 dp_flags = 0;
 	int err;
 	int digest_size;
 
@@ -2209,19 +2547,116 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	p->sector = cpu_to_be64(peer_req->i.sector);
 	p->block_id = peer_req->block_id;
 	p->seq_num = 0;  /* unused */
-	p->dp_flags = 0;
+	if (cmd == P_RS_DATA_REPLY)
+		compressed_size = drbd_compress_pages(peer_device->connection,
+				peer_req->page_chain.head, peer_req->i.size, &dp_flags);
+	if (peer_req->flags & EE_RS_PUSH)
+		dp_flags |= DP_RS_PUSH;
+	p->dp_flags = cpu_to_be32(dp_flags);
 	if (digest_size)
 		drbd_csum_pages(peer_device->connection->integrity_tfm, peer_req->page_chain.head, p + 1);
-	additional_size_command(peer_device->connection, DATA_STREAM, peer_req->i.size);
+	additional_size_command(peer_device->connection, DATA_STREAM,
+				compressed_size ?: peer_req->i.size);
 	err = __send_command(peer_device->connection,
 			     peer_device->device->vnr, cmd, DATA_STREAM);
-	if (!err)
+	if (!err && compressed_size)
+		err = _drbd_send_compressed(peer_device, compressed_size);
+	else if (!err)
 		err = _drbd_send_zc_ee(peer_device, peer_req);
 	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
 
 	return err;
 }
 
+/* Part of the data of a peer request as P_RS_DATA_REPLY, for batched
+ * checksum based resync (DP_RS_BATCH_PART) and streaming resync (DP_RS_PUSH) */
+int drbd_send_rs_data_part(struct drbd_peer_device *peer_device,
+			   struct drbd_peer_request *peer_req,
+			   unsigned int offset, unsigned int size, u32 dp_flags, u32 dedup_pos)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct p_data *p;
+	int digest_size;
+	int err;
+
+	digest_size = connection->integrity_tfm ?
+		      crypto_shash_digestsize(connection->integrity_tfm) : 0;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->sector = cpu_to_be64(peer_req->i.sector + (offset >> 9));
+	p->block_id = dp_flags & DP_RS_DEDUP_STORE ? cpu_to_be64(dedup_pos) : ID_SYNCER;
+	p->seq_num = 0;  /* unused */
+	p->dp_flags = cpu_to_be32(dp_flags);
+	if (digest_size)
+		drbd_csum_page_range(connection->integrity_tfm, peer_req->page_chain.head,
+				     offset, size, p + 1);
+	additional_size_command(connection, DATA_STREAM, size);
+	err = __send_command(connection, peer_device->device->vnr, P_RS_DATA_REPLY, DATA_STREAM);
+	if (!err)
+		err = _drbd_send_zc_ee_range(peer_device, peer_req, offset, size);
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+
+	return err;
+}
+
+/* Batched checksum based resync, concludes the answer to one
+ * P_CSUM_RS_REQUEST. The payload is the bitmap of differing chunks. */
+int drbd_send_rs_batch_done(struct drbd_peer_device *peer_device,
+			    struct drbd_peer_request *peer_req,
+			    unsigned long *differ, unsigned int chunks)
+{
+	unsigned int bytes = DIV_ROUND_UP(chunks, 8);
+	struct p_data *p;
+	u8 *map;
+	int i;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p) + bytes, DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->sector = cpu_to_be64(peer_req->i.sector);
+	p->block_id = ID_CSUM_BATCH;
+	p->seq_num = 0;  /* unused */
+	p->dp_flags = cpu_to_be32(DP_RS_BATCH_DONE |
+				  (peer_req->i.size >> 9) << DP_RAW_SECTORS_SHIFT);
+	map = (u8 *)(p + 1);
+	memset(map, 0, bytes);
+	for_each_set_bit(i, differ, chunks)
+		map[i / 8] |= 1 << (i % 8);
+	return drbd_send_command(peer_device, P_RS_DATA_REPLY, DATA_STREAM);
+}
+
+/* Streamed resync data the peer has in its dictionary, see drbd_dedup.c */
+int drbd_send_rs_dedup_ref(struct drbd_peer_device *peer_device, sector_t sector, u32 dedup_pos)
+{
+	struct p_data *p;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p), DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->sector = cpu_to_be64(sector);
+	p->block_id = cpu_to_be64(dedup_pos);
+	p->seq_num = 0;  /* unused */
+	p->dp_flags = cpu_to_be32(DP_RS_PUSH | DP_RS_DEDUP_REF);
+	return drbd_send_command(peer_device, P_RS_DATA_REPLY, DATA_STREAM);
+}
+
+/* Tell the sync target that streaming reached the end of the bitmap */
+int drbd_send_rs_push_done(struct drbd_peer_device *peer_device)
+{
+	struct p_data *p;
+
+	p = drbd_prepare_command(peer_device, sizeof(*p), DATA_STREAM);
+	if (!p)
+		return -EIO;
+	p->sector = 0;
+	p->block_id = ID_RS_PUSH;
+	p->seq_num = 0;  /* unused */
+	p->dp_flags = cpu_to_be32(DP_RS_PUSH);
+	return drbd_send_command(peer_device, P_RS_DATA_REPLY, DATA_STREAM);
+}
+
 int drbd_send_out_of_sync(struct drbd_peer_device *peer_device, struct drbd_interval *i)
 {
 	struct p_block_desc *p;
@@ -2594,21 +3029,35 @@ void drbd_cleanup_device(struct drbd_device *device)
 static void drbd_destroy_mempools(void)
 {
 	struct page *page;
+	int node;
 
-	while (drbd_pp_pool) {
-		page = drbd_pp_pool;
-		drbd_pp_pool = page_chain_next(page);
-		__free_page(page);
-		drbd_pp_vacant--;
+	for (node = 0; drbd_page_pools && node < nr_node_ids; node++) {
+		struct drbd_page_pool *pool = &drbd_page_pools[node];
+
+		while (pool->pages) {
+			page = pool->pages;
+			pool->pages = page_chain_next(page);
+			__free_page(page);
+			pool->vacant--;
+		}
 	}
+	kfree(drbd_page_pools);
+	drbd_page_pools = NULL;
 
-	/* D_ASSERT(device, atomic_read(&drbd_pp_vacant)==0); */
+	/* Requests might still be on their way back through call_rcu() */
+	rcu_barrier();
+	drbd_obj_cache_exit(&drbd_peer_ack_objs);
+	drbd_obj_cache_exit(&drbd_ee_objs);
+	drbd_obj_cache_exit(&drbd_request_objs);
 
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
+	mempool_exit(&drbd_peer_ack_mempool);
 	mempool_exit(&drbd_ee_mempool);
 	mempool_exit(&drbd_request_mempool);
+	if (drbd_peer_ack_cache)
+		kmem_cache_destroy(drbd_peer_ack_cache);
 	if (drbd_ee_cache)
 		kmem_cache_destroy(drbd_ee_cache);
 	if (drbd_request_cache)
@@ -2622,6 +3071,7 @@ static void drbd_destroy_mempools(void)
 	drbd_request_cache   = NULL;
 	drbd_bm_ext_cache    = NULL;
 	drbd_al_ext_cache    = NULL;
+	drbd_peer_ack_cache  = NULL;
 
 	return;
 }
@@ -2630,7 +3080,7 @@ static int drbd_create_mempools(void)
 {
 	struct page *page;
 	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count;
-	int i, ret;
+	int i, node, ret;
 
 	/* caches */
 	drbd_request_cache = kmem_cache_create(
@@ -2653,6 +3103,11 @@ static int drbd_create_mempools(void)
 	if (drbd_al_ext_cache == NULL)
 		goto Enomem;
 
+	drbd_peer_ack_cache = kmem_cache_create(
+		"drbd_peer_ack", sizeof(struct drbd_peer_ack), 0, 0, NULL);
+	if (drbd_peer_ack_cache == NULL)
+		goto Enomem;
+
 	/* mempools */
 	ret = bioset_init(&drbd_io_bio_set, BIO_POOL_SIZE, 0, 0);
 	if (ret)
@@ -2676,17 +3131,35 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
-	/* drbd's page pool */
-	spin_lock_init(&drbd_pp_lock);
+	ret = mempool_init_slab_pool(&drbd_peer_ack_mempool, DRBD_MIN_POOL_PAGES,
+				     drbd_peer_ack_cache);
+	if (ret)
+		goto Enomem;
 
-	for (i = 0; i < number; i++) {
-		page = alloc_page(GFP_HIGHUSER);
-		if (!page)
-			goto Enomem;
-		set_page_chain_next_offset_size(page, drbd_pp_pool, 0, 0);
-		drbd_pp_pool = page;
+	if (drbd_obj_cache_init(&drbd_request_objs) ||
+	    drbd_obj_cache_init(&drbd_ee_objs) ||
+	    drbd_obj_cache_init(&drbd_peer_ack_objs))
+		goto Enomem;
+
+	/* drbd's page pools, the pre-allocated pages spread over the nodes */
+	drbd_page_pools = kcalloc(nr_node_ids, sizeof(*drbd_page_pools), GFP_KERNEL);
+	if (!drbd_page_pools)
+		goto Enomem;
+	for (node = 0; node < nr_node_ids; node++)
+		spin_lock_init(&drbd_page_pools[node].lock);
+
+	for_each_online_node(node) {
+		struct drbd_page_pool *pool = &drbd_page_pools[node];
+
+		for (i = 0; i < DIV_ROUND_UP(number, num_online_nodes()); i++) {
+			page = alloc_pages_node(node, GFP_HIGHUSER, 0);
+			if (!page)
+				goto Enomem;
+			set_page_chain_next_offset_size(page, pool->pages, 0, 0);
+			pool->pages = page;
+			pool->vacant++;
+		}
 	}
-	drbd_pp_vacant = number;
 
 	return 0;
 
@@ -2737,6 +3210,7 @@ void drbd_destroy_device(struct kref *kref)
 	free_openers(device);
 
 	lc_destroy(device->act_log);
+	kfree(device->submit_ctx);
 	for_each_peer_device_safe(peer_device, tmp, device) {
 		kref_debug_put(&peer_device->connection->kref_debug, 3);
 		kref_put(&peer_device->connection->kref, drbd_destroy_connection);
@@ -2782,7 +3256,8 @@ void drbd_reclaim_resource(struct rcu_head *rp)
 		kref_debug_put(&connection->kref_debug, 9);
 		kref_put(&connection->kref, drbd_destroy_connection);
 	}
-	mempool_free(resource->peer_ack_req, &drbd_request_mempool);
+	if (resource->peer_ack_req)
+		drbd_obj_free(&drbd_request_objs, resource->peer_ack_req);
 	kref_debug_put(&resource->kref_debug, 8);
 	kref_put(&resource->kref, drbd_destroy_resource);
 }
@@ -2798,6 +3273,9 @@ static struct retry_worker {
 	struct list_head writes;
 } retry;
 
+struct workqueue_struct *drbd_csum_wq;
+struct workqueue_struct *drbd_peer_submit_wq;
+
 void drbd_req_destroy_lock(struct kref *kref)
 {
 	struct drbd_request *req = container_of(kref, struct drbd_request, kref);
@@ -2896,6 +3374,12 @@ static void drbd_cleanup(void)
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
 
+	if (drbd_csum_wq)
+		destroy_workqueue(drbd_csum_wq);
+
+	if (drbd_peer_submit_wq)
+		destroy_workqueue(drbd_peer_submit_wq);
+
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
 
@@ -3274,18 +3758,23 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 		goto fail;
 
 	INIT_LIST_HEAD(&connection->current_epoch->list);
+	INIT_LIST_HEAD(&connection->current_epoch->parked);
 	connection->epochs = 1;
 	spin_lock_init(&connection->epoch_lock);
+	atomic_set(&connection->epoch_flushes, 0);
 
 	INIT_LIST_HEAD(&connection->todo.work_list);
 	connection->todo.req = NULL;
 
+	connection->pp_node = NUMA_NO_NODE;
 	atomic_set(&connection->ap_in_flight, 0);
 	atomic_set(&connection->rs_in_flight, 0);
 	connection->send.seen_any_write_yet = false;
 	connection->send.current_epoch_nr = 0;
 	connection->send.current_epoch_writes = 0;
 	connection->send.current_dagtag_sector = 0;
+	atomic64_set(&connection->send.bytes_handed, 0);
+	connection->send.zc_head = connection->send.zc_tail = 0;
 
 	connection->cstate[NOW] = C_STANDALONE;
 	connection->peer_role[NOW] = R_UNKNOWN;
@@ -3312,12 +3801,15 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	INIT_LIST_HEAD(&connection->read_ee);
 	INIT_LIST_HEAD(&connection->net_ee);
 	INIT_LIST_HEAD(&connection->done_ee);
+	spin_lock_init(&connection->csum_lock);
+	INIT_LIST_HEAD(&connection->csum_jobs);
 	init_waitqueue_head(&connection->ee_wait);
+	init_waitqueue_head(&connection->pp_wait);
 
 	kref_init(&connection->kref);
 	kref_debug_init(&connection->kref_debug, &connection->kref, &kref_class_connection);
 
-	INIT_WORK(&connection->peer_ack_work, drbd_send_peer_ack_wf);
+	INIT_DELAYED_WORK(&connection->peer_ack_work, drbd_send_peer_ack_wf);
 	INIT_WORK(&connection->send_acks_work, drbd_send_acks_wf);
 
 	kref_get(&resource->kref);
@@ -3419,6 +3911,7 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->propagate_uuids_work.cb = w_send_uuids;
 
 	mutex_init(&peer_device->resync_next_bit_mutex);
+	spin_lock_init(&peer_device->rs_prio_lock);
 
 	atomic_set(&peer_device->ap_pending_cnt, 0);
 	atomic_set(&peer_device->unacked_cnt, 0);
@@ -3432,6 +3925,26 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	return peer_device;
 }
 
+static void init_submit_contexts(struct drbd_device *device)
+{
+	unsigned int i, n = min(READ_ONCE(drbd_peer_submit_contexts), num_possible_cpus());
+
+	/* Without them the receiver submits itself */
+	device->submit_ctx = n ? kcalloc(n, sizeof(*device->submit_ctx), GFP_KERNEL) : NULL;
+	if (!device->submit_ctx)
+		return;
+
+	for (i = 0; i < n; i++) {
+		struct drbd_submit_ctx *ctx = &device->submit_ctx[i];
+
+		ctx->device = device;
+		INIT_WORK(&ctx->work, drbd_peer_submit_wf);
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->peer_writes);
+	}
+	device->nr_submit_ctx = n;
+}
+
 static int init_submitter(struct drbd_device *device)
 {
 	/* opencoded create_singlethread_workqueue(),
@@ -3444,6 +3957,12 @@ static int init_submitter(struct drbd_device *device)
 	INIT_LIST_HEAD(&device->submit.writes);
 	INIT_LIST_HEAD(&device->submit.peer_writes);
 	spin_lock_init(&device->submit.lock);
+
+	spin_lock_init(&device->flush.lock);
+	INIT_LIST_HEAD(&device->flush.waiters);
+	INIT_WORK(&device->flush.work, drbd_submit_flush_wf);
+
+	init_submit_contexts(device);
 	return 0;
 }
 
@@ -3496,6 +4015,10 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	atomic_set(&device->wait_for_actlog_ecnt, 0);
 	atomic_set(&device->local_cnt, 0);
 	atomic_set(&device->rs_sect_ev, 0);
+	atomic64_set(&device->app_lat_ns, 0);
+	atomic_set(&device->app_lat_cnt, 0);
+	device->app_lat_until = jiffies;
+	atomic_set(&device->rs_claim_ext, 0);
 	atomic_set(&device->md_io.in_use, 0);
 
 #ifdef CONFIG_DRBD_TIMING_STATS
@@ -3712,6 +4235,7 @@ void drbd_unregister_device(struct drbd_device *device)
 	drbd_debugfs_device_cleanup(device);
 	del_gendisk(device->vdisk);
 
+	drbd_flush_peer_submit(device);
 	destroy_workqueue(device->submit.wq);
 	device->submit.wq = NULL;
 	del_timer_sync(&device->request_timer);
@@ -3774,6 +4298,8 @@ void drbd_unregister_connection(struct drbd_connection *connection)
 	drbd_transport_shutdown(connection, DESTROY_TRANSPORT);
 	drbd_put_send_buffers(connection);
 	conn_free_crypto(connection);
+	drbd_compress_free(connection);
+	drbd_dedup_free(connection);
 }
 
 void del_connect_timer(struct drbd_connection *connection)
@@ -3889,6 +4415,18 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	drbd_csum_wq = alloc_workqueue("drbd_csum", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_csum_wq) {
+		pr_err("unable to create checksum workqueue\n");
+		goto fail;
+	}
+
+	drbd_peer_submit_wq = alloc_workqueue("drbd_peer_submit", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_peer_submit_wq) {
+		pr_err("unable to create peer submit workqueue\n");
+		goto fail;
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
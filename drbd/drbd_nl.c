@@ -1012,6 +1012,7 @@ retry:
 		idr_for_each_entry(&resource->devices, device, vnr) {
 			fsync_bdev(device->this_bdev);
 			flush_workqueue(device->submit.wq);
+			drbd_flush_peer_submit(device);
 		}
 
 		if (start_new_tl_epoch(resource)) {
@@ -3429,13 +3430,11 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	connection->fencing_policy = new_net_conf->fencing_policy;
 
 	if (!rsr) {
-		crypto_free_shash(connection->csums_tfm);
-		connection->csums_tfm = crypto.csums_tfm;
+		drbd_csum_replace_tfm(connection, &connection->csums_tfm, crypto.csums_tfm);
 		crypto.csums_tfm = NULL;
 	}
 	if (!ovr) {
-		crypto_free_shash(connection->verify_tfm);
-		connection->verify_tfm = crypto.verify_tfm;
+		drbd_csum_replace_tfm(connection, &connection->verify_tfm, crypto.verify_tfm);
 		crypto.verify_tfm = NULL;
 	}
 
@@ -3762,7 +3761,9 @@ static int adm_new_connection(struct drbd_connection **ret_conn,
 	idr_for_each_entry(&connection->peer_devices, peer_device, i) {
 		struct drbd_device *device = peer_device->device;
 
-		peer_device->resync_susp_other_c[NOW] =
+		/* With resync_multi_source, pausing a new sync source is up
+		   to the state change that makes it one */
+		peer_device->resync_susp_other_c[NOW] = !READ_ONCE(drbd_resync_multi_source) &&
 			is_resync_target_in_other_connection(peer_device);
 		list_add_rcu(&peer_device->peer_devices, &device->peer_devices);
 		kref_get(&connection->kref);
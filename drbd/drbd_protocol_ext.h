@@ -0,0 +1,66 @@
+#ifndef DRBD_PROTOCOL_EXT_H
+#define DRBD_PROTOCOL_EXT_H
+
+/* Feature flags and dp_flags not (yet) in drbd-headers/drbd_protocol.h.
+ * These are on-wire values. They belong with the DRBD_FF_* and DP_* there;
+ * move them over, and renumber them if upstream took the bits in the
+ * meantime, with the next update of drbd-headers.
+ *
+ * To stay clear of upstream assignments, they are allocated from the top:
+ *   DRBD_FF_*  bits 31 .. 26
+ *   DP_*       bits 19 .. 13, and bits 31 .. 20 for a size in sectors
+ *              (DP_RAW_SECTORS_SHIFT)
+ * The special block_id values ID_CSUM_BATCH, ID_OV_DESCEND and ID_RS_PUSH
+ * are next to ID_IN_SYNC and ID_SYNCER in drbd_int.h.
+ */
+
+/* Payload compression, see drbd_compress.c */
+#define DRBD_FF_COMPRESS_LZ4	(1U << 30)
+#define DRBD_FF_COMPRESS_ZSTD	(1U << 31)
+#define DP_COMPRESS_LZ4		(1U << 18)
+#define DP_COMPRESS_ZSTD	(1U << 19)
+#define DP_COMPRESSED		(DP_COMPRESS_LZ4 | DP_COMPRESS_ZSTD)
+/* uncompressed size in sectors, in the upper 12 bits of dp_flags */
+#define DP_RAW_SECTORS_SHIFT	20
+
+/* Batched checksum based resync, see w_e_send_csum().
+ * A P_CSUM_RS_REQUEST with block_id ID_CSUM_BATCH carries one digest per
+ * BM_BLOCK_SIZE chunk. The sync source answers with one P_RS_DATA_REPLY per
+ * run of differing chunks (DP_RS_BATCH_PART), followed by a P_RS_DATA_REPLY
+ * with block_id ID_CSUM_BATCH and DP_RS_BATCH_DONE that carries the bitmap
+ * of differing chunks instead of data; the size of the request is in the
+ * upper bits of dp_flags, as with DP_RAW_SECTORS_SHIFT.
+ * A batch covers exactly one resync request. */
+#define DRBD_FF_CSUM_BATCH	(1U << 29)
+#define DP_RS_BATCH_PART	(1U << 16)
+#define DP_RS_BATCH_DONE	(1U << 17)
+
+/* Hierarchical online verify, see make_ov_request() and ov_tree_descend().
+ * P_OV_REQUESTs cover up to verify_tree_kb; if the digests of such a range
+ * differ, the verify source answers with a P_OV_RESULT with block_id
+ * ID_OV_DESCEND and verifies the parts of the range instead. */
+#define DRBD_FF_OV_TREE		(1U << 28)
+#define DRBD_OV_TREE_FANOUT	4
+
+/* Streaming resync, see make_resync_push().
+ * Instead of requesting each block, the sync target sends a single
+ * P_RS_DATA_REQUEST with block_id ID_RS_PUSH and size 0; the sync source then
+ * reads the out-of-sync blocks from that sector on in sequence and sends them
+ * as P_RS_DATA_REPLY with DP_RS_PUSH, keeping up to resync_push_kb unacked.
+ * At the end of the bitmap it sends a P_RS_DATA_REPLY with block_id
+ * ID_RS_PUSH and no data, and the sync target requests whatever is left.
+ * With DRBD_FF_THIN_RESYNC, runs of zeroes are streamed as P_RS_DEALLOCATED
+ * of up to a resync extent, see send_rs_push_sparse(). */
+#define DRBD_FF_RS_PUSH		(1U << 27)
+#define DP_RS_PUSH		(1U << 15)
+
+/* Deduplication of streamed resync data, see drbd_dedup.c. The block_id of
+ * these packets carries the number of the (first) chunk in the dictionary;
+ * a DP_RS_DEDUP_REF packet has no data and stands for one BM_BLOCK_SIZE chunk.
+ * Both sides keep DRBD_DEDUP_SLOTS chunks. */
+#define DRBD_FF_RS_DEDUP	(1U << 26)
+#define DP_RS_DEDUP_STORE	(1U << 14)
+#define DP_RS_DEDUP_REF		(1U << 13)
+#define DRBD_DEDUP_SLOTS	256
+
+#endif
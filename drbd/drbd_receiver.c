@@ -167,6 +167,7 @@ void conn_disconnect(struct drbd_connection *connection);
 
 static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *, struct drbd_epoch *, enum epoch_event);
 static int e_end_block(struct drbd_work *, int);
+static void queue_parked_peer_writes(struct list_head *parked);
 static void cleanup_unacked_peer_requests(struct drbd_connection *connection);
 static void cleanup_peer_ack_list(struct drbd_connection *connection);
 static u64 node_ids_to_bitmap(struct drbd_device *device, u64 node_ids);
@@ -283,44 +284,132 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
-static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
+static struct page *page_pool_take(struct drbd_page_pool *pool, unsigned int number)
 {
 	struct page *page = NULL;
-	struct page *tmp = NULL;
-	unsigned int i = 0;
 
-	/* Yes, testing drbd_pp_vacant outside the lock is racy.
+	/* Yes, testing pool->vacant outside the lock is racy.
 	 * So what. It saves a spin_lock. */
-	if (drbd_pp_vacant >= number) {
-		spin_lock(&drbd_pp_lock);
-		page = page_chain_del(&drbd_pp_pool, number);
+	if (pool->vacant >= number) {
+		spin_lock(&pool->lock);
+		page = page_chain_del(&pool->pages, number);
 		if (page)
-			drbd_pp_vacant -= number;
-		spin_unlock(&drbd_pp_lock);
+			pool->vacant -= number;
+		spin_unlock(&pool->lock);
+	}
+	return page;
+}
+
+static void page_pool_give(struct drbd_page_pool *pool,
+		struct page *chain_first, struct page *chain_last, int n)
+{
+	spin_lock(&pool->lock);
+	page_chain_add(&pool->pages, chain_first, chain_last);
+	pool->vacant += n;
+	spin_unlock(&pool->lock);
+}
+
+/* Beyond that many vacant pages, a pool returns freed pages to the system */
+static int page_pool_max(void)
+{
+	return DIV_ROUND_UP((DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count,
+			    num_online_nodes());
+}
+
+/* Allocates number pages in blocks of up to 2^page_alloc_order physically
+ * contiguous pages, without reclaim. Each block is split into order-0 pages,
+ * chained in ascending order, so everything that deals with page chains
+ * stays as it is, while bio_add_page() merges them into few segments. */
+static struct page *alloc_page_blocks(struct drbd_page_pool *pool, int node,
+				      unsigned int number, gfp_t gfp_mask)
+{
+	/* PAGE_ALLOC_COSTLY_ORDER exists on all kernels, unlike MAX_ORDER */
+	unsigned int max_order = min_t(unsigned int, READ_ONCE(drbd_page_alloc_order),
+				       PAGE_ALLOC_COSTLY_ORDER);
+	struct page *page = NULL, *last = NULL, *block;
+	unsigned int i = 0, j, n, order;
+
+	gfp_mask = (gfp_mask & ~__GFP_RECLAIM) | __GFP_NOWARN | __GFP_NORETRY;
+	while (i < number) {
+		order = min_t(unsigned int, max_order, ilog2(number - i));
+		block = alloc_pages_node(node, gfp_mask, order);
+		if (!block)
+			break;
+		split_page(block, order);
+		n = 1U << order;
+		for (j = 0; j < n; j++) {
+			struct page *tmp = nth_page(block, j);
+
+			set_page_chain_next_offset_size(tmp, NULL, 0, 0);
+			if (last)
+				set_page_chain_next(last, tmp);
+			else
+				page = tmp;
+			last = tmp;
+		}
+		i += n;
+	}
+
+	if (i == number) {
+		atomic_long_inc(&pool->from_blocks);
+		return page;
+	}
+	if (page)
+		page_pool_give(pool, page, last, i);
+	return NULL;
+}
+
+static struct page *__drbd_alloc_pages(int node, unsigned int number, gfp_t gfp_mask)
+{
+	struct drbd_page_pool *pool = &drbd_page_pools[node];
+	struct page *page;
+	struct page *tmp = NULL;
+	unsigned int i = 0;
+	int n;
+
+	/* Freed pages go back to the pool as single pages, so taking from the
+	 * pool first would hardly ever leave data of several pages contiguous.
+	 * The pool is the fallback if the system has no free pages at hand. */
+	if (number > 1 && READ_ONCE(drbd_page_alloc_order)) {
+		page = alloc_page_blocks(pool, node, number, gfp_mask);
 		if (page)
 			return page;
 	}
 
 	for (i = 0; i < number; i++) {
-		tmp = alloc_page(gfp_mask);
+		tmp = alloc_pages_node(node, gfp_mask, 0);
 		if (!tmp)
 			break;
 		set_page_chain_next_offset_size(tmp, page, 0, 0);
 		page = tmp;
 	}
 
-	if (i == number)
+	if (i == number) {
+		atomic_long_inc(&pool->from_system);
 		return page;
+	}
 
 	/* Not enough pages immediately available this time.
 	 * No need to jump around here, drbd_alloc_pages will retry this
 	 * function "soon". */
+	if (page)
+		page_pool_give(pool, page, page_chain_tail(page, NULL), i);
+
+	page = page_pool_take(pool, number);
 	if (page) {
-		tmp = page_chain_tail(page, NULL);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
+		atomic_long_inc(&pool->from_pool);
+		return page;
+	}
+
+	/* Rather use remote memory than wait */
+	for_each_online_node(n) {
+		if (n == node)
+			continue;
+		page = page_pool_take(&drbd_page_pools[n], number);
+		if (page) {
+			atomic_long_inc(&pool->from_remote);
+			return page;
+		}
 	}
 	return NULL;
 }
@@ -366,6 +455,15 @@ static void drbd_reclaim_net_peer_reqs(struct drbd_connection *connection)
 		drbd_free_net_peer_req(peer_req);
 }
 
+/* Whether local IO holds pages of this connection, which it gives back
+ * without any help from the peer */
+static bool pp_local_io_pending(struct drbd_connection *connection)
+{
+	return atomic_read(&connection->active_ee_cnt) ||
+		atomic_read(&connection->done_ee_cnt) ||
+		!list_empty_careful(&connection->sync_ee);
+}
+
 /**
  * drbd_alloc_pages() - Returns @number pages, retries forever (or until signalled)
  * @device:	DRBD device.
@@ -376,13 +474,15 @@ static void drbd_reclaim_net_peer_reqs(struct drbd_connection *connection)
  * the kernel.
  * Possibly retry until DRBD frees sufficient pages somewhere else.
  *
- * If this allocation would exceed the max_buffers setting, we throttle
- * allocation (schedule_timeout) to give the system some room to breathe.
+ * If this allocation would exceed the max_buffers setting, we wait on
+ * connection->pp_wait until pages of this connection are given back.
  *
  * We do not use max-buffers as hard limit, because it could lead to
  * congestion and further to a distributed deadlock during online-verify or
  * (checksum based) resync, if the max-buffers, socket buffer sizes and
- * resync-rate settings are mis-configured.
+ * resync-rate settings are mis-configured. Only when no local IO holds
+ * pages of this connection, the pages can only come back with the help of
+ * the peer, and we stop waiting for them after a while.
  *
  * Returns a page chain linked via (struct drbd_page_chain*)&page->lru.
  */
@@ -394,13 +494,18 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 	struct page *page = NULL;
 	DEFINE_WAIT(wait);
 	unsigned int mxb;
+	int node = READ_ONCE(connection->pp_node);
+	ktime_t wait_start = 0;
+
+	if (node == NUMA_NO_NODE)
+		node = numa_node_id();
 
 	rcu_read_lock();
 	mxb = rcu_dereference(transport->net_conf)->max_buffers;
 	rcu_read_unlock();
 
 	if (atomic_read(&connection->pp_in_use) < mxb)
-		page = __drbd_alloc_pages(number, gfp_mask & ~__GFP_RECLAIM);
+		page = __drbd_alloc_pages(node, number, gfp_mask & ~__GFP_RECLAIM);
 
 	/* Try to keep the fast path fast, but occasionally we need
 	 * to reclaim the pages we lent to the network stack. */
@@ -408,12 +513,14 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 		drbd_reclaim_net_peer_reqs(connection);
 
 	while (page == NULL) {
-		prepare_to_wait(&drbd_pp_wait, &wait, TASK_INTERRUPTIBLE);
+		wait_queue_head_t *wq;
+		bool credit;
 
 		drbd_reclaim_net_peer_reqs(connection);
 
-		if (atomic_read(&connection->pp_in_use) < mxb) {
-			page = __drbd_alloc_pages(number, gfp_mask);
+		credit = atomic_read(&connection->pp_in_use) < mxb;
+		if (credit) {
+			page = __drbd_alloc_pages(node, number, gfp_mask);
 			if (page)
 				break;
 		}
@@ -426,10 +533,37 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 			break;
 		}
 
-		if (schedule_timeout(HZ/10) == 0)
-			mxb = UINT_MAX;
+		if (!wait_start) {
+			wait_start = ktime_get();
+			connection->pp_stats.waits++;
+		}
+
+		if (credit) {
+			/* Out of memory. DRBD freeing pages wakes us, anybody else does not */
+			wq = &drbd_pp_wait;
+			connection->pp_stats.mem_waits++;
+		} else {
+			wq = &connection->pp_wait;
+		}
+
+		prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
+		if (credit) {
+			schedule_timeout(HZ/10);
+		} else if (atomic_read(&connection->pp_in_use) >= mxb) {
+			if (pp_local_io_pending(connection)) {
+				/* It gives pages back and wakes us, the timeout is a safety net */
+				schedule_timeout(HZ);
+			} else if (schedule_timeout(HZ/10) == 0) {
+				/* Nothing came back, and only the peer could help. */
+				mxb = UINT_MAX;
+				connection->pp_stats.overrides++;
+			}
+		}
+		finish_wait(wq, &wait);
 	}
-	finish_wait(&drbd_pp_wait, &wait);
+
+	if (wait_start)
+		connection->pp_stats.wait_ns += ktime_to_ns(ktime_sub(ktime_get(), wait_start));
 
 	if (page)
 		atomic_add(number, &connection->pp_in_use);
@@ -437,32 +571,35 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 }
 
 /* Must not be used from irq, as that may deadlock: see drbd_alloc_pages.
- * Either links the page chain back to the global pool,
- * or returns all pages to the system. */
+ * Either links the page chain back to the pool of the node of its
+ * first page, or returns all pages to the system. */
 void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is_net)
 {
 	struct drbd_connection *connection =
 		container_of(transport, struct drbd_connection, transport);
 	atomic_t *a = is_net ? &connection->pp_in_use_by_net : &connection->pp_in_use;
+	struct drbd_page_pool *pool;
 	int i;
 
 	if (page == NULL)
 		return;
 
-	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count)
+	pool = &drbd_page_pools[page_to_nid(page)];
+	if (pool->vacant > page_pool_max()) {
 		i = page_chain_free(page);
-	else {
+		atomic_long_inc(&pool->to_system);
+	} else {
 		struct page *tmp;
 		tmp = page_chain_tail(page, &i);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
+		page_pool_give(pool, page, tmp, i);
+		atomic_long_inc(&pool->to_pool);
 	}
 	i = atomic_sub_return(i, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
 			is_net ? "pp_in_use_by_net" : "pp_in_use", i);
+	if (!is_net)
+		wake_up(&connection->pp_wait);
 	wake_up(&drbd_pp_wait);
 }
 
@@ -478,7 +615,7 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 	if (drbd_insert_fault(device, DRBD_FAULT_AL_EE))
 		return NULL;
 
-	peer_req = mempool_alloc(&drbd_ee_mempool, gfp_mask & ~__GFP_HIGHMEM);
+	peer_req = drbd_obj_alloc(&drbd_ee_objs, gfp_mask & ~__GFP_HIGHMEM);
 	if (!peer_req) {
 		if (!(gfp_mask & __GFP_NOWARN))
 			drbd_err(device, "%s: allocation failed\n", __func__);
@@ -503,10 +640,11 @@ void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 	might_sleep();
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
+	kfree(peer_req->csums);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
 	D_ASSERT(peer_device, drbd_interval_empty(&peer_req->i));
 	drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
-	mempool_free(peer_req, &drbd_ee_mempool);
+	drbd_obj_free(&drbd_ee_objs, peer_req);
 }
 
 int drbd_free_peer_reqs(struct drbd_connection *connection, struct list_head *list, bool is_net_ee)
@@ -1001,54 +1139,141 @@ static int drbd_recv_header_maybe_unplug(struct drbd_connection *connection, str
 /* This is blkdev_issue_flush, but asynchronous.
  * We want to submit to all component volumes in parallel,
  * then wait for all completions.
+ * With an epoch, nobody waits; the completion of the last flush
+ * queues w_epoch_flushed() instead, see drbd_flush_epoch_async().
  */
 struct issue_flush_context {
 	atomic_t pending;
 	int error;
 	struct completion done;
+	struct drbd_epoch *epoch;
+	struct drbd_work w;
 };
+/* One per device and issue_flush_context, on device->flush.waiters */
 struct one_flush_context {
+	struct list_head list;
+	u64 gen;
 	struct drbd_device *device;
 	struct issue_flush_context *ctx;
 };
 
-static void one_flush_endio(struct bio *bio)
+static int w_epoch_flushed(struct drbd_work *w, int cancel);
+
+static void flush_context_done(struct issue_flush_context *ctx)
 {
-	struct one_flush_context *octx = bio->bi_private;
-	struct drbd_device *device = octx->device;
-	struct issue_flush_context *ctx = octx->ctx;
+	struct drbd_connection *connection;
+
+	if (!ctx->epoch) {
+		complete(&ctx->done);
+		return;
+	}
+
+	connection = ctx->epoch->connection;
+	ctx->w.cb = w_epoch_flushed;
+	drbd_queue_work(&connection->sender_work, &ctx->w);
+	if (atomic_dec_and_test(&connection->epoch_flushes))
+		wake_up(&connection->ee_wait);
+}
+
+static void flush_done(struct drbd_device *device, int error)
+{
+	struct drbd_flush_agg *fa = &device->flush;
+	struct one_flush_context *octx, *tmp;
+	bool follow_up = false;
+	unsigned long flags;
+	LIST_HEAD(done);
 
+	spin_lock_irqsave(&fa->lock, flags);
+	list_for_each_entry_safe(octx, tmp, &fa->waiters, list) {
+		if (octx->gen > fa->gen)
+			break;
+		list_move_tail(&octx->list, &done);
+	}
+	if (fa->follow_up) {
+		fa->follow_up = false;
+		fa->gen++;
+		fa->submitted++;
+		follow_up = true;
+	} else {
+		fa->in_flight = false;
+	}
+	spin_unlock_irqrestore(&fa->lock, flags);
+
+	/* The waiters of the follow-up flush keep the device and ldev alive */
+	if (follow_up)
+		queue_work(device->submit.wq, &fa->work);
+
+	list_for_each_entry_safe(octx, tmp, &done, list) {
+		struct issue_flush_context *ctx = octx->ctx;
+
+		if (error)
+			ctx->error = error;
+		kfree(octx);
+
+		put_ldev(device);
+		kref_debug_put(&device->kref_debug, 7);
+		kref_put(&device->kref, drbd_destroy_device);
+
+		if (atomic_dec_and_test(&ctx->pending))
+			flush_context_done(ctx);
+	}
+}
+
+static void one_flush_endio(struct bio *bio)
+{
+	struct drbd_device *device = bio->bi_private;
 	blk_status_t status = bio->bi_status;
 
-	if (status) {
-		ctx->error = blk_status_to_errno(status);
+	if (status)
 		drbd_info(device, "local disk FLUSH FAILED with status %d\n", status);
-	}
-	kfree(octx);
 	bio_put(bio);
 
 	clear_bit(FLUSH_PENDING, &device->flags);
-	put_ldev(device);
-	kref_debug_put(&device->kref_debug, 7);
-	kref_put(&device->kref, drbd_destroy_device);
-
-	if (atomic_dec_and_test(&ctx->pending))
-		complete(&ctx->done);
+	flush_done(device, status ? blk_status_to_errno(status) : 0);
 }
 
-static void submit_one_flush(struct drbd_device *device, struct issue_flush_context *ctx)
+/* Called with device->flush.in_flight set, and at least one waiter
+ * holding a reference on device->ldev */
+static void submit_flush_bio(struct drbd_device *device)
 {
 	struct bio *bio = bio_alloc(GFP_NOIO, 0);
-	struct one_flush_context *octx = kmalloc(sizeof(*octx), GFP_NOIO);
-	if (!bio || !octx) {
+
+	if (!bio) {
 		drbd_warn(device, "Could not allocate a bio, CANNOT ISSUE FLUSH\n");
 		/* FIXME: what else can I do now?  disconnecting or detaching
 		 * really does not help to improve the state of the world, either.
 		 */
-		kfree(octx);
-		if (bio)
-			bio_put(bio);
+		flush_done(device, -ENOMEM);
+		return;
+	}
+
+	bio_set_dev(bio, device->ldev->backing_bdev);
+	bio->bi_private = device;
+	bio->bi_end_io = one_flush_endio;
+
+	device->flush_jif = jiffies;
+	set_bit(FLUSH_PENDING, &device->flags);
+	bio->bi_opf = REQ_OP_FLUSH | REQ_PREFLUSH;
+	submit_bio(bio);
+}
+
+void drbd_submit_flush_wf(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, flush.work);
+
+	submit_flush_bio(device);
+}
 
+/* The caller holds a reference on device and device->ldev, which is
+ * dropped once a flush submitted after this call completed. */
+static void submit_one_flush(struct drbd_device *device, struct issue_flush_context *ctx)
+{
+	struct drbd_flush_agg *fa = &device->flush;
+	struct one_flush_context *octx = kmalloc(sizeof(*octx), GFP_NOIO);
+	bool submit = false;
+
+	if (!octx) {
+		drbd_warn(device, "Could not allocate a flush context, CANNOT ISSUE FLUSH\n");
 		ctx->error = -ENOMEM;
 		put_ldev(device);
 		kref_debug_put(&device->kref_debug, 7);
@@ -1058,15 +1283,46 @@ static void submit_one_flush(struct drbd_device *device, struct issue_flush_cont
 
 	octx->device = device;
 	octx->ctx = ctx;
-	bio_set_dev(bio, device->ldev->backing_bdev);
-	bio->bi_private = octx;
-	bio->bi_end_io = one_flush_endio;
-
-	device->flush_jif = jiffies;
-	set_bit(FLUSH_PENDING, &device->flags);
 	atomic_inc(&ctx->pending);
-	bio->bi_opf = REQ_OP_FLUSH | REQ_PREFLUSH;
-	submit_bio(bio);
+
+	spin_lock_irq(&fa->lock);
+	fa->requested++;
+	if (!fa->in_flight) {
+		fa->in_flight = true;
+		fa->submitted++;
+		octx->gen = ++fa->gen;
+		submit = true;
+	} else {
+		/* The flush in flight may have been submitted before the
+		 * writes we want to cover completed, wait for the next one */
+		octx->gen = fa->gen + 1;
+		fa->follow_up = true;
+	}
+	list_add_tail(&octx->list, &fa->waiters);
+	spin_unlock_irq(&fa->lock);
+
+	if (submit)
+		submit_flush_bio(device);
+}
+
+static void submit_flushes(struct drbd_resource *resource, struct issue_flush_context *ctx)
+{
+	struct drbd_device *device;
+	int vnr;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (!get_ldev(device))
+			continue;
+		kref_get(&device->kref);
+		kref_debug_get(&device->kref_debug, 7);
+		rcu_read_unlock();
+
+		submit_one_flush(device, ctx);
+
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
 }
 
 static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connection, struct drbd_epoch *epoch)
@@ -1074,27 +1330,14 @@ static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connecti
 	struct drbd_resource *resource = connection->resource;
 
 	if (resource->write_ordering >= WO_BDEV_FLUSH) {
-		struct drbd_device *device;
 		struct issue_flush_context ctx;
-		int vnr;
 
 		atomic_set(&ctx.pending, 1);
 		ctx.error = 0;
 		init_completion(&ctx.done);
+		ctx.epoch = NULL;
 
-		rcu_read_lock();
-		idr_for_each_entry(&resource->devices, device, vnr) {
-			if (!get_ldev(device))
-				continue;
-			kref_get(&device->kref);
-			kref_debug_get(&device->kref_debug, 7);
-			rcu_read_unlock();
-
-			submit_one_flush(device, &ctx);
-
-			rcu_read_lock();
-		}
-		rcu_read_unlock();
+		submit_flushes(resource, &ctx);
 
 		/* Do we want to add a timeout,
 		 * if disk-timeout is set? */
@@ -1117,6 +1360,53 @@ static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connecti
 	return drbd_may_finish_epoch(connection, epoch, EV_BARRIER_DONE);
 }
 
+/* Called from drbd_may_finish_epoch() once all writes of the epoch completed,
+ * with a reference on the epoch that w_epoch_flushed() drops again.
+ * Unlike drbd_flush_after_epoch(), this does not wait for the flushes, so
+ * neither the receiver nor the ack_sender get stuck behind a slow disk. */
+static void drbd_flush_epoch_async(struct drbd_connection *connection, struct drbd_epoch *epoch)
+{
+	struct issue_flush_context *ctx;
+
+	ctx = kmalloc(sizeof(*ctx), GFP_NOIO);
+	if (!ctx) {
+		drbd_warn(connection, "Could not kmalloc a flush context, flushing synchronously\n");
+		drbd_flush_after_epoch(connection, epoch);
+		drbd_may_finish_epoch(connection, epoch, EV_PUT);
+		return;
+	}
+
+	atomic_set(&ctx->pending, 1);
+	ctx->error = 0;
+	ctx->epoch = epoch;
+	atomic_inc(&connection->epoch_flushes);
+
+	submit_flushes(connection->resource, ctx);
+
+	if (atomic_dec_and_test(&ctx->pending))
+		flush_context_done(ctx);
+}
+
+static int w_epoch_flushed(struct drbd_work *w, int cancel)
+{
+	struct issue_flush_context *ctx = container_of(w, struct issue_flush_context, w);
+	struct drbd_epoch *epoch = ctx->epoch;
+	struct drbd_connection *connection = epoch->connection;
+	int error = ctx->error;
+
+	kfree(ctx);
+
+	/* Any error is already reported by bio_endio callback. */
+	if (error)
+		drbd_bump_write_ordering(connection->resource, NULL, WO_DRAIN_IO);
+
+	drbd_may_finish_epoch(connection, epoch, EV_BARRIER_DONE);
+	drbd_may_finish_epoch(connection, epoch, EV_PUT |
+			      (connection->cstate[NOW] < C_CONNECTED ? EV_CLEANUP : 0));
+
+	return 0;
+}
+
 static int w_flush(struct drbd_work *w, int cancel)
 {
 	struct flush_work *fw = container_of(w, struct flush_work, w);
@@ -1205,10 +1495,11 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 					       enum epoch_event ev)
 {
 	int finish, epoch_size;
-	struct drbd_epoch *next_epoch;
+	struct drbd_epoch *next_epoch, *flush_epoch = NULL;
 	int schedule_flush = 0;
 	enum finish_epoch rv = FE_STILL_LIVE;
 	struct drbd_resource *resource = connection->resource;
+	LIST_HEAD(parked);
 
 	spin_lock(&connection->epoch_lock);
 	do {
@@ -1246,7 +1537,9 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 		    !test_bit(DE_IS_FINISHING, &epoch->flags)) {
 			/* Nearly all conditions are met to finish that epoch... */
 			if (test_bit(DE_BARRIER_IN_NEXT_EPOCH_DONE, &epoch->flags) ||
-			    resource->write_ordering == WO_NONE ||
+			    resource->write_ordering <= WO_DRAIN_IO ||
+			    (resource->write_ordering == WO_BDEV_FLUSH &&
+			     !test_bit(DE_NEEDS_FLUSH, &epoch->flags)) ||
 			    (epoch_size == 1 && test_bit(DE_CONTAINS_A_BARRIER, &epoch->flags)) ||
 			    ev & EV_CLEANUP) {
 				finish = 1;
@@ -1255,6 +1548,11 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 				 resource->write_ordering == WO_BIO_BARRIER) {
 				atomic_inc(&epoch->active);
 				schedule_flush = 1;
+			} else if (!test_bit(DE_BARRIER_IN_NEXT_EPOCH_ISSUED, &epoch->flags) &&
+				   resource->write_ordering == WO_BDEV_FLUSH) {
+				set_bit(DE_BARRIER_IN_NEXT_EPOCH_ISSUED, &epoch->flags);
+				atomic_inc(&epoch->active);
+				flush_epoch = epoch;
 			}
 		}
 		if (finish) {
@@ -1269,6 +1567,8 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 			if (connection->current_epoch != epoch) {
 				next_epoch = list_entry(epoch->list.next, struct drbd_epoch, list);
 				list_del(&epoch->list);
+				/* next_epoch is the oldest now, see park_peer_write() */
+				list_splice_tail_init(&next_epoch->parked, &parked);
 				ev = EV_BECAME_LAST | (ev & EV_CLEANUP);
 				connection->epochs--;
 				kfree(epoch);
@@ -1284,6 +1584,8 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 				if (rv == FE_STILL_LIVE)
 					rv = FE_RECYCLED;
 			}
+			/* receive_Barrier() may wait for that */
+			wake_up(&connection->ee_wait);
 		}
 
 		if (!next_epoch)
@@ -1294,6 +1596,11 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 
 	spin_unlock(&connection->epoch_lock);
 
+	queue_parked_peer_writes(&parked);
+
+	if (flush_epoch)
+		drbd_flush_epoch_async(connection, flush_epoch);
+
 	if (schedule_flush) {
 		struct flush_work *fw;
 		fw = kmalloc(sizeof(*fw), GFP_ATOMIC);
@@ -1330,6 +1637,15 @@ max_allowed_wo(struct drbd_backing_dev *bdev, enum write_ordering_e wo)
 	return wo;
 }
 
+/* FUA writes are as good as a flush after them if the device does them
+ * natively, or if it has no volatile write cache to begin with. */
+static bool fua_ordering_ok(struct drbd_backing_dev *bdev)
+{
+	struct request_queue *q = bdev_get_queue(bdev->backing_bdev);
+
+	return queue_fua_or_no_write_cache(q);
+}
+
 /**
  * drbd_bump_write_ordering() - Fall back to an other write ordering method
  * @resource:	DRBD resource.
@@ -1340,6 +1656,7 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
 {
 	struct drbd_device *device;
 	enum write_ordering_e pwo;
+	bool pfua, fua = READ_ONCE(drbd_fua_ordering);
 	int vnr, i = 0;
 	static char *write_ordering_str[] = {
 		[WO_NONE] = "none",
@@ -1349,6 +1666,7 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
 	};
 
 	pwo = resource->write_ordering;
+	pfua = resource->write_ordering_fua;
 	if (wo != WO_BIO_BARRIER)
 		wo = min(pwo, wo);
 	rcu_read_lock();
@@ -1358,20 +1676,27 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
 
 		if (get_ldev(device)) {
 			wo = max_allowed_wo(device->ldev, wo);
+			fua = fua && fua_ordering_ok(device->ldev);
 			if (device->ldev == bdev)
 				bdev = NULL;
 			put_ldev(device);
 		}
 	}
 
-	if (bdev)
+	if (bdev) {
 		wo = max_allowed_wo(bdev, wo);
+		fua = fua && fua_ordering_ok(bdev);
+	}
 
 	rcu_read_unlock();
 
 	resource->write_ordering = wo;
-	if (pwo != resource->write_ordering || wo == WO_BIO_BARRIER)
-		drbd_info(resource, "Method to ensure write ordering: %s\n", write_ordering_str[resource->write_ordering]);
+	resource->write_ordering_fua = fua && wo == WO_BDEV_FLUSH;
+	if (pwo != resource->write_ordering || pfua != resource->write_ordering_fua ||
+	    wo == WO_BIO_BARRIER)
+		drbd_info(resource, "Method to ensure write ordering: %s%s\n",
+			  write_ordering_str[resource->write_ordering],
+			  resource->write_ordering_fua ? " (fua)" : "");
 }
 
 /*
@@ -1667,6 +1992,7 @@ next_bio:
 	atomic_set(&peer_req->pending_bios, n_bios);
 	/* for debugfs: update timestamp, mark as submitted */
 	peer_req->submit_jif = jiffies;
+	peer_req->submit_kt = drbd_app_io_start(device);
 	peer_req->flags |= EE_SUBMITTED;
 	do {
 		bio = bios;
@@ -1807,29 +2133,12 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 	 * the activity log, which means it would not be resynced in case the
 	 * R_PRIMARY crashes now.
 	 * Therefore we must send the barrier_ack after the barrier request was
-	 * completed. */
-	switch (connection->resource->write_ordering) {
-	case WO_BIO_BARRIER:
-	case WO_NONE:
-		if (rv == FE_RECYCLED)
-			return 0;
-		break;
-
-	case WO_BDEV_FLUSH:
-	case WO_DRAIN_IO:
-		if (rv == FE_STILL_LIVE) {
-			set_bit(DE_BARRIER_IN_NEXT_EPOCH_ISSUED, &connection->current_epoch->flags);
-			conn_wait_active_ee_empty_or_disconnect(connection);
-			rv = drbd_flush_after_epoch(connection, connection->current_epoch);
-		}
-		if (rv == FE_RECYCLED)
-			return 0;
-
-		/* The ack_sender will send all the ACKs and barrier ACKs out, since
-		   all EEs moved from the active_ee to the done_ee. We need to
-		   provide a new epoch object for the EEs that come in soon */
-		break;
-	}
+	 * completed. With WO_BDEV_FLUSH, drbd_may_finish_epoch() issues that
+	 * flush without waiting for it once all writes of the epoch are done,
+	 * and the completion of the flush finishes the epoch.
+	 * Writes of the next epoch are parked until then, see park_peer_write(). */
+	if (rv == FE_RECYCLED)
+		return 0;
 
 	/* receiver context, in the writeout path of the other node.
 	 * avoid potential distributed deadlock */
@@ -1842,6 +2151,11 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 			rv = drbd_flush_after_epoch(connection, connection->current_epoch);
 			if (rv == FE_RECYCLED)
 				return 0;
+		} else {
+			/* The flush may be in flight, see drbd_flush_epoch_async() */
+			wait_event(connection->ee_wait,
+				   atomic_read(&connection->current_epoch->epoch_size) == 0 ||
+				   connection->cstate[NOW] < C_CONNECTED);
 		}
 
 		conn_wait_done_ee_empty_or_disconnect(connection);
@@ -1849,6 +2163,8 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 		return 0;
 	}
 
+	INIT_LIST_HEAD(&epoch->parked);
+
 	spin_lock(&connection->epoch_lock);
 	if (atomic_read(&connection->current_epoch->epoch_size)) {
 		list_add(&epoch->list, &connection->current_epoch->list);
@@ -1882,6 +2198,54 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	d->length = pi->size;
 	d->bi_size = is_trim_or_wsame ? be32_to_cpu(p->size) : pi->size - digest_size;
 	d->digest_size = digest_size;
+	if (!is_trim_or_wsame && d->dp_flags & (DP_COMPRESSED | DP_RS_BATCH_DONE))
+		d->bi_size = (d->dp_flags >> DP_RAW_SECTORS_SHIFT) << 9;
+	if (pi->cmd == P_RS_DATA_REPLY && d->dp_flags & DP_RS_DEDUP_REF) {
+		d->bi_size = BM_BLOCK_SIZE;
+		d->digest_size = 0;
+	}
+}
+
+/* Receive and decompress the payload into a newly allocated page chain */
+static int recv_compressed_pages(struct drbd_peer_device *peer_device,
+				 struct drbd_peer_request *peer_req,
+				 struct drbd_peer_request_details *d)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_transport *transport = &connection->transport;
+	unsigned int in_len = d->length - d->digest_size;
+	unsigned int size = d->bi_size;
+	struct page *page;
+	void *buf, *from;
+	int err;
+
+	buf = drbd_decompress_buffer(connection, d->dp_flags, in_len);
+	if (!buf)
+		return -EIO;
+	err = drbd_recv_into(connection, buf, in_len);
+	if (err)
+		return err;
+	err = drbd_decompress(connection, d->dp_flags, in_len, size);
+	if (err)
+		return err;
+
+	drbd_alloc_page_chain(transport, &peer_req->page_chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = peer_req->page_chain.head;
+	if (!page)
+		return -ENOMEM;
+
+	from = connection->compress.peer_out;
+	page_chain_for_each(page) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		memcpy(data, from, len);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		from += len;
+		size -= len;
+	}
+	return 0;
 }
 
 /* used from receive_RSDataReply (recv_resync_read)
@@ -1939,7 +2303,10 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->length == 0)
 		return peer_req;
 
-	err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
+	if (d->dp_flags & DP_COMPRESSED)
+		err = recv_compressed_pages(peer_device, peer_req, d);
+	else
+		err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
 	if (err)
 		goto fail;
 
@@ -2079,7 +2446,25 @@ static int recv_resync_read(struct drbd_peer_device *peer_device,
 	if (test_bit(UNSTABLE_RESYNC, &peer_device->flags))
 		clear_bit(STABLE_RESYNC, &device->flags);
 
-	dec_rs_pending(peer_device);
+	if (d->dp_flags & DP_RS_DEDUP_STORE)
+		drbd_dedup_store(connection, peer_req, d->dedup_pos);
+	else if (d->dp_flags & DP_RS_DEDUP_REF &&
+		 drbd_dedup_fill(connection, peer_req, d->dedup_pos))
+		goto cancel_push;
+
+	/* Part of the answer to a batched P_CSUM_RS_REQUEST: rs_pending and
+	 * the resync extent reference of the request go with the final
+	 * DP_RS_BATCH_DONE, this write needs its own reference. */
+	if (d->dp_flags & DP_RS_BATCH_PART) {
+		drbd_rs_more_io(peer_device, d->sector);
+	} else if (d->dp_flags & DP_RS_PUSH) {
+		/* Streamed without a request, see make_resync_push(). We may
+		 * not sleep here; the block gets requested after streaming. */
+		if (drbd_try_rs_begin_io(peer_device, d->sector, false))
+			goto cancel_push;
+	} else {
+		dec_rs_pending(peer_device);
+	}
 
 	inc_unacked(peer_device);
 	/* corresponding dec_unacked() in e_end_resync_block()
@@ -2110,6 +2495,13 @@ static int recv_resync_read(struct drbd_peer_device *peer_device,
 			drbd_send_out_of_sync(peer_device, &peer_req->i);
 	}
 	return 0;
+
+cancel_push:
+	drbd_free_peer_req(peer_req);
+	err = drbd_send_ack_ex(peer_device, P_RS_CANCEL, d->sector, d->bi_size, ID_RS_PUSH);
+	if (!err)
+		put_ldev(device);
+	return err;
 out:
 	/* don't care for the reason here */
 	drbd_err(device, "submit failed, triggering re-connect\n");
@@ -2238,6 +2630,97 @@ int drbd_send_ack_ex(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 			      cpu_to_be64(block_id));
 }
 
+static bool batch_chunk_differs(const u8 *map, unsigned int i)
+{
+	return map[i / 8] & (1 << (i % 8));
+}
+
+/* The sync source streamed all it had, see make_resync_push().
+ * Request the blocks that are still out of sync. */
+static int receive_rs_push_done(struct drbd_peer_device *peer_device, struct packet_info *pi)
+{
+	int err = ignore_remaining_packet(peer_device->connection, pi->size);
+
+	mutex_lock(&peer_device->resync_next_bit_mutex);
+	peer_device->use_push = false;
+	clear_bit(RS_PUSH_REQUESTED, &peer_device->flags);
+	peer_device->resync_next_bit = 0;
+	mutex_unlock(&peer_device->resync_next_bit_mutex);
+
+	if (peer_device->repl_state[NOW] == L_SYNC_TARGET)
+		mod_timer(&peer_device->resync_timer, jiffies);
+	return err;
+}
+
+/* The sync target asks us to stream the resync, see make_resync_push() */
+static int receive_rs_push_request(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+
+	if (!(peer_device->connection->agreed_features & DRBD_FF_RS_PUSH) ||
+	    sector >= drbd_get_capacity(peer_device->device->this_bdev))
+		return -EINVAL;
+	if (repl_state != L_SYNC_SOURCE && repl_state != L_PAUSED_SYNC_S)
+		return 0;
+
+	mutex_lock(&peer_device->resync_next_bit_mutex);
+	peer_device->resync_next_bit = BM_SECT_TO_BIT(sector);
+	drbd_rs_controller_reset(peer_device);
+	set_bit(RS_PUSH, &peer_device->flags);
+	mutex_unlock(&peer_device->resync_next_bit_mutex);
+
+	drbd_queue_work_if_unqueued(&peer_device->connection->sender_work,
+				    &peer_device->resync_work);
+	return 0;
+}
+
+/* Concludes the answer to a batched P_CSUM_RS_REQUEST, see csum_rs_batch_reply().
+ * The chunks not marked in the bitmap had the same checksum. */
+static int receive_rs_batch_done(struct drbd_peer_device *peer_device,
+				 struct drbd_peer_request_details *d, struct packet_info *pi)
+{
+	struct drbd_device *device = peer_device->device;
+	unsigned int chunks = DIV_ROUND_UP(d->bi_size, BM_BLOCK_SIZE);
+	u8 map[DRBD_MAX_BIO_SIZE >> BM_BLOCK_SHIFT >> 3];
+	unsigned int start, end, in_sync = 0;
+	int err;
+
+	if (d->bi_size > DRBD_MAX_BIO_SIZE || pi->size != DIV_ROUND_UP(chunks, 8)) {
+		drbd_err(device, "Unexpected batch done, size %u, bitmap of %u bytes\n",
+			 d->bi_size, pi->size);
+		return -EIO;
+	}
+	err = drbd_recv_into(peer_device->connection, map, pi->size);
+	if (err)
+		return err;
+
+	if (get_ldev(device)) {
+		for (start = 0; start < chunks; start = end) {
+			bool differs = batch_chunk_differs(map, start);
+
+			for (end = start + 1; end < chunks; end++)
+				if (!batch_chunk_differs(map, end) != !differs)
+					break;
+			if (!differs) {
+				unsigned int offset = start << BM_BLOCK_SHIFT;
+				unsigned int len = min_t(unsigned int, d->bi_size, end << BM_BLOCK_SHIFT) - offset;
+
+				drbd_set_in_sync(peer_device, d->sector + (offset >> 9), len);
+				/* rs_same_csums unit is BM_BLOCK_SIZE */
+				peer_device->rs_same_csum += end - start;
+				in_sync += len;
+			}
+		}
+		drbd_rs_complete_io(peer_device, d->sector);
+		put_ldev(device);
+	}
+
+	dec_rs_pending(peer_device);
+	rs_sectors_came_in(peer_device, in_sync);
+
+	return 0;
+}
+
 static int receive_RSDataReply(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_request_details d;
@@ -2253,6 +2736,15 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 		return -EIO;
 	device = peer_device->device;
 
+	if (d.dp_flags & DP_RS_BATCH_DONE)
+		return receive_rs_batch_done(peer_device, &d, pi);
+	if (d.dp_flags & DP_RS_PUSH && d.block_id == ID_RS_PUSH)
+		return receive_rs_push_done(peer_device, pi);
+	if (d.dp_flags & (DP_RS_DEDUP_STORE | DP_RS_DEDUP_REF)) {
+		d.dedup_pos = be64_to_cpu(d.block_id);
+		d.block_id = ID_SYNCER;
+	}
+
 	D_ASSERT(device, d.block_id == ID_SYNCER);
 
 	if (get_ldev(device)) {
@@ -2688,6 +3180,225 @@ static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer
 	wake_up(&device->al_wait);
 }
 
+/* With WO_BDEV_FLUSH or WO_DRAIN_IO, a write must not reach the disk before
+ * the writes of the previous epoch, and the flush after them, completed.
+ * Instead of waiting for that in the receiver, hold the write back on its
+ * epoch. drbd_may_finish_epoch() queues it to the submitter once the previous
+ * epoch is gone. Like for writes queued for the activity log, the write is
+ * accounted in active_ee_cnt already. */
+static bool park_peer_write(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	enum write_ordering_e wo = connection->resource->write_ordering;
+	struct drbd_epoch *epoch = peer_req->epoch;
+	struct drbd_epoch *prev;
+	bool parked = false;
+
+	if (wo != WO_BDEV_FLUSH && wo != WO_DRAIN_IO)
+		return false;
+
+	spin_lock(&connection->epoch_lock);
+	prev = list_entry(epoch->list.prev, struct drbd_epoch, list);
+	if (prev != epoch && prev != connection->current_epoch) {
+		atomic_inc(&connection->active_ee_cnt);
+		list_add_tail(&peer_req->wait_for_actlog, &epoch->parked);
+		parked = true;
+	}
+	spin_unlock(&connection->epoch_lock);
+
+	return parked;
+}
+
+static void queue_parked_peer_writes(struct list_head *parked)
+{
+	struct drbd_peer_request *peer_req, *tmp;
+
+	list_for_each_entry_safe(peer_req, tmp, parked, wait_for_actlog) {
+		struct drbd_device *device = peer_req->peer_device->device;
+
+		list_del_init(&peer_req->wait_for_actlog);
+		/* as prepare_activity_log() does for DRBD_PAL_QUEUE */
+		atomic_add(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
+		drbd_queue_peer_request(device, peer_req);
+	}
+}
+
+/* On disconnect, hand all parked writes to the submitter, which drops them */
+static void unpark_peer_writes(struct drbd_connection *connection)
+{
+	struct drbd_epoch *epoch;
+	LIST_HEAD(parked);
+
+	spin_lock(&connection->epoch_lock);
+	list_for_each_entry(epoch, &connection->current_epoch->list, list)
+		list_splice_tail_init(&epoch->parked, &parked);
+	list_splice_tail_init(&connection->current_epoch->parked, &parked);
+	spin_unlock(&connection->epoch_lock);
+
+	queue_parked_peer_writes(&parked);
+}
+
+static bool peer_writes_mergeable(struct drbd_peer_request *a, struct drbd_peer_request *b)
+{
+	return a->peer_device == b->peer_device && a->epoch == b->epoch &&
+		a->opf == b->opf && peer_req_op(a) == REQ_OP_WRITE && !(a->opf & REQ_PREFLUSH) &&
+		!((a->flags | b->flags) & (EE_TRIM | EE_WRITE_SAME | EE_ZEROOUT | EE_IS_BARRIER)) &&
+		a->page_chain.head && b->page_chain.head &&
+		a->i.sector + (a->i.size >> 9) == b->i.sector;
+}
+
+/* Submits the peer writes chained by merged_next with a single bio */
+static int submit_merged_peer_writes(struct drbd_peer_request *first, unsigned int nr_pages)
+{
+	struct drbd_device *device = first->peer_device->device;
+	struct drbd_peer_request *peer_req;
+	struct bio *bio;
+	ktime_t submit_kt;
+
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+	if (!bio)
+		return -ENOMEM;
+	bio->bi_iter.bi_sector = first->i.sector;
+	bio_set_dev(bio, device->ldev->backing_bdev);
+	bio->bi_opf = first->opf;
+	bio->bi_private = first;
+	bio->bi_end_io = drbd_peer_writes_merged_endio;
+
+	for (peer_req = first; peer_req; peer_req = peer_req->merged_next) {
+		struct page *page = peer_req->page_chain.head;
+		unsigned int data_size = peer_req->i.size;
+
+		page_chain_for_each(page) {
+			unsigned int off = page_chain_offset(page);
+			unsigned int len = page_chain_size(page);
+
+			if (off > PAGE_SIZE || len > PAGE_SIZE - off || len > data_size || len == 0 ||
+			    bio_add_page(bio, page, len, off) != len) {
+				bio_put(bio);
+				return -EINVAL;
+			}
+			data_size -= len;
+		}
+		if (data_size) {
+			bio_put(bio);
+			return -EINVAL;
+		}
+	}
+
+	submit_kt = drbd_app_io_start(device);
+	for (peer_req = first; peer_req; peer_req = peer_req->merged_next) {
+		if (peer_req->flags & EE_SET_OUT_OF_SYNC)
+			drbd_set_out_of_sync(peer_req->peer_device,
+					peer_req->i.sector, peer_req->i.size);
+		atomic_set(&peer_req->pending_bios, 1);
+		peer_req->submit_jif = jiffies;
+		peer_req->submit_kt = submit_kt;
+		peer_req->flags |= EE_SUBMITTED;
+	}
+	drbd_generic_make_request(device, peer_request_fault_type(first), bio);
+	return 0;
+}
+
+/* Adjacent writes of one epoch that were received in a row are submitted
+ * with a single bio, up to the size of a bio DRBD would receive. Each of
+ * them still gets completed and acknowledged on its own. */
+static void submit_peer_writes(struct list_head *list)
+{
+	struct drbd_peer_request *first, *last, *peer_req, *next;
+	unsigned int nr_pages;
+
+	while (!list_empty(list)) {
+		first = list_first_entry(list, struct drbd_peer_request, wait_for_actlog);
+		list_del_init(&first->wait_for_actlog);
+		first->merged_next = NULL;
+		nr_pages = first->page_chain.nr_pages;
+
+		last = first;
+		while (!list_empty(list)) {
+			next = list_first_entry(list, struct drbd_peer_request, wait_for_actlog);
+			if (!peer_writes_mergeable(last, next) ||
+			    nr_pages + next->page_chain.nr_pages > DRBD_MAX_BIO_SIZE >> PAGE_SHIFT)
+				break;
+			list_del_init(&next->wait_for_actlog);
+			next->merged_next = NULL;
+			last->merged_next = next;
+			last = next;
+			nr_pages += next->page_chain.nr_pages;
+		}
+
+		if (last != first && !submit_merged_peer_writes(first, nr_pages))
+			continue;
+
+		/* Not merged, or building the merged bio failed */
+		for (peer_req = first; peer_req; peer_req = next) {
+			next = peer_req->merged_next;
+			peer_req->merged_next = NULL;
+			if (drbd_submit_peer_request(peer_req))
+				drbd_cleanup_after_failed_submit_peer_request(peer_req);
+		}
+	}
+}
+
+void drbd_peer_submit_wf(struct work_struct *ws)
+{
+	struct drbd_submit_ctx *ctx = container_of(ws, struct drbd_submit_ctx, work);
+	struct blk_plug plug;
+	LIST_HEAD(work_list);
+
+	blk_start_plug(&plug);
+	for (;;) {
+		spin_lock(&ctx->lock);
+		list_splice_init(&ctx->peer_writes, &work_list);
+		spin_unlock(&ctx->lock);
+		if (list_empty(&work_list))
+			break;
+
+		submit_peer_writes(&work_list);
+	}
+	blk_finish_plug(&plug);
+}
+
+/* Wait until the peer writes queued so far are submitted */
+void drbd_flush_peer_submit(struct drbd_device *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < device->nr_submit_ctx; i++)
+		flush_work(&device->submit_ctx[i].work);
+}
+
+/* Hands a peer write that is in the activity log already to a submit
+ * context. Returns false if the caller has to submit it. */
+static bool drbd_dispatch_peer_write(struct drbd_device *device, struct drbd_peer_request *peer_req)
+{
+	unsigned int n = device->nr_submit_ctx;
+	struct drbd_submit_ctx *ctx, *last;
+	/* activity log extents, as in drbd_al_begin_io_fastpath() */
+	unsigned first_enr = peer_req->i.sector >> (AL_EXTENT_SHIFT-9);
+	unsigned last_enr = (peer_req->i.sector + (peer_req->i.size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+
+	/* With barriers, the block layer orders the writes for us, by the
+	 * order they are submitted in */
+	if (!n || !peer_req->i.size || peer_req->flags & EE_IS_BARRIER ||
+	    device->resource->write_ordering == WO_BIO_BARRIER)
+		return false;
+
+	ctx = &device->submit_ctx[first_enr % n];
+	last = &device->submit_ctx[last_enr % n];
+	if (last != ctx) {
+		/* Writes queued to either context might overlap this one */
+		flush_work(&ctx->work);
+		flush_work(&last->work);
+		return false;
+	}
+
+	spin_lock(&ctx->lock);
+	list_add_tail(&peer_req->wait_for_actlog, &ctx->peer_writes);
+	spin_unlock(&ctx->lock);
+	queue_work(drbd_peer_submit_wq, &ctx->work);
+	return true;
+}
+
 /* FIXME
  * TODO grab the device->al_lock *once*, and check:
  *     if possible, non-blocking get the reference(s),
@@ -2871,6 +3582,11 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 			}
 		}
 	}
+	if (connection->resource->write_ordering_fua && peer_req_op(peer_req) == REQ_OP_WRITE)
+		peer_req->opf |= REQ_FUA;
+	/* An epoch of FUA writes only is on stable storage without a flush */
+	if (!(peer_req->opf & REQ_FUA))
+		set_bit(DE_NEEDS_FLUSH, &peer_req->epoch->flags);
 	spin_unlock(&connection->epoch_lock);
 
 	rcu_read_lock();
@@ -2919,11 +3635,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	list_add_tail(&peer_req->recv_order, &connection->peer_requests);
 	spin_unlock_irq(&connection->peer_reqs_lock);
 
-	err = prepare_activity_log(peer_req);
-	if (err == DRBD_PAL_DISCONNECTED)
-		goto disconnect_during_al_begin_io;
-
-	/* Note: this now may or may not be "hot" in the activity log.
+	/* Note: this may or may not be "hot" in the activity log yet.
 	 * Still, it is the best time to record that we need to set the
 	 * out-of-sync bit, if we delay that until drbd_submit_peer_request(),
 	 * we may introduce a race with some re-attach on the peer.
@@ -2937,6 +3649,13 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		peer_req->flags |= EE_SET_OUT_OF_SYNC;
 	}
 
+	if (park_peer_write(peer_req))
+		return 0;
+
+	err = prepare_activity_log(peer_req);
+	if (err == DRBD_PAL_DISCONNECTED)
+		goto disconnect_during_al_begin_io;
+
 	atomic_inc(&connection->active_ee_cnt);
 
 	if (err == DRBD_PAL_QUEUE) {
@@ -2944,6 +3663,9 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		return 0;
 	}
 
+	if (drbd_dispatch_peer_write(device, peer_req))
+		return 0;
+
 	err = drbd_submit_peer_request(peer_req);
 	if (!err)
 		return 0;
@@ -3101,7 +3823,7 @@ bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 static void verify_skipped_block(struct drbd_peer_device *peer_device,
 		const sector_t sector, const unsigned int size)
 {
-	++peer_device->ov_skipped;
+	peer_device->ov_skipped += DIV_ROUND_UP(size, BM_BLOCK_SIZE);
 	if (peer_device->ov_last_skipped_start + peer_device->ov_last_skipped_size == sector) {
 		peer_device->ov_last_skipped_size += size>>9;
 	} else {
@@ -3134,6 +3856,9 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 	sector = be64_to_cpu(p->sector);
 	size   = be32_to_cpu(p->blksize);
 
+	if (pi->cmd == P_RS_DATA_REQUEST && p->block_id == ID_RS_PUSH)
+		return receive_rs_push_request(peer_device, sector);
+
 	if (size <= 0 || !IS_ALIGNED(size, 512) || size > DRBD_MAX_BIO_SIZE) {
 		drbd_err(device, "%s:%d: sector: %llus, size: %u\n", __FILE__, __LINE__,
 				(unsigned long long)sector, size);
@@ -3253,6 +3978,8 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		di->digest_size = pi->size;
 		di->digest = (((char *)di)+sizeof(struct digest_info));
 
+		if (pi->cmd == P_CSUM_RS_REQUEST && peer_req->block_id == ID_CSUM_BATCH)
+			peer_req->flags |= EE_CSUM_BATCH;
 		peer_req->digest = di;
 		peer_req->flags |= EE_HAS_DIGEST;
 
@@ -4435,15 +5162,13 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 		if (verify_tfm) {
 			strcpy(new_net_conf->verify_alg, p->verify_alg);
 			new_net_conf->verify_alg_len = strlen(p->verify_alg) + 1;
-			crypto_free_shash(connection->verify_tfm);
-			connection->verify_tfm = verify_tfm;
+			drbd_csum_replace_tfm(connection, &connection->verify_tfm, verify_tfm);
 			drbd_info(device, "using verify-alg: \"%s\"\n", p->verify_alg);
 		}
 		if (csums_tfm) {
 			strcpy(new_net_conf->csums_alg, p->csums_alg);
 			new_net_conf->csums_alg_len = strlen(p->csums_alg) + 1;
-			crypto_free_shash(connection->csums_tfm);
-			connection->csums_tfm = csums_tfm;
+			drbd_csum_replace_tfm(connection, &connection->csums_tfm, csums_tfm);
 			drbd_info(device, "using csums-alg: \"%s\"\n", p->csums_alg);
 		}
 		rcu_assign_pointer(connection->transport.net_conf, new_net_conf);
@@ -7134,6 +7859,7 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 	struct drbd_device *device;
 	sector_t sector;
 	int size, err = 0;
+	bool push;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
 	if (!peer_device)
@@ -7143,13 +7869,25 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 	sector = be64_to_cpu(p->sector);
 	size = be32_to_cpu(p->blksize);
 
-	dec_rs_pending(peer_device);
+	/* While the sync source streams, we have no requests outstanding */
+	push = peer_device->use_push;
+	if (!push)
+		dec_rs_pending(peer_device);
 
 	if (get_ldev(device)) {
 		struct drbd_peer_request *peer_req;
 
+		/* See recv_resync_read() */
+		if (push && drbd_try_rs_begin_io(peer_device, sector, false)) {
+			put_ldev(device);
+			return drbd_send_ack_ex(peer_device, P_RS_CANCEL, sector, size, ID_RS_PUSH);
+		}
+
 		peer_req = drbd_alloc_peer_req(peer_device, GFP_NOIO);
 		if (!peer_req) {
+			/* The resync extent reference is taken above when pushed,
+			 * otherwise it was taken when the request was sent */
+			drbd_rs_complete_io(peer_device, sector);
 			put_ldev(device);
 			return -ENOMEM;
 		}
@@ -7184,6 +7922,8 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 
 		/* No put_ldev() here. Gets called in drbd_endio_write_sec_final(),
 		   as well as drbd_rs_complete_io() */
+	} else if (push) {
+		drbd_send_ack_ex(peer_device, P_NEG_ACK, sector, size, ID_SYNCER);
 	} else {
 	fail:
 		drbd_rs_complete_io(peer_device, sector);
@@ -7247,6 +7987,7 @@ static void drbdd(struct drbd_connection *connection)
 		struct data_cmd const *cmd;
 
 		drbd_thread_current_set_cpu(&connection->receiver);
+		WRITE_ONCE(connection->pp_node, numa_node_id());
 		update_receiver_timing_details(connection, drbd_recv_header_maybe_unplug);
 		if (drbd_recv_header_maybe_unplug(connection, &pi))
 			goto err_out;
@@ -7446,6 +8187,8 @@ void conn_disconnect(struct drbd_connection *connection)
 	/* ack_receiver does not clean up anything. it must not interfere, either */
 	drbd_thread_stop(&connection->ack_receiver);
 	if (connection->ack_sender) {
+		/* A delayed peer ack work would queue itself after that */
+		cancel_delayed_work_sync(&connection->peer_ack_work);
 		destroy_workqueue(connection->ack_sender);
 		connection->ack_sender = NULL;
 	}
@@ -7460,10 +8203,15 @@ void conn_disconnect(struct drbd_connection *connection)
 
 	drain_resync_activity(connection);
 
+	unpark_peer_writes(connection);
+
 	/* Wait for current activity to cease.  This includes waiting for
 	 * peer_request queued to the submitter workqueue. */
 	conn_wait_ee_empty(connection, &connection->active_ee);
 
+	/* Flushes after an epoch queue w_epoch_flushed() when they complete */
+	wait_event(connection->ee_wait, !atomic_read(&connection->epoch_flushes));
+
 	/* wait for all w_e_end_data_req, w_e_end_rsdata_req, w_send_barrier,
 	 * w_make_resync_request etc. which may still be on the worker queue
 	 * to be "canceled" */
@@ -7537,6 +8285,12 @@ void conn_disconnect(struct drbd_connection *connection)
 		change_cstate(connection, C_STANDALONE, CS_VERBOSE | CS_HARD | CS_LOCAL_ONLY);
 }
 
+static u32 drbd_my_features(void)
+{
+	return PRO_FEATURES | DRBD_FF_CSUM_BATCH | DRBD_FF_OV_TREE | DRBD_FF_RS_PUSH |
+		DRBD_FF_RS_DEDUP | drbd_compress_features();
+}
+
 /*
  * We support PRO_VERSION_MIN to PRO_VERSION_MAX. The protocol version
  * we can agree on is stored in agreed_pro_version.
@@ -7558,7 +8312,7 @@ static int drbd_send_features(struct drbd_connection *connection)
 	p->protocol_max = cpu_to_be32(PRO_VERSION_MAX);
 	p->sender_node_id = cpu_to_be32(connection->resource->res_opts.node_id);
 	p->receiver_node_id = cpu_to_be32(connection->peer_node_id);
-	p->feature_flags = cpu_to_be32(PRO_FEATURES);
+	p->feature_flags = cpu_to_be32(drbd_my_features());
 	return __send_command(connection, -1, P_CONNECTION_FEATURES, DATA_STREAM);
 }
 
@@ -7620,7 +8374,8 @@ int drbd_do_features(struct drbd_connection *connection)
 	}
 
 	connection->agreed_pro_version = min_t(int, PRO_VERSION_MAX, p->protocol_max);
-	connection->agreed_features = PRO_FEATURES & be32_to_cpu(p->feature_flags);
+	connection->agreed_features =
+		drbd_my_features() & be32_to_cpu(p->feature_flags);
 
 	if (be32_to_cpu(p->sender_node_id) != connection->peer_node_id) {
 		drbd_err(connection, "Peer presented a node_id of %d instead of %d\n",
@@ -7646,6 +8401,9 @@ int drbd_do_features(struct drbd_connection *connection)
 		  connection->agreed_features & DRBD_FF_WZEROES ? " WRITE_ZEROES" :
 		  connection->agreed_features ? "" : " none");
 
+	drbd_compress_setup(connection);
+	drbd_dedup_setup(connection);
+
 	return 1;
 }
 
@@ -7859,10 +8617,23 @@ int drbd_receiver(struct drbd_thread *thi)
 
 /* ********* acknowledge sender ******** */
 
+static struct drbd_peer_ack *next_pending_peer_ack(struct drbd_resource *resource,
+		struct drbd_peer_ack *peer_ack, u64 node_id_mask)
+{
+	list_for_each_entry_continue(peer_ack, &resource->peer_ack_list, list) {
+		if (peer_ack->pending_mask & node_id_mask)
+			return peer_ack;
+	}
+	return NULL;
+}
+
+/* The peer applies the mask of a peer ack to all writes up to its dagtag,
+ * which it did not see a peer ack for yet. Of a run of peer acks with the
+ * same mask, only the last one needs to be sent. */
 static int process_peer_ack_list(struct drbd_connection *connection)
 {
 	struct drbd_resource *resource = connection->resource;
-	struct drbd_peer_ack *peer_ack, *tmp;
+	struct drbd_peer_ack *peer_ack, *next, *tmp;
 	u64 node_id_mask;
 	int err = 0;
 
@@ -7875,9 +8646,18 @@ static int process_peer_ack_list(struct drbd_connection *connection)
 			peer_ack = list_next_entry(peer_ack, list);
 			continue;
 		}
+		next = next_pending_peer_ack(resource, peer_ack, node_id_mask);
+		if (next && next->mask == peer_ack->mask) {
+			peer_ack->pending_mask &= ~node_id_mask;
+			drbd_destroy_peer_ack_if_done(peer_ack);
+			connection->peer_ack_stats.merged++;
+			peer_ack = next;
+			continue;
+		}
 		spin_unlock_irq(&resource->peer_ack_lock);
 
 		err = drbd_send_peer_ack(connection, peer_ack);
+		connection->peer_ack_stats.sent++;
 
 		spin_lock_irq(&resource->peer_ack_lock);
 		tmp = list_next_entry(peer_ack, list);
@@ -8023,6 +8803,10 @@ static int got_Ping(struct drbd_connection *connection, struct packet_info *pi)
 
 static int got_PingAck(struct drbd_connection *connection, struct packet_info *pi)
 {
+	u64 rtt = ktime_to_ns(ktime_sub(ktime_get(), connection->ping_sent_kt));
+
+	connection->rtt_ns = connection->rtt_ns ? (connection->rtt_ns * 7 + rtt) / 8 : rtt;
+
 	if (!test_bit(GOT_PING_ACK, &connection->flags)) {
 		set_bit(GOT_PING_ACK, &connection->flags);
 		wake_up(&connection->resource->state_wait);
@@ -8097,6 +8881,8 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 		drbd_set_in_sync(peer_device, sector, blksize);
 		dec_rs_pending(peer_device);
 		atomic_sub(blksize >> 9, &connection->rs_in_flight);
+		if (test_bit(RS_PUSH, &peer_device->flags))
+			rs_sectors_came_in(peer_device, blksize);
 		return 0;
 	}
 	switch (pi->cmd) {
@@ -8145,6 +8931,7 @@ static int got_NegAck(struct drbd_connection *connection, struct packet_info *pi
 
 	if (p->block_id == ID_SYNCER) {
 		dec_rs_pending(peer_device);
+		atomic_sub(size >> 9, &connection->rs_in_flight);
 		drbd_rs_failed_io(peer_device, sector, size);
 		return 0;
 	}
@@ -8206,6 +8993,14 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 
 	dec_rs_pending(peer_device);
 
+	if (be64_to_cpu(p->block_id) == ID_RS_PUSH) {
+		/* Streamed block the sync target could not take right now */
+		atomic_sub(size >> 9, &connection->rs_in_flight);
+		drbd_queue_work_if_unqueued(&connection->sender_work,
+					    &peer_device->resync_work);
+		return 0;
+	}
+
 	if (get_ldev_if_state(device, D_DETACHING)) {
 		drbd_rs_complete_io(peer_device, sector);
 		switch (pi->cmd) {
@@ -8261,6 +9056,7 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 	struct drbd_device *device;
 	struct p_block_ack *p = pi->data;
 	sector_t sector;
+	bool descend;
 	int size;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
@@ -8273,9 +9069,12 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 
 	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
 
+	/* The verify source is going to verify the parts of that range */
+	descend = be64_to_cpu(p->block_id) == ID_OV_DESCEND;
+
 	if (be64_to_cpu(p->block_id) == ID_OUT_OF_SYNC)
 		drbd_ov_out_of_sync_found(peer_device, sector, size);
-	else
+	else if (!descend)
 		ov_out_of_sync_print(peer_device);
 
 	if (!get_ldev(device))
@@ -8284,7 +9083,8 @@ static int got_OVResult(struct drbd_connection *connection, struct packet_info *
 	drbd_rs_complete_io(peer_device, sector);
 	dec_rs_pending(peer_device);
 
-	verify_progress(peer_device, sector, size);
+	if (!descend)
+		verify_progress(peer_device, sector, size);
 
 	put_ldev(device);
 	return 0;
@@ -8544,6 +9344,52 @@ static struct meta_sock_cmd ack_receiver_tbl[] = {
 	[P_TWOPC_RETRY]     = { sizeof(struct p_twopc_reply), got_twopc_reply },
 };
 
+static bool acks_pending(struct drbd_connection *connection)
+{
+	return atomic_read(&connection->ap_in_flight) ||
+		atomic_read(&connection->rs_in_flight);
+}
+
+/* The ack receiver runs SCHED_RR at that priority, unless it busy polls */
+#define ACK_RECEIVER_PRIO 2
+
+/* A task becoming runnable never preempts an RT task, so need_resched() would
+ * not stop the spinning in recv_ack_busy_poll(). Busy polling runs with the
+ * normal policy instead; switched when ack_busy_poll_us is turned on or off. */
+static void ack_receiver_set_policy(struct drbd_connection *connection, bool busy_poll)
+{
+	struct sched_param param = { .sched_priority = busy_poll ? 0 : ACK_RECEIVER_PRIO };
+	int rv;
+
+	rv = sched_setscheduler(current, busy_poll ? SCHED_NORMAL : SCHED_RR, &param);
+	if (rv < 0)
+		drbd_err(connection, "drbd_ack_receiver: ERROR set priority, ret=%d\n", rv);
+}
+
+/* On a fast link the ack is often there before we would even be done
+ * falling asleep. Poll the control stream for up to poll_us microseconds
+ * before blocking in the transport, see the ack_busy_poll_us module parameter. */
+static int recv_ack_busy_poll(struct drbd_connection *connection, unsigned int poll_us,
+			      void **buf, size_t size, int flags)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_transport_ops *tr_ops = transport->ops;
+
+	if (poll_us && acks_pending(connection)) {
+		u64 end = local_clock() + (u64)poll_us * NSEC_PER_USEC;
+		int rv;
+
+		do {
+			rv = tr_ops->recv(transport, CONTROL_STREAM, buf, size, flags | MSG_DONTWAIT);
+			if (rv != -EAGAIN)
+				return rv;
+			cpu_relax();
+		} while (!need_resched() && !signal_pending(current) && local_clock() < end);
+	}
+
+	return tr_ops->recv(transport, CONTROL_STREAM, buf, size, flags);
+}
+
 int drbd_ack_receiver(struct drbd_thread *thi)
 {
 	struct drbd_connection *connection = thi->connection;
@@ -8556,17 +9402,19 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 	unsigned int header_size = drbd_header_size(connection);
 	int expect   = header_size;
 	bool ping_timeout_active = false;
-	struct sched_param param = { .sched_priority = 2 };
-	struct drbd_transport *transport = &connection->transport;
-	struct drbd_transport_ops *tr_ops = transport->ops;
+	unsigned int poll_us = READ_ONCE(drbd_ack_busy_poll_us);
 
-	rv = sched_setscheduler(current, SCHED_RR, &param);
-	if (rv < 0)
-		drbd_err(connection, "drbd_ack_receiver: ERROR set priority, ret=%d\n", rv);
+	ack_receiver_set_policy(connection, poll_us);
 
 	while (get_t_state(thi) == RUNNING) {
+		unsigned int new_poll_us = READ_ONCE(drbd_ack_busy_poll_us);
+
 		drbd_thread_current_set_cpu(thi);
 
+		if (!new_poll_us != !poll_us)
+			ack_receiver_set_policy(connection, new_poll_us);
+		poll_us = new_poll_us;
+
 		drbd_reclaim_net_peer_reqs(connection);
 
 		if (test_bit(SEND_PING, &connection->flags)) {
@@ -8580,7 +9428,7 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 		}
 
 		pre_recv_jif = jiffies;
-		rv = tr_ops->recv(transport, CONTROL_STREAM, &buffer, expect - received, rflags);
+		rv = recv_ack_busy_poll(connection, poll_us, &buffer, expect - received, rflags);
 
 		/* Note:
 		 * -EINTR	 (on meta) we got a signal
@@ -8722,7 +9570,7 @@ void drbd_send_acks_wf(struct work_struct *ws)
 void drbd_send_peer_ack_wf(struct work_struct *ws)
 {
 	struct drbd_connection *connection =
-		container_of(ws, struct drbd_connection, peer_ack_work);
+		container_of(to_delayed_work(ws), struct drbd_connection, peer_ack_work);
 
 	if (process_peer_ack_list(connection))
 		change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
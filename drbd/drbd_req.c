@@ -39,7 +39,7 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 {
 	struct drbd_request *req;
 
-	req = mempool_alloc(&drbd_request_mempool, GFP_NOIO);
+	req = drbd_obj_alloc(&drbd_request_objs, GFP_NOIO);
 	if (!req)
 		return NULL;
 
@@ -80,7 +80,18 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 void drbd_reclaim_req(struct rcu_head *rp)
 {
 	struct drbd_request *req = container_of(rp, struct drbd_request, rcu);
-	mempool_free(req, &drbd_request_mempool);
+	drbd_obj_free(&drbd_request_objs, req);
+}
+
+/* The requests of a batch hang off req->list of the first one */
+static void drbd_reclaim_req_batch(struct rcu_head *rp)
+{
+	struct drbd_request *req = container_of(rp, struct drbd_request, rcu);
+	struct drbd_request *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &req->list, list)
+		drbd_obj_free(&drbd_request_objs, r);
+	drbd_obj_free(&drbd_request_objs, req);
 }
 
 static u64 peer_ack_mask(struct drbd_request *req)
@@ -106,10 +117,11 @@ static u64 peer_ack_mask(struct drbd_request *req)
 	return mask;
 }
 
-static void queue_peer_ack_send(struct drbd_resource *resource,
-		struct drbd_request *req, struct drbd_peer_ack *peer_ack)
+/* The peers that need to see a peer ack for this request */
+static u64 peer_ack_send_mask(struct drbd_resource *resource, struct drbd_request *req)
 {
 	struct drbd_connection *connection;
+	u64 mask = 0;
 
 	rcu_read_lock();
 	for_each_connection_rcu(connection, resource) {
@@ -118,8 +130,28 @@ static void queue_peer_ack_send(struct drbd_resource *resource,
 				!(req->net_rq_state[node_id] & RQ_NET_SENT))
 			continue;
 
+		mask |= NODE_MASK(node_id);
+	}
+	rcu_read_unlock();
+
+	return mask;
+}
+
+static void queue_peer_ack_send(struct drbd_resource *resource, struct drbd_peer_ack *peer_ack,
+		u64 send_mask)
+{
+	struct drbd_connection *connection;
+
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		unsigned int node_id = connection->peer_node_id;
+		if (!(send_mask & NODE_MASK(node_id)))
+			continue;
+
 		peer_ack->pending_mask |= NODE_MASK(node_id);
-		queue_work(connection->ack_sender, &connection->peer_ack_work);
+		/* Does not shorten the delay if it is already pending */
+		queue_delayed_work(connection->ack_sender, &connection->peer_ack_work,
+				   usecs_to_jiffies(READ_ONCE(drbd_peer_ack_latency_us)));
 	}
 	rcu_read_unlock();
 }
@@ -134,37 +166,65 @@ void drbd_destroy_peer_ack_if_done(struct drbd_peer_ack *peer_ack)
 		return;
 
 	list_del(&peer_ack->list);
-	kfree(peer_ack);
+	drbd_obj_free(&drbd_peer_ack_objs, peer_ack);
+}
+
+static void publish_peer_ack(struct drbd_resource *resource, struct drbd_peer_ack *peer_ack,
+		u64 send_mask)
+{
+	spin_lock_irq(&resource->peer_ack_lock);
+	list_add_tail(&peer_ack->list, &resource->peer_ack_list);
+	queue_peer_ack_send(resource, peer_ack, send_mask);
+	drbd_destroy_peer_ack_if_done(peer_ack);
+	spin_unlock_irq(&resource->peer_ack_lock);
 }
 
+/* A peer ack covers all writes up to its dagtag. Consecutive requests of one
+ * batch that were acknowledged by the same nodes and that go to the same
+ * peers therefore share a single peer ack, that of the last one. */
 int w_queue_peer_ack(struct drbd_work *w, int cancel)
 {
 	struct drbd_resource *resource =
 		container_of(w, struct drbd_resource, peer_ack_work);
+	struct drbd_peer_ack *peer_ack = NULL;
+	struct drbd_request *req, *first;
 	LIST_HEAD(work_list);
-	struct drbd_request *req, *tmp;
+	u64 send_mask = 0;
 
 	spin_lock_irq(&resource->peer_ack_lock);
 	list_splice_init(&resource->peer_ack_req_list, &work_list);
 	spin_unlock_irq(&resource->peer_ack_lock);
 
-	list_for_each_entry_safe(req, tmp, &work_list, list) {
-		struct drbd_peer_ack *peer_ack =
-			kzalloc(sizeof(struct drbd_peer_ack), GFP_KERNEL);
+	if (list_empty(&work_list))
+		return 0;
+
+	list_for_each_entry(req, &work_list, list) {
+		u64 mask = peer_ack_mask(req);
+		u64 req_send_mask = peer_ack_send_mask(resource, req);
+
+		if (peer_ack && peer_ack->mask == mask && send_mask == req_send_mask) {
+			peer_ack->dagtag_sector = req->dagtag_sector;
+			continue;
+		}
+		if (peer_ack)
+			publish_peer_ack(resource, peer_ack, send_mask);
 
+		peer_ack = drbd_obj_alloc(&drbd_peer_ack_objs, GFP_NOIO);
+		memset(peer_ack, 0, sizeof(*peer_ack));
 		peer_ack->resource = resource;
 		INIT_LIST_HEAD(&peer_ack->list);
-		peer_ack->mask = peer_ack_mask(req);
+		peer_ack->mask = mask;
 		peer_ack->dagtag_sector = req->dagtag_sector;
-
-		spin_lock_irq(&resource->peer_ack_lock);
-		list_add_tail(&peer_ack->list, &resource->peer_ack_list);
-		queue_peer_ack_send(resource, req, peer_ack);
-		drbd_destroy_peer_ack_if_done(peer_ack);
-		spin_unlock_irq(&resource->peer_ack_lock);
-
-		call_rcu(&req->rcu, drbd_reclaim_req);
+		send_mask = req_send_mask;
 	}
+	publish_peer_ack(resource, peer_ack, send_mask);
+
+	/* One grace period for the whole batch */
+	first = list_first_entry(&work_list, struct drbd_request, list);
+	list_del(&first->list);
+	INIT_LIST_HEAD(&first->list);
+	list_splice(&work_list, &first->list);
+	call_rcu(&first->rcu, drbd_reclaim_req_batch);
 	return 0;
 }
 
@@ -212,6 +272,19 @@ static void drbd_remove_request_interval(struct rb_root *root,
 		wake_up(&device->misc_wait);
 }
 
+#ifdef CONFIG_DRBD_TIMING_STATS
+/* Called with device->timing_lock held */
+static void account_ack_latency(struct drbd_peer_device *peer_device, struct drbd_request *req)
+{
+	int node_id = peer_device->node_id;
+	s64 us = ktime_us_delta(req->acked_kt[node_id], req->pre_send_kt[node_id]);
+	unsigned int bucket = us > 0 ? ilog2(us) + 1 : 0;
+
+	bucket = min_t(unsigned int, bucket, DRBD_ACK_LATENCY_BUCKETS - 1);
+	peer_device->ack_latency_hist[bucket]++;
+}
+#endif
+
 void drbd_req_destroy(struct kref *kref)
 {
 	struct drbd_request *req = container_of(kref, struct drbd_request, kref);
@@ -245,6 +318,8 @@ void drbd_req_destroy(struct kref *kref)
 			ktime_aggregate_pd(peer_device, node_id, req, pre_send_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, acked_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, net_done_kt);
+			if ((ns & RQ_NET_SENT) && ktime_to_ns(req->acked_kt[node_id]))
+				account_ack_latency(peer_device, req);
 		}
 		spin_unlock(&device->timing_lock);
 	}
@@ -852,12 +927,13 @@ static void drbd_report_io_error(struct drbd_device *device, struct drbd_request
  * Is it also still "PENDING"?
  * --> If so, clear PENDING and set NET_OK below.
  * If it is a protocol A write, but not RQ_PENDING anymore, neg-ack was faster
- * (and we must not set RQ_NET_OK) */
+ * (and we must not set RQ_NET_OK)
+ * If it was sent zero-copy, PENDING is cleared later by ZC_SEND_DONE. */
 static inline bool is_pending_write_protocol_A(struct drbd_request *req, int idx)
 {
 	return (req->local_rq_state & RQ_WRITE) == 0 ? 0 :
 		(req->net_rq_state[idx] &
-		   (RQ_NET_PENDING|RQ_EXP_WRITE_ACK|RQ_EXP_RECEIVE_ACK))
+		   (RQ_NET_PENDING|RQ_EXP_WRITE_ACK|RQ_EXP_RECEIVE_ACK|RQ_EXP_SEND_DONE))
 		==  RQ_NET_PENDING;
 }
 
@@ -1069,6 +1145,16 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		mod_rq_state(req, m, peer_device, RQ_NET_QUEUED, RQ_NET_DONE);
 		break;
 
+	case ZC_SEND_DONE:
+		/* protocol A write sent zero-copy: the transport no longer
+		 * references the pages of the master bio.
+		 * Now do what HANDED_OVER_TO_NETWORK did not do yet,
+		 * unless a neg-ack or connection loss was faster. */
+		D_ASSERT(device, req->net_rq_state[idx] & RQ_EXP_SEND_DONE);
+		if (req->net_rq_state[idx] & RQ_NET_PENDING)
+			mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_NET_OK);
+		break;
+
 	case CONNECTION_LOST_WHILE_PENDING:
 		/* transfer log cleanup after connection loss */
 		mod_rq_state(req, m, peer_device,
@@ -1160,7 +1246,8 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		   allowed to complete this one "out-of-sequence".
 		 */
 		if (!(req->net_rq_state[idx] & RQ_NET_OK)) {
-			mod_rq_state(req, m, peer_device, RQ_COMPLETION_SUSP,
+			/* drbd_send_dblock() decides about zero-copy again */
+			mod_rq_state(req, m, peer_device, RQ_COMPLETION_SUSP|RQ_EXP_SEND_DONE,
 					RQ_NET_QUEUED|RQ_NET_PENDING);
 			break;
 		}
@@ -1170,6 +1257,13 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		if (!(req->local_rq_state & RQ_WRITE))
 			break;
 
+		/* A protocol A write sent zero-copy, which drbd_zc_send_done()
+		 * did not get to yet. The peer has it, so the transport will
+		 * not need its pages any more. */
+		if ((req->net_rq_state[idx] & (RQ_NET_PENDING|RQ_EXP_SEND_DONE)) ==
+		    (RQ_NET_PENDING|RQ_EXP_SEND_DONE))
+			mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_NET_OK);
+
 		if (req->net_rq_state[idx] & RQ_NET_PENDING) {
 			/* barrier came in before all requests were acked.
 			 * this is bad, because if the connection is lost now,
@@ -1458,10 +1552,12 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 	struct drbd_peer_device *peer_device;
 	struct drbd_device *device = req->device;
 	enum drbd_read_balancing rbm = RB_PREFER_REMOTE;
+	bool out_of_sync = false;
 
 	if (req->private_bio) {
 		if (!drbd_may_do_local_read(device,
 					req->i.sector, req->i.size)) {
+			out_of_sync = device->disk_state[NOW] == D_INCONSISTENT;
 			bio_put(req->private_bio);
 			req->private_bio = NULL;
 			put_ldev(device);
@@ -1503,6 +1599,8 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		req->private_bio = NULL;
 		put_ldev(device);
 	}
+	if (out_of_sync && peer_device)
+		drbd_rs_read_priority(device, peer_device, req->i.sector, req->i.size);
 	return peer_device;
 }
 
@@ -1900,6 +1998,7 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 	if (req->private_bio) {
 		/* pre_submit_jif is used in request_timer_fn() */
 		req->pre_submit_jif = jiffies;
+		req->pre_submit_kt = drbd_app_io_start(device);
 		ktime_get_accounting(req->pre_submit_kt);
 		list_add_tail(&req->req_pending_local,
 			&device->pending_completion[rw == WRITE]);
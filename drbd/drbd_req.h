@@ -87,6 +87,7 @@ enum drbd_req_event {
 	SEND_FAILED,
 	HANDED_OVER_TO_NETWORK,
 	OOS_HANDED_TO_NETWORK,
+	ZC_SEND_DONE, /* protocol A, zero-copy */
 	CONNECTION_LOST_WHILE_PENDING,
 	RECV_ACKED_BY_PEER,
 	WRITE_ACKED_BY_PEER,
@@ -186,6 +187,12 @@ enum drbd_req_state_bits {
 	/* waiting for a barrier ack, did an extra kref_get */
 	__RQ_EXP_BARR_ACK,
 
+	/* Protocol A write, handed over to the transport zero-copy.
+	 * The transport still references the pages of the master bio,
+	 * we must not pretend it was written on the peer before the
+	 * transport is done with them, see drbd_zc_send_done() */
+	__RQ_EXP_SEND_DONE,
+
 	/* 4321
 	 * 0000: no local possible
 	 * 0001: to be submitted
@@ -234,6 +241,7 @@ enum drbd_req_state_bits {
 #define RQ_EXP_RECEIVE_ACK (1UL << __RQ_EXP_RECEIVE_ACK)
 #define RQ_EXP_WRITE_ACK   (1UL << __RQ_EXP_WRITE_ACK)
 #define RQ_EXP_BARR_ACK    (1UL << __RQ_EXP_BARR_ACK)
+#define RQ_EXP_SEND_DONE   (1UL << __RQ_EXP_SEND_DONE)
 
 #define RQ_LOCAL_PENDING   (1UL << __RQ_LOCAL_PENDING)
 #define RQ_LOCAL_COMPLETED (1UL << __RQ_LOCAL_COMPLETED)
@@ -22,6 +22,7 @@
 #include <linux/slab.h>
 #include <linux/random.h>
 #include <linux/scatterlist.h>
+#include <linux/log2.h>
 
 #include "drbd_int.h"
 #include "drbd_protocol.h"
@@ -30,7 +31,13 @@
 void drbd_panic_after_delayed_completion_of_aborted_request(struct drbd_device *device);
 
 static int make_ov_request(struct drbd_peer_device *, int);
+static struct drbd_csums *drbd_csum_prepare(struct drbd_peer_request *);
+static void drbd_csum_queue(struct drbd_csums *);
 static int make_resync_request(struct drbd_peer_device *, int);
+static void make_resync_push(struct drbd_peer_device *);
+static int send_rs_push_sparse(struct drbd_peer_device *, struct drbd_peer_request *);
+static int flush_rs_push_zeroes(struct drbd_peer_device *);
+static void drop_rs_push_zeroes(struct drbd_peer_device *);
 static bool should_send_barrier(struct drbd_connection *, unsigned int epoch);
 static void maybe_send_barrier(struct drbd_connection *, unsigned int);
 static unsigned long get_work_bits(const unsigned long mask, unsigned long *flags);
@@ -39,6 +46,7 @@ static unsigned long get_work_bits(const unsigned long mask, unsigned long *flag
  *   drbd_md_endio (defined here)
  *   drbd_request_endio (defined here)
  *   drbd_peer_request_endio (defined here)
+ *   drbd_peer_writes_merged_endio (defined here)
  *   drbd_bm_endio (defined in drbd_bitmap.c)
  *
  * For all these callbacks, note the following:
@@ -92,16 +100,30 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 	struct drbd_device *device = peer_device->device;
 	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_csums *csums;
+
+	/* keeps the tfm alive until the job is queued, see drbd_csum_replace_tfm() */
+	rcu_read_lock();
+	csums = drbd_csum_prepare(peer_req);
 
 	spin_lock_irqsave(&connection->peer_reqs_lock, flags);
 	device->read_cnt += peer_req->i.size >> 9;
-	list_del(&peer_req->w.list);
-	if (list_empty(&connection->read_ee))
-		wake_up(&connection->ee_wait);
+	/* otherwise it stays on read_ee until the checksums are computed */
+	if (!csums) {
+		list_del(&peer_req->w.list);
+		if (list_empty(&connection->read_ee))
+			wake_up(&connection->ee_wait);
+	}
 	if (test_bit(__EE_WAS_ERROR, &peer_req->flags))
 		__drbd_chk_io_error(device, DRBD_READ_ERROR);
 	spin_unlock_irqrestore(&connection->peer_reqs_lock, flags);
 
+	if (csums) {
+		drbd_csum_queue(csums);
+		rcu_read_unlock();
+		return;
+	}
+	rcu_read_unlock();
 	drbd_queue_work(&connection->sender_work, &peer_req->w);
 	put_ldev(device);
 }
@@ -148,6 +170,9 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 	sector = peer_req->i.sector;
 	block_id = peer_req->block_id;
 
+	if ((peer_req->flags & (EE_APPLICATION | EE_WAS_ERROR)) == EE_APPLICATION)
+		drbd_app_io_done(device, peer_req->submit_kt);
+
 	if (peer_req->flags & EE_WAS_ERROR) {
                 /* In protocol != C, we usually do not send write acks.
                  * In case of a write error, send the neg ack anyways. */
@@ -223,6 +248,29 @@ void drbd_peer_request_endio(struct bio *bio)
 	}
 }
 
+/* For adjacent peer writes that were submitted with a single bio,
+ * chained by peer_req->merged_next */
+void drbd_peer_writes_merged_endio(struct bio *bio)
+{
+	struct drbd_peer_request *peer_req = bio->bi_private, *next;
+	struct drbd_device *device = peer_req->peer_device->device;
+	blk_status_t status = bio->bi_status;
+
+	if (status && drbd_ratelimit())
+		drbd_warn(device, "write: error=%d s=%llus\n", status,
+			  (unsigned long long)peer_req->i.sector);
+
+	bio_put(bio);
+	for (; peer_req; peer_req = next) {
+		next = peer_req->merged_next;
+		peer_req->merged_next = NULL;
+		if (status)
+			set_bit(__EE_WAS_ERROR, &peer_req->flags);
+		if (atomic_dec_and_test(&peer_req->pending_bios))
+			drbd_endio_write_sec_final(peer_req);
+	}
+}
+
 /* Not static to increase the likelyhood that it will show up in a stack trace */
 void drbd_panic_after_delayed_completion_of_aborted_request(struct drbd_device *device)
 {
@@ -297,6 +345,7 @@ void drbd_request_endio(struct bio *bio)
 		}
 	} else {
 		what = COMPLETED_OK;
+		drbd_app_io_done(device, req->pre_submit_kt);
 	}
 
 	bio_put(req->private_bio);
@@ -332,6 +381,40 @@ void drbd_csum_pages(struct crypto_shash *tfm, struct page *page, void *digest)
 	shash_desc_zero(desc);
 }
 
+/* Digest of size bytes at offset into the page chain */
+void drbd_csum_page_range(struct crypto_shash *tfm, struct page *page,
+			  unsigned int offset, unsigned int size, void *digest)
+{
+	SHASH_DESC_ON_STACK(desc, tfm);
+
+	desc->tfm = tfm;
+
+	crypto_shash_init(desc);
+
+	page_chain_for_each(page) {
+		unsigned off = page_chain_offset(page);
+		unsigned len = page_chain_size(page);
+		u8 *src;
+
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		off += offset;
+		len = min(len - offset, size);
+		offset = 0;
+
+		src = kmap_atomic(page);
+		crypto_shash_update(desc, src + off, len);
+		kunmap_atomic(src);
+		size -= len;
+		if (!size)
+			break;
+	}
+	crypto_shash_final(desc, digest);
+	shash_desc_zero(desc);
+}
+
 void drbd_csum_bio(struct crypto_shash *tfm, struct bio *bio, void *digest)
 {
 	struct bio_vec bvec;
@@ -356,6 +439,216 @@ void drbd_csum_bio(struct crypto_shash *tfm, struct bio *bio, void *digest)
 	shash_desc_zero(desc);
 }
 
+/* Checksums of reads for online verify and checksum based resync are
+ * computed on drbd_csum_wq, so that these can use more than one CPU.
+ * The peer requests stay on read_ee until then, and are passed on to the
+ * sender in the order their reads completed. */
+struct drbd_csums {
+	struct work_struct work;
+	struct list_head list; /* on connection->csum_jobs */
+	struct drbd_peer_request *peer_req;
+	struct crypto_shash *tfm;
+	unsigned int tfm_gen; /* connection->csum_tfm_gen when tfm was read */
+	unsigned int chunk_size;
+	unsigned int digest_size;
+	bool done;
+	u8 digests[];
+};
+
+static unsigned int csum_batch_chunks(struct drbd_connection *, unsigned int);
+static int w_e_send_csum(struct drbd_work *, int);
+
+/* Which digests the sender work of a peer request is going to need */
+static bool csum_layout(struct drbd_peer_request *peer_req,
+			struct crypto_shash **tfm, unsigned int *chunk_size)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	unsigned int size = peer_req->i.size;
+	bool batch;
+
+	if (peer_req->w.cb == w_e_send_csum || peer_req->w.cb == w_e_end_csum_rs_req) {
+		batch = peer_req->w.cb == w_e_send_csum ?
+			csum_batch_chunks(connection, size) > 1 :
+			peer_req->flags & EE_CSUM_BATCH;
+		*tfm = READ_ONCE(connection->csums_tfm);
+		*chunk_size = batch ? BM_BLOCK_SIZE : size;
+	} else if (peer_req->w.cb == w_e_end_ov_req || peer_req->w.cb == w_e_end_ov_reply) {
+		*tfm = READ_ONCE(connection->verify_tfm);
+		*chunk_size = size;
+	} else {
+		return false;
+	}
+	return *tfm && size;
+}
+
+static void csum_done(struct drbd_peer_request *peer_req)
+{
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+
+	spin_lock(&connection->peer_reqs_lock);
+	list_del(&peer_req->w.list);
+	if (list_empty(&connection->read_ee))
+		wake_up(&connection->ee_wait);
+	spin_unlock(&connection->peer_reqs_lock);
+
+	drbd_queue_work(&connection->sender_work, &peer_req->w);
+	put_ldev(peer_device->device);
+}
+
+static void drbd_csum_work(struct work_struct *ws)
+{
+	struct drbd_csums *csums = container_of(ws, struct drbd_csums, work);
+	struct drbd_peer_request *peer_req = csums->peer_req;
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	unsigned int size = peer_req->i.size;
+	unsigned int offset, i;
+	unsigned long flags;
+
+	for (i = 0, offset = 0; offset < size; i++, offset += csums->chunk_size)
+		drbd_csum_page_range(csums->tfm, peer_req->page_chain.head, offset,
+				     min(csums->chunk_size, size - offset),
+				     csums->digests + i * csums->digest_size);
+
+	spin_lock_irqsave(&connection->csum_lock, flags);
+	csums->done = true;
+	while (!list_empty(&connection->csum_jobs)) {
+		csums = list_first_entry(&connection->csum_jobs, struct drbd_csums, list);
+		if (!csums->done)
+			break;
+		list_del(&csums->list);
+		csum_done(csums->peer_req);
+	}
+	spin_unlock_irqrestore(&connection->csum_lock, flags);
+}
+
+/* Called from drbd_endio_read_sec_final(), possibly in irq context */
+static struct drbd_csums *drbd_csum_prepare(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct drbd_csums *csums;
+	struct crypto_shash *tfm;
+	unsigned int chunk_size, digest_size, tfm_gen;
+
+	if (!READ_ONCE(drbd_csum_offload) || !drbd_csum_wq ||
+	    test_bit(__EE_WAS_ERROR, &peer_req->flags))
+		return NULL;
+
+	/* pairs with the smp_wmb() in drbd_csum_replace_tfm() */
+	tfm_gen = READ_ONCE(connection->csum_tfm_gen);
+	smp_rmb();
+	if (!csum_layout(peer_req, &tfm, &chunk_size))
+		return NULL;
+
+	digest_size = crypto_shash_digestsize(tfm);
+	csums = kmalloc(struct_size(csums, digests,
+			DIV_ROUND_UP(peer_req->i.size, chunk_size) * digest_size), GFP_ATOMIC);
+	if (!csums)
+		return NULL;
+
+	INIT_WORK(&csums->work, drbd_csum_work);
+	csums->peer_req = peer_req;
+	csums->tfm = tfm;
+	csums->tfm_gen = tfm_gen;
+	csums->chunk_size = chunk_size;
+	csums->digest_size = digest_size;
+	csums->done = false;
+	peer_req->csums = csums;
+	return csums;
+}
+
+static void drbd_csum_queue(struct drbd_csums *csums)
+{
+	struct drbd_connection *connection = csums->peer_req->peer_device->connection;
+	unsigned long flags;
+
+	spin_lock_irqsave(&connection->csum_lock, flags);
+	list_add_tail(&csums->list, &connection->csum_jobs);
+	spin_unlock_irqrestore(&connection->csum_lock, flags);
+
+	queue_work(drbd_csum_wq, &csums->work);
+}
+
+/* Install a new csums or verify tfm. Checksum jobs capture the tfm in
+ * drbd_endio_read_sec_final() within an RCU read side section, so after the
+ * grace period all jobs using the old one are on drbd_csum_wq.
+ * Digests computed with the old one carry an older csum_tfm_gen, and are not
+ * used even if the new tfm happens to get the address of the old one. */
+void drbd_csum_replace_tfm(struct drbd_connection *connection, struct crypto_shash **tfm,
+			   struct crypto_shash *new_tfm)
+{
+	struct crypto_shash *old_tfm = *tfm;
+
+	WRITE_ONCE(*tfm, new_tfm);
+	smp_wmb();
+	WRITE_ONCE(connection->csum_tfm_gen, connection->csum_tfm_gen + 1);
+	if (old_tfm && drbd_csum_wq) {
+		synchronize_rcu();
+		flush_workqueue(drbd_csum_wq);
+	}
+	crypto_free_shash(old_tfm);
+}
+
+/* Digest of the chunk_size bytes at chunk * chunk_size of a peer request,
+ * as computed by drbd_csum_work() if possible */
+static void peer_req_csum(struct drbd_peer_request *peer_req, struct crypto_shash *tfm,
+			  unsigned int chunk_size, unsigned int chunk, void *digest)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct drbd_csums *csums = peer_req->csums;
+	unsigned int size = peer_req->i.size;
+	unsigned int offset = chunk * chunk_size;
+
+	if (csums && csums->tfm_gen == READ_ONCE(connection->csum_tfm_gen) &&
+	    csums->tfm == tfm && csums->chunk_size == chunk_size &&
+	    csums->digest_size == crypto_shash_digestsize(tfm)) {
+		memcpy(digest, csums->digests + chunk * csums->digest_size, csums->digest_size);
+		return;
+	}
+	if (chunk_size >= size)
+		drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+	else
+		drbd_csum_page_range(tfm, peer_req->page_chain.head, offset,
+				     min(chunk_size, size - offset), digest);
+}
+
+/* Number of BM_BLOCK_SIZE chunks to compare separately, 1 if not batching */
+static unsigned int csum_batch_chunks(struct drbd_connection *connection, unsigned int size)
+{
+	if (!drbd_csums_batch || !(connection->agreed_features & DRBD_FF_CSUM_BATCH))
+		return 1;
+	return DIV_ROUND_UP(size, BM_BLOCK_SIZE);
+}
+
+/* Batched variant of the P_CSUM_RS_REQUEST: one digest per chunk, so that the
+ * sync source only needs to send the chunks that differ.
+ * Consumes peer_req, unless it returns -ENOMEM. */
+static int send_csum_batch(struct drbd_peer_device *peer_device,
+			   struct drbd_peer_request *peer_req, int digest_size)
+{
+	struct crypto_shash *tfm = peer_device->connection->csums_tfm;
+	unsigned int size = peer_req->i.size;
+	unsigned int chunks = DIV_ROUND_UP(size, BM_BLOCK_SIZE);
+	sector_t sector = peer_req->i.sector;
+	unsigned int i;
+	u8 *digests;
+	int err;
+
+	digests = kmalloc(chunks * digest_size, GFP_NOIO);
+	if (!digests)
+		return -ENOMEM;
+
+	for (i = 0; i < chunks; i++)
+		peer_req_csum(peer_req, tfm, BM_BLOCK_SIZE, i, digests + i * digest_size);
+	/* Free peer_req and pages before send, see w_e_send_csum() */
+	drbd_free_peer_req(peer_req);
+
+	inc_rs_pending(peer_device);
+	err = drbd_send_csum_batch(peer_device, sector, size, digests, chunks * digest_size);
+	kfree(digests);
+	return err;
+}
+
 /* MAYBE merge common code with w_e_end_ov_req */
 static int w_e_send_csum(struct drbd_work *w, int cancel)
 {
@@ -372,9 +665,17 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 		goto out;
 
 	digest_size = crypto_shash_digestsize(peer_device->connection->csums_tfm);
+	if (csum_batch_chunks(peer_device->connection, peer_req->i.size) > 1) {
+		err = send_csum_batch(peer_device, peer_req, digest_size);
+		if (err != -ENOMEM) {
+			peer_req = NULL;
+			goto out;
+		}
+		err = 0;
+	}
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (digest) {
-		drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		peer_req_csum(peer_req, peer_device->connection->csums_tfm, peer_req->i.size, 0, digest);
 		/* Free peer_req and pages before send.
 		 * In case we block on congestion, we could otherwise run into
 		 * some distributed deadlock, if the other side blocks on
@@ -398,7 +699,9 @@ out:
 	return err;
 }
 
-static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector, int size)
+/* Read a resync block on our own initiative, cb is called once the read completed */
+static int read_for_resync(struct drbd_peer_device *peer_device, sector_t sector, int size,
+			   int (*cb)(struct drbd_work *, int))
 {
 	struct drbd_connection *connection = peer_device->connection;
 	struct drbd_device *device = peer_device->device;
@@ -421,7 +724,7 @@ static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector,
 	peer_req->i.sector = sector;
 	peer_req->block_id = ID_SYNCER; /* unused */
 
-	peer_req->w.cb = w_e_send_csum;
+	peer_req->w.cb = cb;
 	peer_req->opf = REQ_OP_READ;
 	spin_lock_irq(&connection->peer_reqs_lock);
 	list_add_tail(&peer_req->w.list, &connection->read_ee);
@@ -462,6 +765,10 @@ int w_resync_timer(struct drbd_work *w, int cancel)
 	case L_SYNC_TARGET:
 		make_resync_request(peer_device, cancel);
 		break;
+	case L_SYNC_SOURCE:
+		if (test_bit(RS_PUSH, &peer_device->flags) && !cancel)
+			make_resync_push(peer_device);
+		break;
 	default:
 		break;
 	}
@@ -609,6 +916,76 @@ static int drbd_rs_controller(struct drbd_peer_device *peer_device, u64 sect_in,
 	return req_sect;
 }
 
+/* Latency based resync controller, see drbd_resync_latency_us.
+ * Models the average latency of application I/O on the backing device as
+ * base + k * resync rate. The base is a slowly rising minimum of what we see,
+ * k is refitted with each step. Picks the rate for which the model predicts
+ * the target latency, changing it by at most a factor of two per step, and
+ * keeps at least a network round trip worth of resync data in flight. */
+static int drbd_rs_latency_controller(struct drbd_peer_device *peer_device, u64 duration_ns)
+{
+	struct drbd_device *device = peer_device->device;
+	struct peer_device_conf *pdc = rcu_dereference(peer_device->conf);
+	u64 target_ns = (u64)READ_ONCE(drbd_resync_latency_us) * NSEC_PER_USEC;
+	bool measuring = drbd_app_io_latency(device);
+	u64 lat_sum = atomic64_read(&device->app_lat_ns);
+	int lat_cnt = atomic_read(&device->app_lat_cnt);
+	int samples = lat_cnt - peer_device->rs_lat_cnt_seen;
+	u64 rate = peer_device->rs_lat_rate ?: max(pdc->resync_rate, 1U);
+	u64 base = peer_device->rs_lat_base_ns;
+	u64 lat_ns = 0, next, want, req_sect;
+
+	if (samples > 0)
+		lat_ns = div_u64(lat_sum - peer_device->rs_lat_ns_seen, samples);
+	peer_device->rs_lat_ns_seen = lat_sum;
+	peer_device->rs_lat_cnt_seen = lat_cnt;
+	/* Keep measuring until a second after the last step */
+	WRITE_ONCE(device->app_lat_until, jiffies + HZ);
+
+	if (!measuring) {
+		/* Nothing measured yet, keep the rate for this step */
+		next = rate;
+	} else if (samples <= 0) {
+		/* No application I/O, resync as fast as we may */
+		next = rate * 2;
+	} else {
+		if (!base || lat_ns < base)
+			base = lat_ns;
+		else
+			base += (lat_ns - base) / 64;
+		peer_device->rs_lat_base_ns = base;
+
+		if (lat_ns > base) {
+			u64 k = div64_u64((lat_ns - base) << 10, rate);
+
+			peer_device->rs_lat_k = peer_device->rs_lat_k ?
+				(peer_device->rs_lat_k * 7 + k) / 8 : k;
+		}
+
+		if (target_ns <= base)
+			next = rate / 2;
+		else if (!peer_device->rs_lat_k)
+			next = rate * 2;
+		else
+			next = div64_u64((target_ns - base) << 10, peer_device->rs_lat_k);
+		next = clamp(next, rate / 2, rate * 2);
+	}
+	next = clamp_t(u64, next, max(pdc->c_min_rate, 4U), max(pdc->c_max_rate, 4U));
+	peer_device->rs_lat_rate = next;
+
+	/* KiB/s to sectors in this step */
+	req_sect = div_u64(next * 2 * duration_ns, NSEC_PER_SEC);
+	want = div_u64(next * 2 * peer_device->connection->rtt_ns, NSEC_PER_SEC);
+	if (peer_device->rs_in_flight + req_sect < want)
+		req_sect = want - peer_device->rs_in_flight;
+
+	dynamic_drbd_dbg(peer_device, "dur=%lluns samples=%d lat=%lluns base=%lluns k=%llu rtt=%lluns rate=%llu in_flight=%d rs=%llu\n",
+		 duration_ns, samples, lat_ns, base, peer_device->rs_lat_k,
+		 peer_device->connection->rtt_ns, next, peer_device->rs_in_flight, req_sect);
+
+	return min_t(u64, req_sect, INT_MAX);
+}
+
 static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 {
 	struct net_conf *nc;
@@ -626,7 +1003,10 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	rcu_read_lock();
 	nc = rcu_dereference(peer_device->connection->transport.net_conf);
 	mxb = nc ? nc->max_buffers : 0;
-	if (rcu_dereference(peer_device->rs_plan_s)->size) {
+	if (READ_ONCE(drbd_resync_latency_us)) {
+		number = drbd_rs_latency_controller(peer_device, ktime_to_ns(duration)) >> (BM_BLOCK_SHIFT - 9);
+		peer_device->c_sync_rate = peer_device->rs_lat_rate;
+	} else if (rcu_dereference(peer_device->rs_plan_s)->size) {
 		number = drbd_rs_controller(peer_device, sect_in, ktime_to_ns(duration)) >> (BM_BLOCK_SHIFT - 9);
 		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / RS_MAKE_REQS_INTV;
 	} else {
@@ -650,18 +1030,258 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	return number;
 }
 
+/* Maximum number of bitmap bits a resync request starting at bit may cover.
+ * Bigger requests are always aligned, in order to be prepared for all stripe
+ * sizes of software RAIDs, and never cross a resync extent boundary, since
+ * the peer locks only the extent of the first sector. */
+static unsigned long resync_request_bits(unsigned long bit, unsigned int max_request_size,
+					 int discard_granularity, int budget)
+{
+	unsigned long bits = max_t(unsigned long, max_request_size >> BM_BLOCK_SHIFT, 1);
+
+	bits = min_t(unsigned long, bits, max(budget, 1));
+	if (bit)
+		bits = min(bits, 1UL << __ffs(bit));
+	if (discard_granularity)
+		bits = min_t(unsigned long, bits,
+			     max(discard_granularity >> BM_BLOCK_SHIFT, 1));
+	return min_t(unsigned long, bits, BM_BITS_PER_EXT - (bit & BM_BLOCKS_PER_BM_EXT_MASK));
+}
+
+/* Whether another sync target of the device is working on the resync
+ * extent of bit, see find_next_resync_bit() */
+static bool extent_claimed_by_other(struct drbd_peer_device *peer_device, unsigned long bit)
+{
+	struct drbd_peer_device *p;
+	bool claimed = false;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, peer_device->device) {
+		unsigned long end = READ_ONCE(p->rs_claim_end);
+
+		if (p == peer_device || !READ_ONCE(p->rs_claim) || !end ||
+		    p->repl_state[NOW] != L_SYNC_TARGET)
+			continue;
+		if (BM_BIT_TO_EXT(end - 1) == BM_BIT_TO_EXT(bit)) {
+			claimed = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return claimed;
+}
+
+/* Called on the submit path of application reads that go to a peer because
+ * the blocks are still out of sync here. Have the resync request the resync
+ * extents of the read first, instead of the read waiting for the resync to
+ * get there, and repeated reads going to the peer in the meantime. */
+void drbd_rs_read_priority(struct drbd_device *device, struct drbd_peer_device *read_peer_device,
+			   sector_t sector, int size)
+{
+	struct drbd_peer_device *peer_device = NULL, *p;
+	unsigned int enr, last_enr;
+	unsigned long flags;
+	bool queue = false;
+	int i;
+
+	if (!READ_ONCE(drbd_resync_on_read) || !size)
+		return;
+
+	if (read_peer_device && read_peer_device->repl_state[NOW] == L_SYNC_TARGET) {
+		peer_device = read_peer_device;
+	} else {
+		rcu_read_lock();
+		for_each_peer_device_rcu(p, device) {
+			if (p->repl_state[NOW] == L_SYNC_TARGET) {
+				peer_device = p;
+				break;
+			}
+		}
+		rcu_read_unlock();
+	}
+	if (!peer_device)
+		return;
+
+	last_enr = BM_SECT_TO_EXT(sector + (size >> 9) - 1);
+	spin_lock_irqsave(&peer_device->rs_prio_lock, flags);
+	for (enr = BM_SECT_TO_EXT(sector); enr <= last_enr; enr++) {
+		if (READ_ONCE(peer_device->rs_prio_end) &&
+		    BM_BIT_TO_EXT(READ_ONCE(peer_device->rs_prio_start)) == enr)
+			continue;
+		for (i = 0; i < peer_device->rs_prio_cnt; i++) {
+			if (peer_device->rs_prio_ext[i] == enr)
+				break;
+		}
+		if (i == peer_device->rs_prio_cnt && i < RS_PRIO_EXTENTS) {
+			peer_device->rs_prio_ext[peer_device->rs_prio_cnt++] = enr;
+			queue = true;
+		}
+	}
+	spin_unlock_irqrestore(&peer_device->rs_prio_lock, flags);
+
+	if (queue)
+		drbd_queue_work_if_unqueued(&peer_device->connection->sender_work,
+					    &peer_device->resync_work);
+}
+
+/* Remember an extent the tail pass left to another sync target. Returns
+ * false if there is no room, and the caller has to request it itself. */
+static bool skip_claimed_extent(struct drbd_peer_device *peer_device, unsigned int enr)
+{
+	int i;
+
+	for (i = 0; i < peer_device->rs_skipped_cnt; i++) {
+		if (peer_device->rs_skipped_ext[i] == enr)
+			return true;
+	}
+	if (i == ARRAY_SIZE(peer_device->rs_skipped_ext))
+		return false;
+	peer_device->rs_skipped_ext[peer_device->rs_skipped_cnt++] = enr;
+	return true;
+}
+
+/* Have the extents left to other sync targets that are no longer working
+ * on them requested like those application reads wait for. Returns whether
+ * any are left. */
+static bool requeue_skipped_extents(struct drbd_peer_device *peer_device)
+{
+	unsigned int enr;
+	int i = 0, j;
+
+	while (i < peer_device->rs_skipped_cnt) {
+		enr = peer_device->rs_skipped_ext[i];
+		if (extent_claimed_by_other(peer_device, (unsigned long)enr * BM_BITS_PER_EXT)) {
+			i++;
+			continue;
+		}
+
+		spin_lock_irq(&peer_device->rs_prio_lock);
+		for (j = 0; j < peer_device->rs_prio_cnt; j++) {
+			if (peer_device->rs_prio_ext[j] == enr)
+				break;
+		}
+		if (j == peer_device->rs_prio_cnt && j == RS_PRIO_EXTENTS) {
+			spin_unlock_irq(&peer_device->rs_prio_lock);
+			break;
+		}
+		if (j == peer_device->rs_prio_cnt)
+			peer_device->rs_prio_ext[peer_device->rs_prio_cnt++] = enr;
+		spin_unlock_irq(&peer_device->rs_prio_lock);
+
+		peer_device->rs_skipped_ext[i] =
+			peer_device->rs_skipped_ext[--peer_device->rs_skipped_cnt];
+	}
+	return peer_device->rs_skipped_cnt || READ_ONCE(peer_device->rs_prio_cnt);
+}
+
+static void reset_rs_priority(struct drbd_peer_device *peer_device)
+{
+	spin_lock_irq(&peer_device->rs_prio_lock);
+	peer_device->rs_prio_cnt = 0;
+	spin_unlock_irq(&peer_device->rs_prio_lock);
+	WRITE_ONCE(peer_device->rs_prio_end, 0);
+}
+
+/* Take the next resync extent queued by drbd_rs_read_priority(), and
+ * remember where to go on after it. Returns false if there is none. */
+static bool start_rs_prio_extent(struct drbd_peer_device *peer_device)
+{
+	const unsigned long bm_bits = drbd_bm_bits(peer_device->device);
+	unsigned long start;
+	unsigned int enr;
+
+	spin_lock_irq(&peer_device->rs_prio_lock);
+	if (!peer_device->rs_prio_cnt) {
+		spin_unlock_irq(&peer_device->rs_prio_lock);
+		return false;
+	}
+	enr = peer_device->rs_prio_ext[0];
+	peer_device->rs_prio_cnt--;
+	memmove(peer_device->rs_prio_ext, peer_device->rs_prio_ext + 1,
+		peer_device->rs_prio_cnt * sizeof(peer_device->rs_prio_ext[0]));
+	spin_unlock_irq(&peer_device->rs_prio_lock);
+
+	start = (unsigned long)enr * BM_BITS_PER_EXT;
+	peer_device->rs_prio_saved_bit = peer_device->resync_next_bit;
+	peer_device->resync_next_bit = start;
+	WRITE_ONCE(peer_device->rs_prio_start, start);
+	WRITE_ONCE(peer_device->rs_prio_end, max(min(start + BM_BITS_PER_EXT, bm_bits), start + 1));
+	return true;
+}
+
+/* Extents application reads wait for come first, see drbd_rs_read_priority().
+ * With resync_multi_source, all sync targets of a device take whole resync
+ * extents from one shared cursor, so that each peer serves as many as it
+ * keeps up with. Data received from one peer gets set in sync for the others
+ * by the P_PEERS_IN_SYNC packets of the sync sources. Once all extents are
+ * taken, request what is still out of sync from the start, leaving out the
+ * extents other peers are still working on. */
+static unsigned long find_next_resync_bit(struct drbd_peer_device *peer_device, bool prio_only)
+{
+	struct drbd_device *device = peer_device->device;
+	const unsigned long bm_bits = drbd_bm_bits(device);
+	unsigned long bit, ext;
+
+	for (;;) {
+		if (!peer_device->rs_prio_end && !start_rs_prio_extent(peer_device))
+			break;
+		if (peer_device->resync_next_bit < peer_device->rs_prio_start) {
+			/* Moved back by the receiver, go on from there afterwards */
+			peer_device->rs_prio_saved_bit = min(peer_device->rs_prio_saved_bit,
+							     peer_device->resync_next_bit);
+			peer_device->resync_next_bit = peer_device->rs_prio_start;
+		}
+		if (peer_device->resync_next_bit < peer_device->rs_prio_end) {
+			bit = drbd_bm_range_find_next(peer_device, peer_device->resync_next_bit,
+						      peer_device->rs_prio_end - 1);
+			if (bit != DRBD_END_OF_BITMAP)
+				return bit;
+		}
+		peer_device->resync_next_bit = peer_device->rs_prio_saved_bit;
+		WRITE_ONCE(peer_device->rs_prio_end, 0);
+	}
+	if (prio_only)
+		return DRBD_END_OF_BITMAP;
+
+	while (peer_device->rs_claim) {
+		if (peer_device->resync_next_bit < peer_device->rs_claim_end) {
+			bit = drbd_bm_range_find_next(peer_device, peer_device->resync_next_bit,
+						      peer_device->rs_claim_end - 1);
+			if (bit != DRBD_END_OF_BITMAP)
+				return bit;
+		}
+		ext = atomic_inc_return(&device->rs_claim_ext) - 1;
+		if (!bm_bits || ext > BM_BIT_TO_EXT(bm_bits - 1)) {
+			WRITE_ONCE(peer_device->rs_claim, false);
+			peer_device->resync_next_bit = 0;
+			break;
+		}
+		peer_device->resync_next_bit = ext * BM_BITS_PER_EXT;
+		WRITE_ONCE(peer_device->rs_claim_end,
+			   min(peer_device->resync_next_bit + BM_BITS_PER_EXT, bm_bits));
+	}
+
+	for (;;) {
+		bit = drbd_bm_find_next(peer_device, peer_device->resync_next_bit);
+		if (bit == DRBD_END_OF_BITMAP || !extent_claimed_by_other(peer_device, bit) ||
+		    !skip_claimed_extent(peer_device, BM_BIT_TO_EXT(bit)))
+			return bit;
+		peer_device->resync_next_bit = (bit | BM_BLOCKS_PER_BM_EXT_MASK) + 1;
+	}
+}
+
 static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_transport *transport = &peer_device->connection->transport;
-	unsigned long bit;
+	unsigned long bit, bits, end;
 	sector_t sector;
 	const sector_t capacity = drbd_get_capacity(device->this_bdev);
-	int max_bio_size;
+	unsigned int max_request_size;
 	int number, rollback_i, size;
-	int align;
 	int i;
 	int discard_granularity = 0;
+	bool prio_only, skipped = false;
 
 	if (unlikely(cancel))
 		return 0;
@@ -690,17 +1310,38 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		return 0;
 	}
 
+	/* The sync source sends the data on its own, see receive_rs_push_done()
+	 * for when we take over again. Only what application reads wait for
+	 * gets requested in the meantime. */
+	prio_only = peer_device->use_push;
+	if (prio_only) {
+		if (!test_and_set_bit(RS_PUSH_REQUESTED, &peer_device->flags) &&
+		    drbd_send_drequest(peer_device, P_RS_DATA_REQUEST,
+				       BM_BIT_TO_SECT(peer_device->resync_next_bit), 0, ID_RS_PUSH))
+			clear_bit(RS_PUSH_REQUESTED, &peer_device->flags);
+		if (!peer_device->rs_prio_end && !READ_ONCE(peer_device->rs_prio_cnt)) {
+			put_ldev(device);
+			return 0;
+		}
+	}
+
 	if (peer_device->connection->agreed_features & DRBD_FF_THIN_RESYNC) {
 		rcu_read_lock();
 		discard_granularity = rcu_dereference(device->ldev->disk_conf)->rs_discard_granularity;
 		rcu_read_unlock();
 	}
 
-	max_bio_size = queue_max_hw_sectors(device->rq_queue) << 9;
-	number = drbd_rs_number_requests(peer_device);
-	/* don't let rs_sectors_came_in() re-schedule us "early"
-	 * just because the first reply came "fast", ... */
-	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
+	max_request_size = min(queue_max_hw_sectors(device->rq_queue) << 9,
+			       READ_ONCE(drbd_resync_request_kb) << 10);
+	if (prio_only) {
+		/* The resync controller does not run while the sync source streams */
+		number = BM_BITS_PER_EXT / 8;
+	} else {
+		number = drbd_rs_number_requests(peer_device);
+		/* don't let rs_sectors_came_in() re-schedule us "early"
+		 * just because the first reply came "fast", ... */
+		peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
+	}
 
 	for (i = 0; i < number; i++) {
 		bool send_buffer_ok = true;
@@ -724,131 +1365,273 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 			goto request_done;
 
 next_sector:
-		size = BM_BLOCK_SIZE;
-		bit  = drbd_bm_find_next(peer_device, peer_device->resync_next_bit);
+		bit = find_next_resync_bit(peer_device, prio_only);
 
 		if (bit == DRBD_END_OF_BITMAP) {
-			peer_device->resync_next_bit = drbd_bm_bits(device);
+			if (!prio_only) {
+				peer_device->resync_next_bit = drbd_bm_bits(device);
+				skipped = requeue_skipped_extents(peer_device);
+			}
 			goto request_done;
 		}
 
 		sector = BM_BIT_TO_SECT(bit);
 
-		if (drbd_try_rs_begin_io(peer_device, sector, true)) {
+		/* Do not throttle what application reads wait for */
+		if (drbd_try_rs_begin_io(peer_device, sector, !peer_device->rs_prio_end)) {
 			peer_device->resync_next_bit = bit;
 			goto request_done;
 		}
 
-		if (unlikely(drbd_bm_test_bit(peer_device, bit) == 0)) {
+		/* take the whole run of adjacent dirty bits, with one scan of
+		 * the bitmap, up to the maximum request size */
+		rollback_i = i;
+		bits = resync_request_bits(bit, max_request_size, discard_granularity, number - i);
+		end = drbd_bm_range_find_next_zero(peer_device, bit, bit + bits - 1);
+		if (end != DRBD_END_OF_BITMAP)
+			bits = end - bit;
+		if (unlikely(bits == 0)) {
 			peer_device->resync_next_bit = bit + 1;
 			drbd_rs_complete_io(peer_device, sector);
 			goto next_sector;
 		}
+		size = bits << BM_BLOCK_SHIFT;
+		i += bits - 1;
+		/* set the offset to start the next drbd_bm_find_next from */
+		peer_device->resync_next_bit = bit + bits;
 
-		/* try to find some adjacent bits.
-		 * we stop if we have already the maximum req size.
-		 *
-		 * Additionally always align bigger requests, in order to
-		 * be prepared for all stripe sizes of software RAIDs.
-		 */
-		align = 1;
-		rollback_i = i;
-		while (i + 1 < number) {
-			if (size + BM_BLOCK_SIZE > max_bio_size)
-				break;
+		/* adjust very last sectors, in case we are oddly sized */
+		if (sector + (size>>9) > capacity)
+			size = (capacity-sector)<<9;
 
-			/* Be always aligned */
-			if (sector & ((1<<(align+3))-1))
+		if (peer_device->use_csums) {
+			switch (read_for_resync(peer_device, sector, size, w_e_send_csum)) {
+			case -EIO: /* Disk failure */
+				put_ldev(device);
+				return -EIO;
+			case -EAGAIN: /* allocation failed, or ldev busy */
+				drbd_rs_complete_io(peer_device, sector);
+				peer_device->resync_next_bit = BM_SECT_TO_BIT(sector);
+				i = rollback_i;
+				goto request_done;
+			case 0:
+				/* everything ok */
 				break;
+			default:
+				BUG();
+			}
+		} else {
+			int err;
 
-			if (discard_granularity && size == discard_granularity)
-				break;
+			inc_rs_pending(peer_device);
+			err = drbd_send_drequest(peer_device,
+						 /* P_RS_DEALLOCATED would look streamed */
+						 size == discard_granularity && !prio_only ?
+						 P_RS_THIN_REQ : P_RS_DATA_REQUEST,
+						 sector, size, ID_SYNCER);
+			if (err) {
+				drbd_err(device, "drbd_send_drequest() failed, aborting...\n");
+				dec_rs_pending(peer_device);
+				put_ldev(device);
+				return err;
+			}
+		}
+	}
+
+request_done:
+	if (prio_only) {
+		if (peer_device->rs_prio_end)
+			mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+		put_ldev(device);
+		return 0;
+	}
+
+	/* ... but do a correction, in case we had to break/goto request_done; */
+	peer_device->rs_in_flight -= (number - i) * BM_SECT_PER_BIT;
+
+	if (peer_device->resync_next_bit >= drbd_bm_bits(device) && !skipped) {
+		/* last syncer _request_ was sent,
+		 * but the P_RS_DATA_REPLY not yet received.  sync will end (and
+		 * next sync group will resume), as soon as we receive the last
+		 * resync data block, and the last bit is cleared.
+		 * until then resync "work" is "inactive" ...
+		 */
+		put_ldev(device);
+		return 0;
+	}
+
+	/* and in case that raced with the receiver, reschedule ourselves right now */
+	if (i > 0 && atomic_read(&peer_device->rs_sect_in) >= peer_device->rs_in_flight)
+		drbd_queue_work_if_unqueued(
+			&peer_device->connection->sender_work,
+			&peer_device->resync_work);
+	else
+		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+	put_ldev(device);
+	return 0;
+}
+
+/* Once the whole bitmap was streamed and acknowledged, let the sync target
+ * request what is left. Waiting for the acks keeps it from requesting blocks
+ * that are still being written. */
+static void maybe_finish_resync_push(struct drbd_peer_device *peer_device)
+{
+	if (peer_device->rs_push_reads || peer_device->rs_push_zero_size ||
+	    atomic_read(&peer_device->rs_pending_cnt) ||
+	    peer_device->resync_next_bit < drbd_bm_bits(peer_device->device))
+		return;
+	if (test_and_clear_bit(RS_PUSH, &peer_device->flags))
+		drbd_send_rs_push_done(peer_device);
+}
+
+static int w_e_end_rs_push(struct drbd_work *w, int cancel)
+{
+	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
+	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_device *device = peer_device->device;
+	int err = 0;
+
+	peer_device->rs_push_reads--;
+
+	if (get_ldev_if_state(device, D_DETACHING)) {
+		drbd_rs_complete_io(peer_device, peer_req->i.sector);
+		put_ldev(device);
+	}
+
+	/* Blocks we do not send here are left for the sync target to
+	 * request once streaming is over */
+	if (likely(!cancel && (peer_req->flags & EE_WAS_ERROR) == 0 &&
+		   peer_device->repl_state[NOW] == L_SYNC_SOURCE &&
+		   peer_device->disk_state[NOW] >= D_INCONSISTENT)) {
+		if (connection->agreed_features & DRBD_FF_THIN_RESYNC ||
+		    drbd_dedup_prepare(connection)) {
+			err = send_rs_push_sparse(peer_device, peer_req);
+		} else {
+			inc_rs_pending(peer_device);
+			peer_req->flags |= EE_RS_PUSH;
+			err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
+		}
+		if (unlikely(err))
+			drbd_err(peer_device, "drbd_send_block() failed\n");
+	} else {
+		atomic_sub(peer_req->i.size >> 9, &connection->rs_in_flight);
+		if (cancel || peer_device->repl_state[NOW] != L_SYNC_SOURCE)
+			drop_rs_push_zeroes(peer_device);
+	}
+
+	if (!cancel) {
+		/* Do not hold back a run of zeroes while nothing follows it */
+		if (!err && !peer_device->rs_push_reads)
+			err = flush_rs_push_zeroes(peer_device);
+		maybe_finish_resync_push(peer_device);
+	}
+
+	move_to_net_ee_or_free(connection, peer_req);
+	return err;
+}
+
+/* SyncSource side of streaming resync: read the out-of-sync blocks in
+ * sequence. Paced like make_resync_request(): each step reads as much as
+ * the resync controller allows, unless c-min-rate throttles the resync,
+ * and never more than resync_push_kb of resync data is unacked.
+ * The acks count as resync data coming in, see got_BlockAck(). */
+static void make_resync_push(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	struct drbd_connection *connection = peer_device->connection;
+	const sector_t capacity = drbd_get_capacity(device->this_bdev);
+	unsigned int max_request_size;
+	int window, number;
+	unsigned long bit, bits, end;
+	sector_t sector;
+	int size;
+
+	if (!get_ldev(device))
+		return;
+
+	if (drbd_rs_c_min_rate_throttle(peer_device)) {
+		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+		put_ldev(device);
+		return;
+	}
+
+	number = drbd_rs_number_requests(peer_device);
+	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
+
+	max_request_size = min3(queue_max_hw_sectors(device->rq_queue) << 9,
+				READ_ONCE(drbd_resync_request_kb) << 10,
+				(unsigned int)DRBD_MAX_BIO_SIZE);
+	/* Keep going if resync_push_kb was set to 0 meanwhile */
+	window = max(READ_ONCE(drbd_resync_push_kb) << 1, max_request_size >> 9);
+
+	while (number > 0 && atomic_read(&connection->rs_in_flight) < window) {
+		bit = drbd_bm_find_next(peer_device, peer_device->resync_next_bit);
+		if (bit == DRBD_END_OF_BITMAP) {
+			peer_device->resync_next_bit = drbd_bm_bits(device);
+			maybe_finish_resync_push(peer_device);
+			break;
+		}
 
-			/* do not cross extent boundaries */
-			if (((bit+1) & BM_BLOCKS_PER_BM_EXT_MASK) == 0)
-				break;
-			/* now, is it actually dirty, after all?
-			 * caution, drbd_bm_test_bit is tri-state for some
-			 * obscure reason; ( b == 0 ) would get the out-of-band
-			 * only accidentally right because of the "oddly sized"
-			 * adjustment below */
-			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
-				break;
-			bit++;
-			size += BM_BLOCK_SIZE;
-			if ((BM_BLOCK_SIZE << align) <= size)
-				align++;
-			i++;
+		sector = BM_BIT_TO_SECT(bit);
+		if (drbd_try_rs_begin_io(peer_device, sector, true)) {
+			peer_device->resync_next_bit = bit;
+			break;
 		}
-		/* set the offset to start the next drbd_bm_find_next from */
-		peer_device->resync_next_bit = bit + 1;
 
-		/* adjust very last sectors, in case we are oddly sized */
+		bits = resync_request_bits(bit, max_request_size, 0, number);
+		end = drbd_bm_range_find_next_zero(peer_device, bit, bit + bits - 1);
+		if (end != DRBD_END_OF_BITMAP)
+			bits = end - bit;
+		if (unlikely(bits == 0)) {
+			peer_device->resync_next_bit = bit + 1;
+			drbd_rs_complete_io(peer_device, sector);
+			continue;
+		}
+		size = bits << BM_BLOCK_SHIFT;
 		if (sector + (size>>9) > capacity)
 			size = (capacity-sector)<<9;
 
-		if (peer_device->use_csums) {
-			switch (read_for_csum(peer_device, sector, size)) {
-			case -EIO: /* Disk failure */
-				put_ldev(device);
-				return -EIO;
-			case -EAGAIN: /* allocation failed, or ldev busy */
-				drbd_rs_complete_io(peer_device, sector);
-				peer_device->resync_next_bit = BM_SECT_TO_BIT(sector);
-				i = rollback_i;
-				goto request_done;
-			case 0:
-				/* everything ok */
-				break;
-			default:
-				BUG();
-			}
-		} else {
-			int err;
-
-			inc_rs_pending(peer_device);
-			err = drbd_send_drequest(peer_device,
-						 size == discard_granularity ? P_RS_THIN_REQ : P_RS_DATA_REQUEST,
-						 sector, size, ID_SYNCER);
-			if (err) {
-				drbd_err(device, "drbd_send_drequest() failed, aborting...\n");
-				dec_rs_pending(peer_device);
-				put_ldev(device);
-				return err;
-			}
+		atomic_add(size >> 9, &connection->rs_in_flight);
+		if (read_for_resync(peer_device, sector, size, w_e_end_rs_push)) {
+			atomic_sub(size >> 9, &connection->rs_in_flight);
+			drbd_rs_complete_io(peer_device, sector);
+			peer_device->resync_next_bit = bit;
+			break;
 		}
+		peer_device->rs_push_reads++;
+		peer_device->resync_next_bit = bit + bits;
+		number -= bits;
 	}
 
-request_done:
-	/* ... but do a correction, in case we had to break/goto request_done; */
-	peer_device->rs_in_flight -= (number - i) * BM_SECT_PER_BIT;
-
-	if (peer_device->resync_next_bit >= drbd_bm_bits(device)) {
-		/* last syncer _request_ was sent,
-		 * but the P_RS_DATA_REPLY not yet received.  sync will end (and
-		 * next sync group will resume), as soon as we receive the last
-		 * resync data block, and the last bit is cleared.
-		 * until then resync "work" is "inactive" ...
-		 */
-		put_ldev(device);
-		return 0;
-	}
+	/* Correction for what we did not read in this step */
+	peer_device->rs_in_flight -= number * BM_SECT_PER_BIT;
 
-	/* and in case that raced with the receiver, reschedule ourselves right now */
-	if (i > 0 && atomic_read(&peer_device->rs_sect_in) >= peer_device->rs_in_flight)
-		drbd_queue_work_if_unqueued(
-			&peer_device->connection->sender_work,
-			&peer_device->resync_work);
-	else
+	if (test_bit(RS_PUSH, &peer_device->flags))
 		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
 	put_ldev(device);
-	return 0;
+}
+
+/* Size of the next P_OV_REQUEST. With hierarchical verify, requests cover
+ * naturally aligned ranges of up to verify_tree_kb, which therefore never
+ * cross a resync extent. */
+static unsigned int ov_request_size(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	unsigned int size = min_t(unsigned int, READ_ONCE(drbd_verify_tree_kb),
+				  DRBD_MAX_BIO_SIZE >> 10) << 10;
+
+	if (size <= BM_BLOCK_SIZE ||
+	    !(peer_device->connection->agreed_features & DRBD_FF_OV_TREE))
+		return BM_BLOCK_SIZE;
+
+	size = rounddown_pow_of_two(size);
+	return size - ((sector << 9) & (size - 1));
 }
 
 static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	struct drbd_device *device = peer_device->device;
-	int number, i, size;
+	int number, i, size, budget;
 	sector_t sector;
 	const sector_t capacity = drbd_get_capacity(device->this_bdev);
 	bool stop_sector_reached = false;
@@ -861,8 +1644,9 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
-	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
-	for (i = 0; i < number; i++) {
+	budget = number * BM_SECT_PER_BIT;
+	peer_device->rs_in_flight += budget;
+	for (i = 0; budget > 0; i++) {
 		if (sector >= capacity)
 			break;
 
@@ -874,7 +1658,7 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 		if (stop_sector_reached)
 			break;
 
-		size = BM_BLOCK_SIZE;
+		size = ov_request_size(peer_device, sector);
 
 		if (drbd_try_rs_begin_io(peer_device, sector, true))
 			break;
@@ -887,10 +1671,11 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 			dec_rs_pending(peer_device);
 			return 0;
 		}
-		sector += BM_SECT_PER_BIT;
+		sector += size >> 9;
+		budget -= size >> 9;
 	}
 	/* ... but do a correction, in case we had to break; ... */
-	peer_device->rs_in_flight -= (number-i) * BM_SECT_PER_BIT;
+	peer_device->rs_in_flight -= budget;
 	peer_device->ov_position = sector;
 	if (stop_sector_reached)
 		return 1;
@@ -1267,6 +2052,7 @@ static void move_to_net_ee_or_free(struct drbd_connection *connection, struct dr
 		spin_lock_irq(&connection->peer_reqs_lock);
 		list_add_tail(&peer_req->w.list, &peer_req->peer_device->connection->net_ee);
 		spin_unlock_irq(&connection->peer_reqs_lock);
+		wake_up(&connection->pp_wait);
 		wake_up(&drbd_pp_wait);
 	} else
 		drbd_free_peer_req(peer_req);
@@ -1308,30 +2094,166 @@ int w_e_end_data_req(struct drbd_work *w, int cancel)
 	return err;
 }
 
-static bool all_zero(struct drbd_peer_request *peer_req)
+static bool range_all_zero(struct drbd_peer_request *peer_req, unsigned int offset, unsigned int size)
 {
 	struct page *page = peer_req->page_chain.head;
-	unsigned int len = peer_req->i.size;
 
 	page_chain_for_each(page) {
-		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
+		unsigned int l;
+		void *d, *nonzero;
 
-		d = kmap_atomic(page);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				kunmap_atomic(d);
-				return false;
-			}
+		if (offset >= PAGE_SIZE) {
+			offset -= PAGE_SIZE;
+			continue;
 		}
+		l = min_t(unsigned int, size, PAGE_SIZE - offset);
+
+		/* memchr_inv() checks eight bytes at a time */
+		d = kmap_atomic(page);
+		nonzero = memchr_inv(d + offset, 0, l);
 		kunmap_atomic(d);
-		len -= l;
+		if (nonzero)
+			return false;
+		size -= l;
+		if (!size)
+			break;
+		offset = 0;
 	}
 
 	return true;
 }
 
+static bool all_zero(struct drbd_peer_request *peer_req)
+{
+	return range_all_zero(peer_req, 0, peer_req->i.size);
+}
+
+static int flush_rs_push_zeroes(struct drbd_peer_device *peer_device)
+{
+	unsigned int size = peer_device->rs_push_zero_size;
+
+	if (!size)
+		return 0;
+	peer_device->rs_push_zero_size = 0;
+	inc_rs_pending(peer_device);
+	return drbd_send_rs_deallocated(peer_device, peer_device->rs_push_zero_sector, size);
+}
+
+static void drop_rs_push_zeroes(struct drbd_peer_device *peer_device)
+{
+	atomic_sub(peer_device->rs_push_zero_size >> 9, &peer_device->connection->rs_in_flight);
+	peer_device->rs_push_zero_size = 0;
+}
+
+/* Append to the pending run of zeroes, or send that and start a new one.
+ * Runs never cross a resync extent, as the sync target locks only one. */
+static int rs_push_zeroes(struct drbd_peer_device *peer_device, sector_t sector, unsigned int size)
+{
+	sector_t run = peer_device->rs_push_zero_sector;
+	int err;
+
+	if (peer_device->rs_push_zero_size &&
+	    run + (peer_device->rs_push_zero_size >> 9) == sector &&
+	    BM_SECT_TO_EXT(run) == BM_SECT_TO_EXT(sector)) {
+		peer_device->rs_push_zero_size += size;
+		return 0;
+	}
+
+	err = flush_rs_push_zeroes(peer_device);
+	peer_device->rs_push_zero_sector = sector;
+	peer_device->rs_push_zero_size = size;
+	return err;
+}
+
+static bool rs_push_dedup_chunk(struct drbd_connection *connection,
+				struct drbd_peer_request *peer_req, unsigned int offset, u32 *pos)
+{
+	struct page *page = peer_req->page_chain.head;
+	bool dup;
+	void *d;
+
+	page_chain_for_each(page) {
+		if (offset < PAGE_SIZE)
+			break;
+		offset -= PAGE_SIZE;
+	}
+	d = kmap_atomic(page);
+	dup = drbd_dedup_chunk(connection, d + offset, pos);
+	kunmap_atomic(d);
+	return dup;
+}
+
+/* Send the pending run of data chunks, if any */
+static int send_rs_push_run(struct drbd_peer_device *peer_device, struct drbd_peer_request *peer_req,
+			    unsigned int offset, unsigned int *size, bool stored, u32 pos)
+{
+	unsigned int len = *size;
+
+	if (!len)
+		return 0;
+	*size = 0;
+	inc_rs_pending(peer_device);
+	return drbd_send_rs_data_part(peer_device, peer_req, offset, len,
+				      DP_RS_PUSH | (stored ? DP_RS_DEDUP_STORE : 0), pos);
+}
+
+/* Streaming resync of thinly provisioned or sparse devices: the block layer
+ * tells us nothing about what is allocated, but unallocated ranges read as
+ * zeroes. Send the data of a pushed read per BM_BLOCK_SIZE chunk, runs of
+ * zeroes as P_RS_DEALLOCATED, which the sync target discards or zeroes out,
+ * and chunks the sync target got recently as references, see drbd_dedup.c.
+ * Only used while streaming, that is with resync_push_kb set; it is 0 by
+ * default, and full syncs then request their blocks like any other resync. */
+static int send_rs_push_sparse(struct drbd_peer_device *peer_device,
+			       struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	bool thin = connection->agreed_features & DRBD_FF_THIN_RESYNC;
+	bool dedup = drbd_dedup_prepare(connection);
+	unsigned int size = peer_req->i.size;
+	unsigned int offset, len, run = 0, run_len = 0;
+	bool run_stored = false;
+	u32 run_pos = 0, pos;
+	int err = 0;
+
+	for (offset = 0; offset < size && !err; offset += len) {
+		len = min_t(unsigned int, BM_BLOCK_SIZE, size - offset);
+
+		if (thin && range_all_zero(peer_req, offset, len)) {
+			err = send_rs_push_run(peer_device, peer_req, run, &run_len, run_stored, run_pos);
+			if (!err)
+				err = rs_push_zeroes(peer_device, peer_req->i.sector + (offset >> 9), len);
+			continue;
+		}
+
+		if (dedup && len == BM_BLOCK_SIZE) {
+			if (rs_push_dedup_chunk(connection, peer_req, offset, &pos)) {
+				err = send_rs_push_run(peer_device, peer_req, run, &run_len,
+						       run_stored, run_pos);
+				if (!err) {
+					inc_rs_pending(peer_device);
+					err = drbd_send_rs_dedup_ref(peer_device,
+							peer_req->i.sector + (offset >> 9), pos);
+				}
+				continue;
+			}
+			/* Stored; chunks stored one after the other get consecutive numbers */
+			if (!run_len) {
+				run = offset;
+				run_stored = true;
+				run_pos = pos;
+			}
+		} else if (!run_len) {
+			run = offset;
+			run_stored = false;
+		}
+		run_len += len;
+	}
+	if (!err)
+		err = send_rs_push_run(peer_device, peer_req, run, &run_len, run_stored, run_pos);
+	return err;
+}
+
 /**
  * w_e_end_rsdata_req() - Worker callback to send a P_RS_DATA_REPLY packet in response to a P_RS_DATA_REQUEST
  * @w:		work object.
@@ -1368,7 +2290,8 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 			 * TODO: to fix that, we'd need a protocol bump. */
 			atomic_add(peer_req->i.size >> 9, &connection->rs_in_flight);
 			if (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req)) {
-				err = drbd_send_rs_deallocated(peer_device, peer_req);
+				err = drbd_send_rs_deallocated(peer_device, peer_req->i.sector,
+							       peer_req->i.size);
 			} else {
 				err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
 			}
@@ -1398,6 +2321,66 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 	return err;
 }
 
+/* Answer a batched P_CSUM_RS_REQUEST, see send_csum_batch().
+ * Sends the runs of chunks with a different checksum, then the
+ * bitmap of those chunks so that the peer can set the others in sync. */
+static int csum_rs_batch_reply(struct drbd_peer_device *peer_device,
+			       struct drbd_peer_request *peer_req)
+{
+	DECLARE_BITMAP(differ, DRBD_MAX_BIO_SIZE >> BM_BLOCK_SHIFT);
+	struct drbd_connection *connection = peer_device->connection;
+	struct digest_info *di = peer_req->digest;
+	unsigned int size = peer_req->i.size;
+	unsigned int chunks = DIV_ROUND_UP(size, BM_BLOCK_SIZE);
+	unsigned int start, end;
+	int digest_size = 0;
+	void *digest = NULL;
+	int err = 0;
+
+	/* Without a usable checksum, send everything */
+	bitmap_fill(differ, chunks);
+	if (connection->csums_tfm) {
+		digest_size = crypto_shash_digestsize(connection->csums_tfm);
+		digest = kmalloc(digest_size, GFP_NOIO);
+	}
+	if (digest && di->digest_size == chunks * digest_size) {
+		for (start = 0; start < chunks; start++) {
+			peer_req_csum(peer_req, connection->csums_tfm, BM_BLOCK_SIZE, start, digest);
+			if (!memcmp(digest, di->digest + start * digest_size, digest_size))
+				__clear_bit(start, differ);
+		}
+	}
+	kfree(digest);
+
+	peer_req->block_id = ID_SYNCER; /* By setting block_id, digest pointer becomes invalid! */
+	peer_req->flags &= ~EE_HAS_DIGEST; /* This peer request no longer has a digest pointer */
+	kfree(di);
+
+	for (start = 0; start < chunks; start = end) {
+		unsigned int offset = start << BM_BLOCK_SHIFT;
+		unsigned int len;
+
+		if (test_bit(start, differ)) {
+			end = find_next_zero_bit(differ, chunks, start);
+			len = min_t(unsigned int, size, end << BM_BLOCK_SHIFT) - offset;
+			inc_rs_pending(peer_device);
+			atomic_add(len >> 9, &connection->rs_in_flight);
+			err = drbd_send_rs_data_part(peer_device, peer_req, offset, len,
+						     DP_RS_BATCH_PART, 0);
+			if (err)
+				return err;
+		} else {
+			end = find_next_bit(differ, chunks, start);
+			len = min_t(unsigned int, size, end << BM_BLOCK_SHIFT) - offset;
+			drbd_set_in_sync(peer_device, peer_req->i.sector + (offset >> 9), len);
+			/* rs_same_csums unit is BM_BLOCK_SIZE */
+			peer_device->rs_same_csum += end - start;
+		}
+	}
+
+	return drbd_send_rs_batch_done(peer_device, peer_req, differ, chunks);
+}
+
 int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
@@ -1421,7 +2404,9 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 
 	di = peer_req->digest;
 
-	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
+	if (peer_req->flags & EE_CSUM_BATCH && likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
+		err = csum_rs_batch_reply(peer_device, peer_req);
+	} else if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
 		/* quick hack to try to avoid a race against reconfiguration.
 		 * a real fix would be much more involved,
 		 * introducing more locking mechanisms */
@@ -1430,7 +2415,8 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 			D_ASSERT(device, digest_size == di->digest_size);
 			digest = kmalloc(digest_size, GFP_NOIO);
 			if (digest) {
-				drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+				peer_req_csum(peer_req, peer_device->connection->csums_tfm,
+					      peer_req->i.size, 0, digest);
 				eq = !memcmp(digest, di->digest, digest_size);
 				kfree(digest);
 			}
@@ -1483,7 +2469,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	}
 
 	if (!(peer_req->flags & EE_WAS_ERROR))
-		drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+		peer_req_csum(peer_req, peer_device->connection->verify_tfm, peer_req->i.size, 0, digest);
 	else
 		memset(digest, 0, digest_size);
 
@@ -1525,17 +2511,48 @@ void verify_progress(struct drbd_peer_device *peer_device,
 	bool stop_sector_reached =
 		(peer_device->repl_state[NOW] == L_VERIFY_S) &&
 		(sector + (size>>9)) >= peer_device->ov_stop_sector;
+	unsigned long ov_left = peer_device->ov_left;
 
-	--peer_device->ov_left;
+	/* with hierarchical verify, a request may cover many bits */
+	peer_device->ov_left -= min_t(unsigned long, ov_left, DIV_ROUND_UP(size, BM_BLOCK_SIZE));
 
 	/* let's advance progress step marks only for every other megabyte */
-	if ((peer_device->ov_left & 0x1ff) == 0)
+	if ((peer_device->ov_left >> 9) != (ov_left >> 9) || peer_device->ov_left == 0)
 		drbd_advance_rs_marks(peer_device, peer_device->ov_left);
 
 	if (peer_device->ov_left == 0 || stop_sector_reached)
 		drbd_peer_device_post_work(peer_device, RS_DONE);
 }
 
+/* Hierarchical verify: instead of reporting a range whose digests differ
+ * as out of sync, verify its parts. Returns true if it did so.
+ * The caller holds a resync extent reference for the range. */
+static bool ov_tree_descend(struct drbd_peer_device *peer_device, sector_t sector,
+			    unsigned int size)
+{
+	unsigned int offset, part_size;
+
+	if (size <= BM_BLOCK_SIZE ||
+	    !(peer_device->connection->agreed_features & DRBD_FF_OV_TREE))
+		return false;
+
+	part_size = round_up(size / DRBD_OV_TREE_FANOUT, BM_BLOCK_SIZE);
+	for (offset = 0; offset < size; offset += part_size) {
+		sector_t s = sector + (offset >> 9);
+		unsigned int len = min(part_size, size - offset);
+
+		drbd_rs_more_io(peer_device, s);
+		inc_rs_pending(peer_device);
+		peer_device->rs_in_flight += len >> 9;
+		if (drbd_send_ov_request(peer_device, s, len)) {
+			dec_rs_pending(peer_device);
+			drbd_rs_complete_io(peer_device, s);
+			break;
+		}
+	}
+	return true;
+}
+
 int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
@@ -1545,6 +2562,7 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	void *digest;
 	sector_t sector = peer_req->i.sector;
 	unsigned int size = peer_req->i.size;
+	bool may_descend, descend = false;
 	int digest_size;
 	int err, eq = 0;
 
@@ -1554,20 +2572,15 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 		return 0;
 	}
 
-	/* after "cancel", because after drbd_disconnect/drbd_rs_cancel_all
-	 * the resync lru has been cleaned up already */
-	if (get_ldev(device)) {
-		drbd_rs_complete_io(peer_device, peer_req->i.sector);
-		put_ldev(device);
-	}
-
 	di = peer_req->digest;
+	may_descend = !(peer_req->flags & EE_WAS_ERROR);
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
 		digest_size = crypto_shash_digestsize(peer_device->connection->verify_tfm);
 		digest = kmalloc(digest_size, GFP_NOIO);
 		if (digest) {
-			drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+			peer_req_csum(peer_req, peer_device->connection->verify_tfm,
+				      peer_req->i.size, 0, digest);
 
 			D_ASSERT(device, digest_size == di->digest_size);
 			eq = !memcmp(digest, di->digest, digest_size);
@@ -1581,17 +2594,28 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	 * congestion as well, because our receiver blocks in
 	 * drbd_alloc_pages due to pp_in_use > max_buffers. */
 	drbd_free_peer_req(peer_req);
-	if (!eq)
-		drbd_ov_out_of_sync_found(peer_device, sector, size);
-	else
+
+	/* after "cancel", because after drbd_disconnect/drbd_rs_cancel_all
+	 * the resync lru has been cleaned up already */
+	if (get_ldev(device)) {
+		if (!eq && may_descend)
+			descend = ov_tree_descend(peer_device, sector, size);
+		drbd_rs_complete_io(peer_device, sector);
+		put_ldev(device);
+	}
+
+	if (eq)
 		ov_out_of_sync_print(peer_device);
+	else if (!descend)
+		drbd_ov_out_of_sync_found(peer_device, sector, size);
 
 	err = drbd_send_ack_ex(peer_device, P_OV_RESULT, sector, size,
-			       eq ? ID_IN_SYNC : ID_OUT_OF_SYNC);
+			       eq ? ID_IN_SYNC : descend ? ID_OV_DESCEND : ID_OUT_OF_SYNC);
 
 	dec_unacked(peer_device);
 
-	verify_progress(peer_device, sector, size);
+	if (!descend)
+		verify_progress(peer_device, sector, size);
 
 	return err;
 }
@@ -1843,6 +2867,11 @@ void drbd_rs_controller_reset(struct drbd_peer_device *peer_device)
 	atomic_set(&peer_device->device->rs_sect_ev, 0);  /* FIXME: ??? */
 	peer_device->rs_last_mk_req_kt = ktime_get();
 	peer_device->rs_in_flight = 0;
+	peer_device->rs_lat_rate = 0;
+	peer_device->rs_lat_base_ns = 0;
+	peer_device->rs_lat_k = 0;
+	peer_device->rs_lat_ns_seen = atomic64_read(&peer_device->device->app_lat_ns);
+	peer_device->rs_lat_cnt_seen = atomic_read(&peer_device->device->app_lat_cnt);
 	peer_device->rs_last_events =
 		drbd_backing_bdev_events(peer_device->device);
 
@@ -1967,6 +2996,15 @@ static bool use_checksum_based_resync(struct drbd_connection *connection, struct
 		 || test_bit(CRASHED_PRIMARY, &device->flags));	/* or only after Primary crash? */
 }
 
+/* Streaming pays off when most of the device needs to be resynced, as with
+ * a full sync; scattered blocks are better requested one by one. */
+static bool use_resync_push(struct drbd_peer_device *peer_device)
+{
+	return READ_ONCE(drbd_resync_push_kb) &&
+		peer_device->connection->agreed_features & DRBD_FF_RS_PUSH &&
+		peer_device->rs_total >= drbd_bm_bits(peer_device->device) / 2;
+}
+
 /**
  * drbd_start_resync() - Start the resync process
  * @side:	Either L_SYNC_SOURCE or L_SYNC_TARGET
@@ -1974,6 +3012,36 @@ static bool use_checksum_based_resync(struct drbd_connection *connection, struct
  * This function might bring you directly into one of the
  * C_PAUSED_SYNC_* states.
  */
+/* Start over with the shared cursor of resync_multi_source, unless another
+ * sync target of the device still takes extents from it */
+static void start_resync_claim(struct drbd_peer_device *peer_device)
+{
+	struct drbd_device *device = peer_device->device;
+	struct drbd_peer_device *p;
+	bool claiming = false;
+
+	WRITE_ONCE(peer_device->rs_claim_end, 0);
+	peer_device->rs_skipped_cnt = 0;
+	if (!READ_ONCE(drbd_resync_multi_source)) {
+		WRITE_ONCE(peer_device->rs_claim, false);
+		return;
+	}
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(p, device) {
+		enum drbd_repl_state r = p->repl_state[NOW];
+
+		if (p != peer_device && READ_ONCE(p->rs_claim) &&
+		    (r == L_SYNC_TARGET || r == L_PAUSED_SYNC_T))
+			claiming = true;
+	}
+	rcu_read_unlock();
+
+	if (!claiming)
+		atomic_set(&device->rs_claim_ext, 0);
+	WRITE_ONCE(peer_device->rs_claim, true);
+}
+
 void drbd_start_resync(struct drbd_peer_device *peer_device, enum drbd_repl_state side)
 {
 	struct drbd_device *device = peer_device->device;
@@ -2081,11 +3149,21 @@ skip_helper:
 		     drbd_repl_str(repl_state),
 		     (unsigned long) peer_device->rs_total << (BM_BLOCK_SHIFT-10),
 		     (unsigned long) peer_device->rs_total);
+		clear_bit(RS_PUSH, &peer_device->flags);
+		clear_bit(RS_PUSH_REQUESTED, &peer_device->flags);
+		peer_device->rs_push_zero_size = 0;
 		if (side == L_SYNC_TARGET) {
 			peer_device->resync_next_bit = 0;
+			reset_rs_priority(peer_device);
+			start_resync_claim(peer_device);
 			peer_device->use_csums = use_checksum_based_resync(connection, device);
+			/* Streaming covers the whole bitmap, it does not go with claiming */
+			peer_device->use_push = !peer_device->use_csums && !peer_device->rs_claim &&
+				use_resync_push(peer_device);
 		} else {
+			WRITE_ONCE(peer_device->rs_claim, false);
 			peer_device->use_csums = false;
+			peer_device->use_push = false;
 		}
 
 		if ((side == L_SYNC_TARGET || side == L_PAUSED_SYNC_T) &&
@@ -2532,6 +3610,101 @@ restart:
 	return req_oldest;
 }
 
+/* Complete protocol A writes which have been sent zero-copy,
+ * once the transport no longer references their pages.
+ *
+ * Data handed over to the transport is no longer referenced once the peer
+ * acknowledged it.  Anything of what we handed over that the transport does
+ * not report as unacknowledged has been acknowledged.  Other contexts may
+ * concurrently send on the DATA_STREAM, but they account bytes_handed only
+ * after the transport took them, so we may only underestimate.
+ */
+static u64 zc_bytes_acked(struct drbd_connection *connection)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_transport_stats stats = {};
+	u64 acked;
+
+	acked = atomic64_read(&connection->send.bytes_handed);
+	transport->ops->stats(transport, &stats);
+	return acked - min_t(u64, acked, stats.unacked_send);
+}
+
+/* Whether drbd_zc_send_done() has something to complete */
+static bool zc_send_done_pending(struct drbd_connection *connection)
+{
+	unsigned int i = connection->send.zc_head % DRBD_ZC_MARKS;
+
+	return connection->send.zc_head != connection->send.zc_tail &&
+		connection->send.zc_mark[i].bytes_handed <= zc_bytes_acked(connection);
+}
+
+/* Returns whether it completed some requests. The transport wakes the
+ * sender through drbd_transport_send_done() when there may be more. */
+bool drbd_zc_send_done(struct drbd_connection *connection)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_request *req;
+	u64 acked, dagtag_sector = 0;
+	bool found = false;
+
+	if (connection->send.zc_head == connection->send.zc_tail)
+		return false;
+
+	acked = zc_bytes_acked(connection);
+	while (connection->send.zc_head != connection->send.zc_tail) {
+		unsigned int i = connection->send.zc_head % DRBD_ZC_MARKS;
+
+		if (connection->send.zc_mark[i].bytes_handed > acked)
+			break;
+		dagtag_sector = connection->send.zc_mark[i].dagtag_sector;
+		connection->send.zc_head++;
+		found = true;
+	}
+
+	if (connection->send.zc_head != connection->send.zc_tail) {
+		/* The transport calls back once, then needs to be asked again */
+		mutex_lock(&connection->mutex[DATA_STREAM]);
+		if (transport->ops->stream_ok(transport, DATA_STREAM))
+			transport->ops->hint(transport, DATA_STREAM, NOSPACE);
+		mutex_unlock(&connection->mutex[DATA_STREAM]);
+	}
+	if (!found)
+		return false;
+
+	rcu_read_lock();
+restart:
+	/* mod_rq_state() advances req_ack_pending */
+	req = READ_ONCE(connection->req_ack_pending);
+	for (; req; req = list_next_or_null_rcu(&connection->resource->transfer_log,
+				&req->tl_requests, struct drbd_request, tl_requests)) {
+		struct drbd_device *device = req->device;
+		struct drbd_peer_device *peer_device = conn_peer_device(connection, device->vnr);
+		const unsigned mask = RQ_NET_SENT | RQ_NET_PENDING | RQ_EXP_SEND_DONE;
+		struct bio_and_error m;
+
+		if (!drbd_req_is_write(req))
+			continue;
+		if (dagtag_newer(req->dagtag_sector, dagtag_sector))
+			break;
+		if ((req->net_rq_state[peer_device->node_id] & mask) != mask)
+			continue;
+
+		read_lock_irq(&connection->resource->state_rwlock);
+		__req_mod(req, ZC_SEND_DONE, peer_device, &m);
+		read_unlock_irq(&connection->resource->state_rwlock);
+
+		if (m.bio) {
+			rcu_read_unlock();
+			complete_master_bio(device, &m);
+			rcu_read_lock();
+		}
+		goto restart;
+	}
+	rcu_read_unlock();
+	return true;
+}
+
 static struct drbd_request *tl_next_request_for_connection(struct drbd_connection *connection)
 {
 	if (connection->todo.req_next == TL_NEXT_REQUEST_RESEND)
@@ -2664,6 +3837,18 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 		if (get_t_state(&connection->sender) != RUNNING)
 			break;
 
+		/* The transport wakes us once it is done with zero-copy
+		 * protocol A writes, see drbd_transport_send_done() */
+		if (connection->send.zc_head != connection->send.zc_tail) {
+			finish_wait(&connection->sender_work.q_wait, &wait);
+			if (drbd_zc_send_done(connection))
+				continue;
+			prepare_to_wait(&connection->sender_work.q_wait, &wait,
+					TASK_INTERRUPTIBLE);
+			if (zc_send_done_pending(connection) || check_sender_todo(connection))
+				continue;
+		}
+
 		schedule();
 		/* may be woken up for other things but new work, too,
 		 * e.g. if the current epoch got closed.
@@ -2853,6 +4038,8 @@ static int process_one_request(struct drbd_connection *connection)
 	if (m.bio)
 		complete_master_bio(device, &m);
 
+	drbd_zc_send_done(connection);
+
 	do_send_unplug = do_send_unplug && what == HANDED_OVER_TO_NETWORK;
 	maybe_send_unplug_remote(connection, do_send_unplug);
 
@@ -2921,6 +4108,10 @@ int drbd_sender(struct drbd_thread *thi)
 	}
 	rcu_read_unlock();
 
+	/* a restarted sender talks to a new transport stream */
+	atomic64_set(&connection->send.bytes_handed, 0);
+	connection->send.zc_head = connection->send.zc_tail = 0;
+
 	while (get_t_state(thi) == RUNNING) {
 		drbd_thread_current_set_cpu(thi);
 
@@ -78,6 +78,7 @@ static int w_after_state_change(struct drbd_work *w, int unused);
 static enum drbd_state_rv is_valid_soft_transition(struct drbd_resource *);
 static enum drbd_state_rv is_valid_transition(struct drbd_resource *resource);
 static void sanitize_state(struct drbd_resource *resource);
+static bool is_sync_target_other_c(struct drbd_peer_device *ign_peer_device);
 
 /* We need to stay consistent if we are neighbor of a diskless primary with
    different UUID. This function should be used if the device was D_UP_TO_DATE
@@ -1031,6 +1032,17 @@ static void set_resync_susp_other_c(struct drbd_peer_device *peer_device, bool v
 				continue;
 
 			r = p->repl_state[NEW];
+			/* With resync_multi_source, only the resyncs we would be
+			   source of wait until we are up to date. Other up to date
+			   peers join in as sync sources right away. */
+			if (READ_ONCE(drbd_resync_multi_source) &&
+			    r != L_SYNC_SOURCE && r != L_PAUSED_SYNC_S) {
+				if (start && r == L_ESTABLISHED && p->disk_state[NEW] == D_UP_TO_DATE)
+					p->repl_state[NEW] = resync_suspended(p, NEW) ?
+						L_PAUSED_SYNC_T : L_SYNC_TARGET;
+				continue;
+			}
+
 			p->resync_susp_other_c[NEW] = true;
 
 			if (start && p->disk_state[NEW] >= D_INCONSISTENT && r == L_ESTABLISHED)
@@ -1055,6 +1067,10 @@ static void set_resync_susp_other_c(struct drbd_peer_device *peer_device, bool v
 			}
 		}
 
+		/* With resync_multi_source, we might still be sync target of others */
+		if (READ_ONCE(drbd_resync_multi_source) && is_sync_target_other_c(peer_device))
+			return;
+
 		for_each_peer_device(p, device) {
 			if (p == peer_device)
 				continue;
@@ -2310,10 +2326,39 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 						  -(long)peer_device->rs_mark_time[peer_device->rs_last_mark];
 				initialize_resync_progress_marks(peer_device);
 				peer_device->resync_next_bit = 0;
-				if (repl_state[NEW] == L_SYNC_TARGET)
+				peer_device->rs_claim_end = 0;
+				peer_device->rs_skipped_cnt = 0;
+				peer_device->rs_prio_end = 0;
+				/* Streaming resync starts over, on request of the sync target */
+				clear_bit(RS_PUSH_REQUESTED, &peer_device->flags);
+				if (repl_state[NEW] == L_SYNC_TARGET ||
+				    test_bit(RS_PUSH, &peer_device->flags))
 					mod_timer(&peer_device->resync_timer, jiffies);
 			}
 
+			/* Joins the resync from another peer, see set_resync_susp_other_c() */
+			if (repl_state[OLD] == L_ESTABLISHED && repl_state[NEW] == L_SYNC_TARGET) {
+				peer_device->resync_next_bit = 0;
+				peer_device->rs_claim_end = 0;
+				peer_device->rs_skipped_cnt = 0;
+				peer_device->rs_prio_end = 0;
+				peer_device->rs_claim = true;
+				peer_device->use_csums = false;
+				peer_device->use_push = false;
+				mod_timer(&peer_device->resync_timer, jiffies);
+			}
+
+			/* Other sync targets may have left its extent to it */
+			if (repl_state[OLD] == L_SYNC_TARGET && repl_state[NEW] != L_SYNC_TARGET &&
+			    READ_ONCE(drbd_resync_multi_source)) {
+				struct drbd_peer_device *p;
+
+				for_each_peer_device(p, device) {
+					if (p != peer_device && p->repl_state[NEW] == L_SYNC_TARGET)
+						mod_timer(&p->resync_timer, jiffies);
+				}
+			}
+
 			if ((repl_state[OLD] == L_SYNC_TARGET  || repl_state[OLD] == L_SYNC_SOURCE) &&
 			    (repl_state[NEW] == L_PAUSED_SYNC_T || repl_state[NEW] == L_PAUSED_SYNC_S)) {
 				drbd_info(peer_device, "Resync suspended\n");
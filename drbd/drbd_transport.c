@@ -317,6 +317,17 @@ void drbd_path_event(struct drbd_transport *transport, struct drbd_path *path)
 	notify_path(connection, path, NOTIFY_CHANGE);
 }
 
+/* Called by a transport when the peer acknowledged data of the DATA_STREAM,
+ * possibly in softirq context. Wakes the sender for drbd_zc_send_done(). */
+void drbd_transport_send_done(struct drbd_transport *transport)
+{
+	struct drbd_connection *connection =
+		container_of(transport, struct drbd_connection, transport);
+
+	if (READ_ONCE(connection->send.zc_head) != READ_ONCE(connection->send.zc_tail))
+		wake_up(&connection->sender_work.q_wait);
+}
+
 /* Network transport abstractions */
 EXPORT_SYMBOL_GPL(drbd_register_transport_class);
 EXPORT_SYMBOL_GPL(drbd_unregister_transport_class);
@@ -326,3 +337,4 @@ EXPORT_SYMBOL_GPL(drbd_find_path_by_addr);
 EXPORT_SYMBOL_GPL(drbd_stream_send_timed_out);
 EXPORT_SYMBOL_GPL(drbd_should_abort_listening);
 EXPORT_SYMBOL_GPL(drbd_path_event);
+EXPORT_SYMBOL_GPL(drbd_transport_send_done);
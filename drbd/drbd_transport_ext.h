@@ -0,0 +1,13 @@
+#ifndef DRBD_TRANSPORT_EXT_H
+#define DRBD_TRANSPORT_EXT_H
+
+/* Transport to core callbacks not (yet) in drbd-headers/drbd_transport.h.
+ * They belong next to drbd_stream_send_timed_out() and drbd_path_event()
+ * there; move them over with the next update of drbd-headers. */
+
+struct drbd_transport;
+
+/* drbd_transport.c */
+extern void drbd_transport_send_done(struct drbd_transport *transport);
+
+#endif
@@ -0,0 +1,987 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_loop.c
+
+   This file is part of DRBD.
+
+   In-memory loopback transport. It connects two DRBD connections within
+   the same kernel, without any sockets. Pages handed to send_page() are
+   referenced and queued, the receiving side copies out of them.
+
+   Two connections pair up if the first path of one has as my_addr the
+   peer_addr of the other, and vice versa. Use it to benchmark the
+   request, activity log, sender and receiver pipelines isolated from
+   the network stack, e.g. with two resources on one machine.
+
+   It can also emulate a WAN link, to benchmark congestion handling and
+   the resync controller deterministically. The knobs live in
+   <debugfs>/drbd_transport_loop/ and apply to chunks sent after they
+   are changed. All of them default to 0, which disables that part:
+
+   delay_us               one way latency
+   jitter_us              additional random latency, up to this much
+   rate_kib               bandwidth per stream and direction, in KiB/s
+   loss_permille          chunks "lost", these arrive loss_delay_ms late,
+   loss_delay_ms            as with a TCP retransmit
+   reorder_permille       control stream chunks held back reorder_us, so
+   reorder_us               that they arrive after later data stream chunks
+   stall_period_ms        the link delivers nothing for stall_ms at the
+   stall_ms                 beginning of each stall_period_ms
+   seed                   for the random numbers, taken at connect time
+
+   Each stream stays a byte stream, chunks of one stream are never
+   delivered out of order. The receiver polls for chunks that become due
+   with jiffies granularity.
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/sched/signal.h>
+#include <linux/highmem.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <net/ipv6.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_protocol.h>
+#include <drbd_transport.h>
+#include <drbd_transport_ext.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("Philipp Reisner <philipp.reisner@linbit.com>");
+MODULE_AUTHOR("Lars Ellenberg <lars.ellenberg@linbit.com>");
+MODULE_DESCRIPTION("In-memory loopback transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* used if sndbuf-size is not configured */
+#define DTL_DEFAULT_SNDBUF (4 << 20)
+
+/* A piece of a page that was handed to send_page() */
+struct dtl_chunk {
+	struct list_head list;
+	struct page *page;
+	unsigned int offset;
+	unsigned int size;
+	ktime_t due;		/* not visible to the receiver before */
+};
+
+/* One direction of one stream */
+struct dtl_pipe {
+	spinlock_t lock;
+	wait_queue_head_t wait;	/* woken on new data, consumed data, close */
+	struct list_head chunks;
+	unsigned int queued;	/* bytes in chunks */
+	bool closed;
+	struct drbd_transport *sender; /* DATA_STREAM, see drbd_transport_send_done() */
+
+	/* WAN emulation */
+	ktime_t wire_free;	/* the last chunk is "on the wire" until */
+	ktime_t last_due;
+	u32 random_state;
+
+	/* statistics, for debugfs */
+	u64 bytes;
+	u64 chunks_total;
+	u64 lost;
+	u64 reordered;
+	u64 stalled;
+};
+
+/* Shared by both ends; side 0 sends through pipe[0][stream] and
+ * receives from pipe[1][stream], side 1 the other way round. */
+struct dtl_link {
+	struct kref kref;
+	struct dtl_pipe pipe[2][2];
+};
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct drbd_loop_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	struct buffer rbuf[2];
+
+	spinlock_t link_lock; /* protects link */
+	struct dtl_link *link;
+	int side;
+	struct drbd_path *path; /* the established one */
+
+	struct drbd_path *connect_path; /* while on dtl_waiters */
+	struct list_head waiters_list;
+	wait_queue_head_t connect_wait;
+
+	long rcvtimeo[2];
+	long sndtimeo;
+	unsigned int sndbuf_size;
+};
+
+static int dtl_init(struct drbd_transport *transport);
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtl_connect(struct drbd_transport *transport);
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtl_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtl_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtl_remove_path(struct drbd_transport *, struct drbd_path *);
+static void dtl_update_congested(struct dtl_pipe *pipe);
+
+static struct drbd_transport_class loop_transport_class = {
+	.name = "loop",
+	.instance_size = sizeof(struct drbd_loop_transport),
+	.path_instance_size = sizeof(struct drbd_path),
+	.module = THIS_MODULE,
+	.init = dtl_init,
+	.list = LIST_HEAD_INIT(loop_transport_class.list),
+};
+
+static struct drbd_transport_ops dtl_ops = {
+	.free = dtl_free,
+	.connect = dtl_connect,
+	.recv = dtl_recv,
+	.recv_pages = dtl_recv_pages,
+	.stats = dtl_stats,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.get_rcvtimeo = dtl_get_rcvtimeo,
+	.send_page = dtl_send_page,
+	.send_zc_bio = dtl_send_zc_bio,
+	.stream_ok = dtl_stream_ok,
+	.hint = dtl_hint,
+	.debugfs_show = dtl_debugfs_show,
+	.add_path = dtl_add_path,
+	.remove_path = dtl_remove_path,
+};
+
+static struct {
+	u32 delay_us;
+	u32 jitter_us;
+	u32 rate_kib;
+	u32 loss_permille;
+	u32 loss_delay_ms;
+	u32 reorder_permille;
+	u32 reorder_us;
+	u32 stall_period_ms;
+	u32 stall_ms;
+	u32 seed;
+} dtl_emu;
+
+static struct dentry *dtl_debugfs_root;
+
+/* loop transports waiting in dtl_connect() for their peer */
+static LIST_HEAD(dtl_waiters);
+static DEFINE_MUTEX(dtl_waiters_mutex);
+
+static int dtl_init(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		loop_transport->rbuf[i].base = buffer;
+		loop_transport->rbuf[i].pos = buffer;
+	}
+
+	spin_lock_init(&loop_transport->paths_lock);
+	spin_lock_init(&loop_transport->link_lock);
+	INIT_LIST_HEAD(&loop_transport->waiters_list);
+	init_waitqueue_head(&loop_transport->connect_wait);
+	loop_transport->rcvtimeo[DATA_STREAM] = MAX_SCHEDULE_TIMEOUT;
+	loop_transport->rcvtimeo[CONTROL_STREAM] = MAX_SCHEDULE_TIMEOUT;
+	loop_transport->sndtimeo = MAX_SCHEDULE_TIMEOUT;
+	loop_transport->transport.ops = &dtl_ops;
+	loop_transport->transport.class = &loop_transport_class;
+
+	return 0;
+fail:
+	free_page((unsigned long)loop_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static struct dtl_link *dtl_alloc_link(void)
+{
+	struct dtl_link *link;
+	int i, s;
+
+	link = kzalloc(sizeof(*link), GFP_KERNEL);
+	if (!link)
+		return NULL;
+
+	kref_init(&link->kref);
+	for (i = 0; i < 2; i++) {
+		for (s = DATA_STREAM; s <= CONTROL_STREAM; s++) {
+			struct dtl_pipe *pipe = &link->pipe[i][s];
+
+			spin_lock_init(&pipe->lock);
+			init_waitqueue_head(&pipe->wait);
+			INIT_LIST_HEAD(&pipe->chunks);
+			pipe->random_state = READ_ONCE(dtl_emu.seed) + i * 2 + s;
+		}
+	}
+
+	return link;
+}
+
+static void dtl_free_chunk(struct dtl_chunk *chunk)
+{
+	put_page(chunk->page);
+	kfree(chunk);
+}
+
+static void dtl_destroy_link(struct kref *kref)
+{
+	struct dtl_link *link = container_of(kref, struct dtl_link, kref);
+	struct dtl_chunk *chunk, *tmp;
+	int i, s;
+
+	for (i = 0; i < 2; i++) {
+		for (s = DATA_STREAM; s <= CONTROL_STREAM; s++) {
+			list_for_each_entry_safe(chunk, tmp, &link->pipe[i][s].chunks, list)
+				dtl_free_chunk(chunk);
+		}
+	}
+	kfree(link);
+}
+
+static struct dtl_link *dtl_get_link(struct drbd_loop_transport *loop_transport)
+{
+	struct dtl_link *link;
+
+	spin_lock(&loop_transport->link_lock);
+	link = loop_transport->link;
+	if (link)
+		kref_get(&link->kref);
+	spin_unlock(&loop_transport->link_lock);
+
+	return link;
+}
+
+static void dtl_put_link(struct dtl_link *link)
+{
+	kref_put(&link->kref, dtl_destroy_link);
+}
+
+static struct dtl_pipe *dtl_tx_pipe(struct drbd_loop_transport *loop_transport,
+				    struct dtl_link *link, enum drbd_stream stream)
+{
+	return &link->pipe[loop_transport->side][stream];
+}
+
+static struct dtl_pipe *dtl_rx_pipe(struct drbd_loop_transport *loop_transport,
+				    struct dtl_link *link, enum drbd_stream stream)
+{
+	return &link->pipe[!loop_transport->side][stream];
+}
+
+static void dtl_close_link(struct dtl_link *link)
+{
+	int i, s;
+
+	for (i = 0; i < 2; i++) {
+		for (s = DATA_STREAM; s <= CONTROL_STREAM; s++) {
+			struct dtl_pipe *pipe = &link->pipe[i][s];
+
+			spin_lock_bh(&pipe->lock);
+			pipe->closed = true;
+			if (pipe->sender)
+				clear_bit(NET_CONGESTED, &pipe->sender->flags);
+			pipe->sender = NULL;
+			spin_unlock_bh(&pipe->lock);
+			wake_up_all(&pipe->wait);
+		}
+	}
+}
+
+static void dtl_leave_waiters(struct drbd_loop_transport *loop_transport)
+{
+	struct drbd_path *path = NULL;
+
+	mutex_lock(&dtl_waiters_mutex);
+	if (!list_empty(&loop_transport->waiters_list)) {
+		list_del_init(&loop_transport->waiters_list);
+		path = loop_transport->connect_path;
+		loop_transport->connect_path = NULL;
+	}
+	mutex_unlock(&dtl_waiters_mutex);
+
+	if (path)
+		kref_put(&path->kref, drbd_destroy_path);
+}
+
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct drbd_path *drbd_path, *tmp;
+	struct dtl_link *link;
+
+	dtl_leave_waiters(loop_transport);
+
+	spin_lock(&loop_transport->link_lock);
+	link = loop_transport->link;
+	loop_transport->link = NULL;
+	spin_unlock(&loop_transport->link_lock);
+
+	if (link) {
+		dtl_close_link(link);
+		dtl_put_link(link);
+	}
+
+	drbd_path = xchg(&loop_transport->path, NULL);
+	if (drbd_path) {
+		drbd_path->established = false;
+		drbd_path_event(transport, drbd_path);
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+	}
+
+	spin_lock(&loop_transport->paths_lock);
+	if (free_op == DESTROY_TRANSPORT) {
+		enum drbd_stream i;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)loop_transport->rbuf[i].base);
+			loop_transport->rbuf[i].base = NULL;
+		}
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+	}
+	spin_unlock(&loop_transport->paths_lock);
+}
+
+static bool dtl_addr_equal(const struct sockaddr_storage *addr1, int len1,
+			   const struct sockaddr_storage *addr2, int len2)
+{
+	if (addr1->ss_family != addr2->ss_family)
+		return false;
+
+	if (addr1->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *v6a1 = (const struct sockaddr_in6 *)addr1;
+		const struct sockaddr_in6 *v6a2 = (const struct sockaddr_in6 *)addr2;
+
+		return ipv6_addr_equal(&v6a1->sin6_addr, &v6a2->sin6_addr) &&
+			v6a1->sin6_port == v6a2->sin6_port;
+	} else if (addr1->ss_family == AF_INET) {
+		const struct sockaddr_in *v4a1 = (const struct sockaddr_in *)addr1;
+		const struct sockaddr_in *v4a2 = (const struct sockaddr_in *)addr2;
+
+		return v4a1->sin_addr.s_addr == v4a2->sin_addr.s_addr &&
+			v4a1->sin_port == v4a2->sin_port;
+	}
+
+	return len1 == len2 && !memcmp(addr1, addr2, len1);
+}
+
+static bool dtl_paths_match(struct drbd_path *a, struct drbd_path *b)
+{
+	return dtl_addr_equal(&a->my_addr, a->my_addr_len, &b->peer_addr, b->peer_addr_len) &&
+		dtl_addr_equal(&a->peer_addr, a->peer_addr_len, &b->my_addr, b->my_addr_len);
+}
+
+static int dtl_connect(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct drbd_loop_transport *peer = NULL, *waiter;
+	struct drbd_path *drbd_path;
+	struct dtl_link *link;
+	struct net_conf *nc;
+	int connect_int;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	connect_int = nc->connect_int;
+	loop_transport->sndtimeo = nc->timeout * HZ / 10;
+	loop_transport->sndbuf_size = nc->sndbuf_size ?: DTL_DEFAULT_SNDBUF;
+	rcu_read_unlock();
+
+	spin_lock(&loop_transport->paths_lock);
+	drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&loop_transport->paths_lock);
+	if (!drbd_path)
+		return -EDESTADDRREQ;
+
+	link = dtl_alloc_link();
+	if (!link) {
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&dtl_waiters_mutex);
+	list_for_each_entry(waiter, &dtl_waiters, waiters_list) {
+		if (dtl_paths_match(waiter->connect_path, drbd_path)) {
+			peer = waiter;
+			break;
+		}
+	}
+	if (peer) {
+		struct drbd_path *peer_path = peer->connect_path;
+
+		list_del_init(&peer->waiters_list);
+		peer->connect_path = NULL;
+
+		/* The waiting side takes the role of the TCP side that
+		 * accepted the control stream */
+		link->pipe[0][DATA_STREAM].sender = transport;
+		link->pipe[1][DATA_STREAM].sender = &peer->transport;
+		kref_get(&link->kref);
+		spin_lock(&peer->link_lock);
+		peer->link = link;
+		peer->side = 1;
+		spin_unlock(&peer->link_lock);
+		set_bit(RESOLVE_CONFLICTS, &peer->transport.flags);
+		wake_up(&peer->connect_wait);
+
+		spin_lock(&loop_transport->link_lock);
+		loop_transport->link = link;
+		loop_transport->side = 0;
+		spin_unlock(&loop_transport->link_lock);
+		clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+		link = NULL;
+		mutex_unlock(&dtl_waiters_mutex);
+
+		kref_put(&peer_path->kref, drbd_destroy_path);
+	} else {
+		loop_transport->connect_path = drbd_path;
+		kref_get(&drbd_path->kref);
+		list_add_tail(&loop_transport->waiters_list, &dtl_waiters);
+		mutex_unlock(&dtl_waiters_mutex);
+
+		dtl_put_link(link);
+		link = NULL;
+
+		wait_event_interruptible_timeout(loop_transport->connect_wait,
+				READ_ONCE(loop_transport->link),
+				connect_int * HZ);
+
+		/* the peer might have found us just now */
+		dtl_leave_waiters(loop_transport);
+		if (!READ_ONCE(loop_transport->link)) {
+			/* flushes signals, the caller checks the rest */
+			drbd_should_abort_listening(transport);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+			return -EAGAIN;
+		}
+	}
+
+	drbd_path->established = true;
+	drbd_path_event(transport, drbd_path);
+	loop_transport->path = drbd_path; /* keeps the reference */
+
+	return 0;
+}
+
+static bool dtl_chunk_due(struct dtl_chunk *chunk)
+{
+	return !ktime_before(ktime_get(), chunk->due);
+}
+
+/* Is there something the receiver may look at? */
+static bool dtl_rx_ready(struct dtl_pipe *pipe)
+{
+	struct dtl_chunk *chunk;
+	bool ready;
+
+	spin_lock_bh(&pipe->lock);
+	chunk = list_first_entry_or_null(&pipe->chunks, struct dtl_chunk, list);
+	ready = pipe->closed || (chunk && dtl_chunk_due(chunk));
+	spin_unlock_bh(&pipe->lock);
+
+	return ready;
+}
+
+/* Copy out of the pipe, waiting for data unless MSG_DONTWAIT.
+ * Returns the number of bytes copied, 0 if the peer closed the link,
+ * -EAGAIN if the receive timeout expired, -EINTR on a signal. */
+static int dtl_recv_short(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			  void *buf, size_t size, int flags)
+{
+	struct dtl_link *link;
+	struct dtl_pipe *pipe;
+	long timeout = loop_transport->rcvtimeo[stream];
+	size_t copied = 0;
+	int err = 0;
+
+	if (!flags)
+		flags = MSG_WAITALL | MSG_NOSIGNAL;
+
+	link = dtl_get_link(loop_transport);
+	if (!link)
+		return -ENOTCONN;
+	pipe = dtl_rx_pipe(loop_transport, link, stream);
+
+	while (copied < size) {
+		struct dtl_chunk *chunk;
+		unsigned int len;
+		void *data;
+
+		spin_lock_bh(&pipe->lock);
+		chunk = list_first_entry_or_null(&pipe->chunks, struct dtl_chunk, list);
+		if (!chunk || !dtl_chunk_due(chunk)) {
+			bool closed = pipe->closed;
+			long slice = timeout, left;
+
+			if (chunk) {
+				/* Nobody wakes us when it becomes due */
+				s64 ns = ktime_to_ns(ktime_sub(chunk->due, ktime_get()));
+
+				slice = min_t(long, timeout, nsecs_to_jiffies(max_t(s64, ns, 0)) + 1);
+			}
+			spin_unlock_bh(&pipe->lock);
+			if (closed || (flags & MSG_DONTWAIT) || (copied && !(flags & MSG_WAITALL))) {
+				if (!copied && !closed)
+					err = -EAGAIN;
+				break;
+			}
+			left = wait_event_interruptible_timeout(pipe->wait, dtl_rx_ready(pipe), slice);
+			if (left < 0) {
+				err = -EINTR;
+				break;
+			}
+			if (timeout != MAX_SCHEDULE_TIMEOUT)
+				timeout -= slice - left;
+			if (timeout == 0) {
+				err = -EAGAIN;
+				break;
+			}
+			continue;
+		}
+
+		/* We are the only reader of this pipe, the chunk stays. */
+		spin_unlock_bh(&pipe->lock);
+		len = min_t(size_t, chunk->size, size - copied);
+		data = kmap_atomic(chunk->page);
+		memcpy(buf + copied, data + chunk->offset, len);
+		kunmap_atomic(data);
+		copied += len;
+
+		spin_lock_bh(&pipe->lock);
+		chunk->offset += len;
+		chunk->size -= len;
+		pipe->queued -= len;
+		dtl_update_congested(pipe);
+		if (pipe->sender)
+			drbd_transport_send_done(pipe->sender);
+		if (chunk->size == 0)
+			list_del(&chunk->list);
+		else
+			chunk = NULL;
+		spin_unlock_bh(&pipe->lock);
+
+		if (chunk)
+			dtl_free_chunk(chunk);
+		wake_up(&pipe->wait);
+	}
+
+	dtl_put_link(link);
+
+	return copied ? copied : err;
+}
+
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == loop_transport->rbuf[stream].base);
+		buffer = loop_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = loop_transport->rbuf[stream].base;
+
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		loop_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct page *page;
+	int err;
+
+	if (!dtl_stream_ok(transport, DATA_STREAM))
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dtl_recv_short(loop_transport, DATA_STREAM, data, len, 0);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err < 0)
+			goto fail;
+		if (err != len) {
+			err = -EIO;
+			goto fail;
+		}
+		size -= len;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_link *link = dtl_get_link(loop_transport);
+
+	if (link) {
+		struct dtl_pipe *tx = dtl_tx_pipe(loop_transport, link, DATA_STREAM);
+		struct dtl_pipe *rx = dtl_rx_pipe(loop_transport, link, DATA_STREAM);
+
+		stats->unread_received = READ_ONCE(rx->queued);
+		stats->unacked_send = READ_ONCE(tx->queued);
+		stats->send_buffer_size = loop_transport->sndbuf_size;
+		stats->send_buffer_used = READ_ONCE(tx->queued);
+		dtl_put_link(link);
+	}
+}
+
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	loop_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	return loop_transport->rcvtimeo[stream];
+}
+
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_link *link = dtl_get_link(loop_transport);
+	bool ok = false;
+
+	if (link) {
+		ok = !READ_ONCE(dtl_tx_pipe(loop_transport, link, stream)->closed);
+		dtl_put_link(link);
+	}
+
+	return ok;
+}
+
+static bool dtl_tx_space(struct drbd_loop_transport *loop_transport, struct dtl_pipe *pipe)
+{
+	return pipe->closed || pipe->queued < loop_transport->sndbuf_size;
+}
+
+/* Called with pipe->lock held, when chunks are queued or consumed.
+ * As with dtt_update_congested(), only the DATA_STREAM counts. */
+static void dtl_update_congested(struct dtl_pipe *pipe)
+{
+	struct drbd_loop_transport *loop_transport;
+
+	if (!pipe->sender)
+		return;
+
+	loop_transport = container_of(pipe->sender, struct drbd_loop_transport, transport);
+	if (pipe->queued > loop_transport->sndbuf_size / 5 * 4)
+		set_bit(NET_CONGESTED, &pipe->sender->flags);
+	else
+		clear_bit(NET_CONGESTED, &pipe->sender->flags);
+}
+
+static u32 dtl_random(struct dtl_pipe *pipe)
+{
+	pipe->random_state = pipe->random_state * 1664525 + 1013904223;
+	return pipe->random_state >> 8;
+}
+
+/* When the receiver may see a chunk of size bytes sent now.
+ * Called with pipe->lock held, in the order the chunks get queued. */
+static ktime_t dtl_emulate_wan(struct dtl_pipe *pipe, enum drbd_stream stream, size_t size)
+{
+	u32 rate_kib = READ_ONCE(dtl_emu.rate_kib);
+	u32 jitter_us = READ_ONCE(dtl_emu.jitter_us);
+	u32 loss_permille = READ_ONCE(dtl_emu.loss_permille);
+	u32 reorder_permille = READ_ONCE(dtl_emu.reorder_permille);
+	u32 stall_period_ms = READ_ONCE(dtl_emu.stall_period_ms);
+	u32 stall_ms = READ_ONCE(dtl_emu.stall_ms);
+	ktime_t now = ktime_get();
+	ktime_t due = now;
+
+	if (rate_kib) {
+		ktime_t start = ktime_after(pipe->wire_free, now) ? pipe->wire_free : now;
+
+		pipe->wire_free = ktime_add_ns(start,
+			div_u64((u64)size * NSEC_PER_SEC, (u64)rate_kib * 1024));
+		due = pipe->wire_free;
+	}
+
+	due = ktime_add_us(due, READ_ONCE(dtl_emu.delay_us));
+	if (jitter_us)
+		due = ktime_add_us(due, dtl_random(pipe) % (jitter_us + 1));
+	if (loss_permille && dtl_random(pipe) % 1000 < loss_permille) {
+		due = ktime_add_ms(due, READ_ONCE(dtl_emu.loss_delay_ms));
+		pipe->lost++;
+	}
+	if (stream == CONTROL_STREAM && reorder_permille &&
+	    dtl_random(pipe) % 1000 < reorder_permille) {
+		due = ktime_add_us(due, READ_ONCE(dtl_emu.reorder_us));
+		pipe->reordered++;
+	}
+	if (stall_period_ms && stall_ms) {
+		u32 pos;
+
+		div_u64_rem(ktime_to_ms(due), stall_period_ms, &pos);
+		if (pos < stall_ms) {
+			due = ktime_add_ms(due, stall_ms - pos);
+			pipe->stalled++;
+		}
+	}
+
+	/* TCP delivers a stream in order, so do we */
+	if (ktime_before(due, pipe->last_due))
+		due = pipe->last_due;
+	pipe->last_due = due;
+
+	return due;
+}
+
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_chunk *chunk;
+	struct dtl_link *link;
+	struct dtl_pipe *pipe;
+	int err = 0;
+
+	link = dtl_get_link(loop_transport);
+	if (!link)
+		return -ENOTCONN;
+	pipe = dtl_tx_pipe(loop_transport, link, stream);
+
+	chunk = kmalloc(sizeof(*chunk), GFP_NOIO);
+	if (!chunk) {
+		err = -ENOMEM;
+		goto out;
+	}
+	get_page(page);
+	chunk->page = page;
+	chunk->offset = offset;
+	chunk->size = size;
+
+	spin_lock_bh(&pipe->lock);
+	while (!dtl_tx_space(loop_transport, pipe)) {
+		long t;
+
+		spin_unlock_bh(&pipe->lock);
+		t = wait_event_timeout(pipe->wait, dtl_tx_space(loop_transport, pipe),
+				       loop_transport->sndtimeo);
+		if (!t && drbd_stream_send_timed_out(transport, stream)) {
+			dtl_free_chunk(chunk);
+			err = -EAGAIN;
+			goto out;
+		}
+		spin_lock_bh(&pipe->lock);
+	}
+	if (pipe->closed) {
+		spin_unlock_bh(&pipe->lock);
+		dtl_free_chunk(chunk);
+		err = -ECONNRESET;
+		goto out;
+	}
+	chunk->due = dtl_emulate_wan(pipe, stream, size);
+	list_add_tail(&chunk->list, &pipe->chunks);
+	pipe->queued += size;
+	pipe->bytes += size;
+	pipe->chunks_total++;
+	dtl_update_congested(pipe);
+	spin_unlock_bh(&pipe->lock);
+	wake_up(&pipe->wait);
+out:
+	dtl_put_link(link);
+	return err;
+}
+
+static int dtl_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtl_send_page(transport, DATA_STREAM, bvec.bv_page,
+				    bvec.bv_offset, bvec.bv_len,
+				    bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	/* Everything is delivered right away, there is nothing to cork,
+	 * to push or to acknowledge early. */
+	return dtl_stream_ok(transport, stream);
+}
+
+static void dtl_debugfs_show_pipe(struct seq_file *m, const char *what, struct dtl_pipe *pipe)
+{
+	seq_printf(m, "%s queued: %u Byte\n", what, READ_ONCE(pipe->queued));
+	seq_printf(m, "%s total: %llu Byte in %llu chunks\n", what,
+		   (unsigned long long)pipe->bytes, (unsigned long long)pipe->chunks_total);
+	seq_printf(m, "%s emulated: %llu lost, %llu reordered, %llu stalled\n", what,
+		   (unsigned long long)pipe->lost, (unsigned long long)pipe->reordered,
+		   (unsigned long long)pipe->stalled);
+}
+
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_link *link;
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 1);
+
+	link = dtl_get_link(loop_transport);
+	if (!link)
+		return;
+
+	seq_printf(m, "side: %d\nsend buffer size: %u Byte\n",
+		   loop_transport->side, loop_transport->sndbuf_size);
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		dtl_debugfs_show_pipe(m, "send", dtl_tx_pipe(loop_transport, link, i));
+		dtl_debugfs_show_pipe(m, "receive", dtl_rx_pipe(loop_transport, link, i));
+	}
+	dtl_put_link(link);
+}
+
+static int dtl_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	drbd_path->established = false;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_add(&drbd_path->list, &transport->paths);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtl_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static void dtl_debugfs_init(void)
+{
+	struct dentry *root;
+
+	root = debugfs_create_dir("drbd_transport_loop", NULL);
+	if (IS_ERR_OR_NULL(root))
+		return;
+	dtl_debugfs_root = root;
+
+	debugfs_create_u32("delay_us", 0644, root, &dtl_emu.delay_us);
+	debugfs_create_u32("jitter_us", 0644, root, &dtl_emu.jitter_us);
+	debugfs_create_u32("rate_kib", 0644, root, &dtl_emu.rate_kib);
+	debugfs_create_u32("loss_permille", 0644, root, &dtl_emu.loss_permille);
+	debugfs_create_u32("loss_delay_ms", 0644, root, &dtl_emu.loss_delay_ms);
+	debugfs_create_u32("reorder_permille", 0644, root, &dtl_emu.reorder_permille);
+	debugfs_create_u32("reorder_us", 0644, root, &dtl_emu.reorder_us);
+	debugfs_create_u32("stall_period_ms", 0644, root, &dtl_emu.stall_period_ms);
+	debugfs_create_u32("stall_ms", 0644, root, &dtl_emu.stall_ms);
+	debugfs_create_u32("seed", 0644, root, &dtl_emu.seed);
+}
+
+static int __init dtl_initialize(void)
+{
+	int err;
+
+	err = drbd_register_transport_class(&loop_transport_class,
+					    DRBD_TRANSPORT_API_VERSION,
+					    sizeof(struct drbd_transport));
+	if (!err)
+		dtl_debugfs_init();
+	return err;
+}
+
+static void __exit dtl_cleanup(void)
+{
+	debugfs_remove_recursive(dtl_debugfs_root);
+	drbd_unregister_transport_class(&loop_transport_class);
+}
+
+module_init(dtl_initialize)
+module_exit(dtl_cleanup)
@@ -21,6 +21,7 @@
 #include <linux/drbd_config.h>
 #include <drbd_protocol.h>
 #include <drbd_transport.h>
+#include <drbd_transport_ext.h>
 #include "drbd_wrappers.h"
 
 
@@ -44,6 +45,7 @@ struct drbd_tcp_transport {
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	void (*original_sk_write_space)(struct sock *sk);
 };
 
 struct dtt_listener {
@@ -181,6 +183,38 @@ fail:
 	return -ENOMEM;
 }
 
+/* The DATA_STREAM got space because the peer acknowledged data */
+static void dtt_write_space(struct sock *sk)
+{
+	struct drbd_tcp_transport *tcp_transport = sk->sk_user_data;
+
+	tcp_transport->original_sk_write_space(sk);
+	drbd_transport_send_done(&tcp_transport->transport);
+}
+
+static void dtt_register_write_space(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+{
+	struct sock *sk = socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	tcp_transport->original_sk_write_space = sk->sk_write_space;
+	sk->sk_user_data = tcp_transport;
+	sk->sk_write_space = dtt_write_space;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void dtt_unregister_write_space(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+{
+	struct sock *sk = socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_write_space == dtt_write_space) {
+		sk->sk_write_space = tcp_transport->original_sk_write_space;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
 static void dtt_free_one_sock(struct socket *socket)
 {
 	if (socket) {
@@ -199,6 +233,9 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 	/* free the socket specific stuff,
 	 * mutexes are handled by caller */
 
+	if (tcp_transport->stream[DATA_STREAM])
+		dtt_unregister_write_space(tcp_transport, tcp_transport->stream[DATA_STREAM]);
+
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		if (tcp_transport->stream[i]) {
 			dtt_free_one_sock(tcp_transport->stream[i]);
@@ -1050,6 +1087,7 @@ randomize:
 	dtt_nodelay(dsocket);
 	dtt_nodelay(csocket);
 
+	dtt_register_write_space(tcp_transport, dsocket);
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
 